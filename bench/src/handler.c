@@ -0,0 +1,481 @@
+/*
+ * This file is part of gru-http, an HTTP server.
+ * Copyright (C) 2024  Joe Desmond
+ *
+ * gru-http is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * gru-http is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with gru-http.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Measures the CPU cost of handling a request, without any sockets. It runs `handle_http_req` on
+// requests of different shapes in memory, then `try_get_resource` on parsed requests as the
+// number of files grows, then `get_content_type` on different extensions. The static files are
+// made up in memory, so nothing is read from disk. Run with `make bench-handler`.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "files.h"
+#include "http.h"
+#include "latency.h"
+#include "status.h"
+
+// How many times each request in the corpus is handled
+#define REQUESTS_PER_CASE   200000
+#define LOOKUPS_PER_RUN     2000000
+#define CALLS_PER_TYPE      2000000
+// The number of different parsed requests that the lookups cycle through
+#define NUM_QUERIES         4096
+#define QUERY_BUF_SIZE      512
+// Every file was last modified at the same time, before any of the dates in the corpus
+#define SITE_MTIME          1700000000
+
+struct request_case {
+    const char * name;
+    char * buf;
+    size_t len;
+    // If this isn't zero, the head arrives in two reads, split here
+    size_t split;
+    http_status_code expected;
+};
+
+static const char curl_request[] =
+    "GET / HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "User-Agent: curl/8.5.0\r\n"
+    "Accept: */*\r\n"
+    "\r\n";
+
+static const char browser_script_request[] =
+    "GET /assets/js/app.3f9a1c.js HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) "
+        "Chrome/124.0.0.0 Safari/537.36\r\n"
+    "sec-ch-ua-platform: \"Windows\"\r\n"
+    "Accept: */*\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Dest: script\r\n"
+    "Referer: https://www.example.com/index.html\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "Cookie: session=8c1f0e2b9d4a47f6a3e5c7b1d2f4a6c8; theme=dark; _ga=GA1.2.1234567890.1700000000\r\n"
+    "\r\n";
+
+static const char browser_document_request[] =
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:125.0) Gecko/20100101 Firefox/125.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Connection: keep-alive\r\n"
+    "Referer: https://www.example.com/\r\n"
+    "Cookie: session=8c1f0e2b9d4a47f6a3e5c7b1d2f4a6c8; theme=dark\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-User: ?1\r\n"
+    "Priority: u=0, i\r\n"
+    "\r\n";
+
+static const char browser_image_request[] =
+    "GET /img/hero-1920.jpg HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Accept: image/webp,image/avif,image/jxl,image/heic,image/heic-sequence,video/*;q=0.8,"
+        "image/png,image/svg+xml,image/*;q=0.8,*/*;q=0.5\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "User-Agent: Mozilla/5.0 (Macintosh; Intel Mac OS X 10_15_7) AppleWebKit/605.1.15 "
+        "(KHTML, like Gecko) Version/17.4.1 Safari/605.1.15\r\n"
+    "Referer: https://www.example.com/index.html\r\n"
+    "Sec-Fetch-Dest: image\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "Priority: u=5, i\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n";
+
+// The file's ETag is filled in once it's been made
+static const char revalidate_format[] =
+    "GET /style.css HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:125.0) Gecko/20100101 Firefox/125.0\r\n"
+    "Accept: text/css,*/*;q=0.1\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Referer: https://www.example.com/index.html\r\n"
+    "If-Modified-Since: Tue, 14 Nov 2023 22:13:20 GMT\r\n"
+    "If-None-Match: %s\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "\r\n";
+
+static const char range_request[] =
+    "GET /img/hero-1920.jpg HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:125.0) Gecko/20100101 Firefox/125.0\r\n"
+    "Range: bytes=1024-2047\r\n"
+    "\r\n";
+
+static const char head_request[] =
+    "HEAD /style.css HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "User-Agent: curl/8.5.0\r\n"
+    "Accept: */*\r\n"
+    "\r\n";
+
+static const char http10_request[] = "GET /index.html HTTP/1.0\r\n\r\n";
+
+static const char missing_request[] =
+    "GET /wp-login.php HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (compatible; scanner/1.0)\r\n"
+    "\r\n";
+
+static const char bad_method_request[] =
+    "BREW /pot HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "\r\n";
+
+static const char bad_version_request[] =
+    "GET / HTTP/2.0\r\n"
+    "Host: www.example.com\r\n"
+    "\r\n";
+
+static const char bad_field_request[] =
+    "GET / HTTP/1.1\r\n"
+    "Host www.example.com\r\n"
+    "\r\n";
+
+static const char bare_lf_request[] =
+    "GET / HTTP/1.1\n"
+    "Host: www.example.com\n"
+    "\n";
+
+static const char control_char_request[] =
+    "GET /index\x01.html HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "\r\n";
+
+struct site_file {
+    const char * path;
+    size_t size;
+};
+
+static const struct site_file site_files[] = {
+    { "/index.html", 4 * 1024 },
+    { "/style.css", 12 * 1024 },
+    { "/assets/js/app.3f9a1c.js", 64 * 1024 },
+    { "/img/hero-1920.jpg", 256 * 1024 }
+};
+
+static const char * content_type_paths[] = {
+    "/index.html",
+    "/assets/js/app.3f9a1c.js",
+    "/style.css",
+    "/robots.txt",
+    "/img/logo.png",
+    "/img/hero-1920.jpg",
+    "/img/photo.JPEG",
+    "/fonts/inter.woff2",
+    "/LICENSE",
+    "/releases.d/latest"
+};
+
+static const size_t file_counts[] = { 10, 1000, 100000 };
+
+static size_t num_files_made = 0;
+
+static struct file * make_file(const char * path, size_t content_length) {
+    struct file * file = calloc(1, sizeof(struct file));
+    struct tm tm;
+
+    if (! file) {
+        exit(1);
+    }
+
+    file->path_len = snprintf(file->path, sizeof file->path, "%s", path);
+    file->content = malloc(content_length);
+    file->content_allocated = 1;
+    file->fd = -1;
+    file->content_length = content_length;
+
+    if (! file->content) {
+        exit(1);
+    }
+
+    memset(file->content, 'x', content_length);
+    snprintf(file->etag, sizeof file->etag, "\"%016zx\"", ++num_files_made);
+    file->mtime = SITE_MTIME;
+    gmtime_r(&file->mtime, &tm);
+    strftime(file->last_modified, sizeof file->last_modified, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    atomic_init(&file->refs, 1);
+    render_file_heads(file);
+
+    return file;
+}
+
+// Replaces the static files. Nothing else is looking them up, so the old ones can be freed
+// right away.
+static void use_files(struct file_array * files) {
+    struct static_snapshot * old = atomic_exchange(&static_files.snapshot, create_static_snapshot(files));
+
+    if (old) {
+        free_static_snapshot(old);
+    }
+}
+
+static void add_case(struct request_case * cases, size_t * num_cases, const char * name, const char * buf, size_t split, http_status_code expected) {
+    struct request_case * request_case = cases + (*num_cases)++;
+
+    request_case->name = name;
+    request_case->buf = strdup(buf);
+    request_case->len = strlen(buf);
+    request_case->split = split;
+    request_case->expected = expected;
+
+    if (! request_case->buf) {
+        exit(1);
+    }
+}
+
+// Makes a request whose target is `length` bytes long
+static char * make_long_request(size_t length) {
+    static const char start[] = "GET /search?q=";
+    static const char end[] = " HTTP/1.1\r\nHost: www.example.com\r\n\r\n";
+    char * buf = malloc(sizeof start + length + sizeof end);
+
+    if (! buf) {
+        exit(1);
+    }
+
+    memcpy(buf, start, sizeof start - 1);
+
+    for (size_t i = sizeof start - 1; i < length + 4; i++) {
+        buf[i] = 'a' + i % 26;
+    }
+
+    memcpy(buf + length + 4, end, sizeof end);
+
+    return buf;
+}
+
+// Handles the request once, the way a worker would, and returns the response's status
+static http_status_code handle(const struct request_case * request_case) {
+    struct http_req req = create_http_req();
+    struct http_res res = create_http_res();
+
+    if (request_case->split && handle_http_req(request_case->buf, request_case->split, &req, &res)) {
+        printf("Handled the first part of %s as if it were all there\n", request_case->name);
+        exit(1);
+    }
+
+    if (! handle_http_req(request_case->buf, request_case->len, &req, &res)) {
+        printf("Failed to handle %s\n", request_case->name);
+        exit(1);
+    }
+
+    http_status_code status = res.status;
+
+    reset_http_req(&req);
+    reset_http_res(&res);
+
+    return status;
+}
+
+static void bench_requests() {
+    struct request_case cases[32];
+    size_t num_cases = 0;
+    struct file_array files = { 0 };
+    struct file * style = NULL;
+
+    for (size_t i = 0; i < sizeof site_files / sizeof site_files[0]; i++) {
+        struct file * file = make_file(site_files[i].path, site_files[i].size);
+
+        if (! strcmp(file->path, "/style.css")) {
+            style = file;
+        }
+
+        push_file(&files, file);
+    }
+
+    use_files(&files);
+
+    char revalidate_request[sizeof revalidate_format + ETAG_SIZE];
+    char * long_target_request = make_long_request(2048);
+    char * too_long_request = make_long_request(2 * DEFAULT_MAX_HEADER_SIZE);
+
+    // A worker stops reading once it has this much of a head, so this is all it would have
+    too_long_request[DEFAULT_MAX_HEADER_SIZE] = 0;
+    snprintf(revalidate_request, sizeof revalidate_request, revalidate_format, style->etag);
+
+    add_case(cases, &num_cases, "curl", curl_request, 0, HTTP_OK);
+    add_case(cases, &num_cases, "http/1.0", http10_request, 0, HTTP_OK);
+    add_case(cases, &num_cases, "head", head_request, 0, HTTP_OK);
+    add_case(cases, &num_cases, "browser-document", browser_document_request, 0, HTTP_OK);
+    add_case(cases, &num_cases, "browser-script", browser_script_request, 0, HTTP_OK);
+    add_case(cases, &num_cases, "browser-image", browser_image_request, 0, HTTP_OK);
+    add_case(cases, &num_cases, "browser-split", browser_script_request, sizeof browser_script_request / 2, HTTP_OK);
+    add_case(cases, &num_cases, "revalidate", revalidate_request, 0, HTTP_NOT_MODIFIED);
+    add_case(cases, &num_cases, "range", range_request, 0, HTTP_PARTIAL_CONTENT);
+    add_case(cases, &num_cases, "missing", missing_request, 0, HTTP_RESOURCE_NOT_FOUND);
+    add_case(cases, &num_cases, "long-target", long_target_request, 0, HTTP_RESOURCE_NOT_FOUND);
+    add_case(cases, &num_cases, "target-too-long", too_long_request, 0, HTTP_URI_TOO_LONG);
+    add_case(cases, &num_cases, "bad-method", bad_method_request, 0, HTTP_METHOD_NOT_IMPLEMENTED);
+    add_case(cases, &num_cases, "bad-version", bad_version_request, 0, HTTP_VERSION_NOT_SUPPORTED);
+    add_case(cases, &num_cases, "bad-field", bad_field_request, 0, HTTP_BAD_REQUEST);
+    add_case(cases, &num_cases, "bare-lf", bare_lf_request, 0, HTTP_BAD_REQUEST);
+    add_case(cases, &num_cases, "control-char", control_char_request, 0, HTTP_BAD_REQUEST);
+
+    free(long_target_request);
+    free(too_long_request);
+
+    printf("%-18s %8s %8s %14s %10s\n", "request", "bytes", "status", "ns/request", "MB/s");
+
+    for (size_t i = 0; i < num_cases; i++) {
+        const struct request_case * request_case = cases + i;
+        http_status_code status = handle(request_case);
+
+        // A case that doesn't get the status it was written for isn't measuring what it says
+        if (status != request_case->expected) {
+            printf("%s got %d instead of %d\n", request_case->name, status, request_case->expected);
+            exit(1);
+        }
+
+        uint64_t start = now_ns();
+
+        for (size_t j = 0; j < REQUESTS_PER_CASE; j++) {
+            handle(request_case);
+        }
+
+        uint64_t elapsed = now_ns() - start;
+
+        printf(
+            "%-18s %8zu %8d %14.1f %10.1f\n",
+            request_case->name,
+            request_case->len,
+            status,
+            (double) elapsed / REQUESTS_PER_CASE,
+            (double) request_case->len * REQUESTS_PER_CASE / elapsed * 1000
+        );
+
+        free(request_case->buf);
+    }
+}
+
+static void bench_lookups() {
+    char (* bufs)[QUERY_BUF_SIZE] = malloc(NUM_QUERIES * QUERY_BUF_SIZE);
+    struct http_req * reqs = malloc(NUM_QUERIES * sizeof(struct http_req));
+
+    if (! bufs || ! reqs) {
+        exit(1);
+    }
+
+    printf("\n%10s %14s %10s\n", "files", "ns/lookup", "hits");
+
+    for (size_t i = 0; i < sizeof file_counts / sizeof file_counts[0]; i++) {
+        size_t num_files = file_counts[i];
+        struct file_array files = { 0 };
+        char path[256];
+
+        for (size_t j = 0; j < num_files; j++) {
+            snprintf(path, sizeof path, "/assets/%03zu/file-%06zu.js", j % 97, j);
+            push_file(&files, make_file(path, 256));
+        }
+
+        use_files(&files);
+
+        // One in eight requests is for a file that doesn't exist
+        for (size_t j = 0; j < NUM_QUERIES; j++) {
+            size_t n = rand() % num_files;
+            struct http_res res = create_http_res();
+            int len = snprintf(
+                bufs[j],
+                QUERY_BUF_SIZE,
+                "GET /assets/%03zu/%s-%06zu.js HTTP/1.1\r\nHost: www.example.com\r\nAccept-Encoding: gzip, deflate, br\r\n\r\n",
+                n % 97,
+                j % 8 == 7 ? "missing" : "file",
+                n
+            );
+
+            reqs[j] = create_http_req();
+
+            if (! handle_http_req(bufs[j], len, reqs + j, &res)) {
+                printf("Failed to parse lookup request\n");
+                exit(1);
+            }
+
+            reset_http_res(&res);
+        }
+
+        size_t hits = 0;
+        uint64_t start = now_ns();
+
+        for (size_t j = 0; j < LOOKUPS_PER_RUN; j++) {
+            struct http_res res = create_http_res();
+
+            hits += ! try_get_resource(bufs[j % NUM_QUERIES], &res, reqs + j % NUM_QUERIES);
+            reset_http_res(&res);
+        }
+
+        uint64_t elapsed = now_ns() - start;
+
+        printf("%10zu %14.1f %10zu\n", num_files, (double) elapsed / LOOKUPS_PER_RUN, hits);
+
+        for (size_t j = 0; j < NUM_QUERIES; j++) {
+            reset_http_req(reqs + j);
+        }
+    }
+
+    free(bufs);
+    free(reqs);
+}
+
+static void bench_content_types() {
+    printf("\n%-26s %-26s %10s\n", "path", "content type", "ns/call");
+
+    for (size_t i = 0; i < sizeof content_type_paths / sizeof content_type_paths[0]; i++) {
+        const char * path = content_type_paths[i];
+        size_t total = 0;
+        uint64_t start = now_ns();
+
+        for (size_t j = 0; j < CALLS_PER_TYPE; j++) {
+            total += strlen(get_content_type(path));
+        }
+
+        uint64_t elapsed = now_ns() - start;
+
+        // Using `total` keeps the calls from being optimized away
+        printf("%-26s %-26s %10.1f\n", path, total ? get_content_type(path) : "", (double) elapsed / CALLS_PER_TYPE);
+    }
+}
+
+int main(int argc, char ** argv) {
+    struct file_array no_files = { 0 };
+
+    srand(1);
+    use_files(&no_files);
+    init_error_responses();
+
+    bench_requests();
+    bench_lookups();
+    bench_content_types();
+
+    free_error_responses();
+    free_static_snapshot(atomic_exchange(&static_files.snapshot, NULL));
+
+    return 0;
+}
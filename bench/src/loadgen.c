@@ -0,0 +1,996 @@
+/*
+ * This file is part of gru-http, an HTTP server.
+ * Copyright (C) 2024  Joe Desmond
+ *
+ * gru-http is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * gru-http is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with gru-http.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// A load generator that measures the server's throughput and latency over loopback. It makes a
+// small site in a temporary directory, starts the server on it, and runs each scenario against
+// it with a few client threads, each driving its own connections from an epoll loop.
+//
+// In a closed-loop scenario, every connection sends its next request as soon as it has the
+// response to the last one, so the request rate is whatever the server can keep up with. In an
+// open-loop scenario, requests are started at a fixed rate whether or not the server has kept
+// up. Their latency is measured from when they were supposed to start, so a server that falls
+// behind isn't flattered by the requests that were never sent.
+//
+// Results are printed as a table, and with --output, written as JSON lines that can be compared
+// between builds. Run with `make bench`.
+
+#define _GNU_SOURCE
+#include <argp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "latency.h"
+
+#define MAX_CONNECTIONS         4096
+#define MAX_THREADS             64
+#define MAX_URLS                1024
+#define MAX_URL_LENGTH          2048
+#define HEAD_BUF_SIZE           8192
+#define DISCARD_BUF_SIZE        (256 * 1024)
+#define EPOLL_MAX_EVENTS        256
+#define SERVER_START_TIMEOUT_MS 60000
+
+struct scenario {
+    const char * name;
+    size_t connections;
+    // Requests per second across every connection, or 0 for a closed loop
+    double rate;
+    int keep_alive;
+};
+
+static const struct scenario default_scenarios[] = {
+    { "closed-keepalive", 64, 0, 1 },
+    { "closed-close", 16, 0, 0 },
+    { "open-keepalive", 64, 5000, 1 }
+};
+
+// The site that's made for the server. Text files are filled with repeating markup, so that
+// they compress like real ones, and the rest with random bytes.
+struct site_file {
+    const char * path;
+    size_t size;
+    int is_text;
+};
+
+static const struct site_file site_files[] = {
+    { "index.html", 2 * 1024, 1 },
+    { "style.css", 12 * 1024, 1 },
+    { "app.js", 48 * 1024, 1 },
+    { "img/logo.png", 6 * 1024, 0 },
+    { "img/photo.jpg", 256 * 1024, 0 }
+};
+
+// The default request mix, weighted by repetition
+static const char * default_urls[] = {
+    "/", "/", "/", "/",
+    "/style.css", "/style.css",
+    "/app.js", "/app.js",
+    "/img/logo.png", "/img/logo.png",
+    "/img/photo.jpg",
+    "/missing.html"
+};
+
+enum client_state {
+    // No request in flight. The socket may still be open if the connection is persistent.
+    Idle,
+    Sending,
+    ReadingHead,
+    ReadingBody
+};
+
+struct client_conn {
+    int fd;
+    enum client_state state;
+    const char * req;
+    size_t req_len;
+    size_t sent;
+    size_t head_len;
+    size_t body_left;
+    int status;
+    // When the request started, or for an open loop, when it was supposed to
+    uint64_t start_ns;
+    char head[HEAD_BUF_SIZE];
+};
+
+struct client_thread {
+    pthread_t thread;
+    size_t index;
+    const struct scenario * scenario;
+    int epoll_fd;
+    struct client_conn * conns;
+    size_t num_conns;
+    // Connections without a request in flight, for an open loop
+    struct client_conn ** idle;
+    size_t num_idle;
+    size_t next_url;
+    uint64_t end_ns;
+    // For an open loop: the time between requests, and when the next one is due
+    uint64_t interval_ns;
+    uint64_t next_due_ns;
+    char * discard_buf;
+
+    struct latency_histogram latency;
+    size_t completed;
+    size_t non_2xx;
+    size_t errors;
+    size_t bytes;
+};
+
+struct options {
+    const char * server;
+    const char * url_file;
+    const char * output;
+    const char * workers;
+    const char * backend;
+    size_t threads;
+    double duration_s;
+    struct scenario custom;
+    int has_custom;
+};
+
+static struct options options = {
+    .threads = 2,
+    .duration_s = 5,
+    .custom = { "custom", 64, 0, 1 }
+};
+
+static struct sockaddr_in server_addr;
+// A request for each URL, with and without keep-alive
+static char * keep_alive_reqs[MAX_URLS];
+static char * close_reqs[MAX_URLS];
+static size_t num_urls = 0;
+
+static void fail(const char * msg) {
+    perror(msg);
+    exit(1);
+}
+
+static int open_client_socket() {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (fd == -1) {
+        return -1;
+    }
+
+    const int one = 1;
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+
+    if (connect(fd, (struct sockaddr *) &server_addr, sizeof server_addr) == -1 && errno != EINPROGRESS) {
+        close(fd);
+
+        return -1;
+    }
+
+    return fd;
+}
+
+static void close_conn(struct client_thread * thread, struct client_conn * conn) {
+    if (thread->scenario->keep_alive) {
+        close(conn->fd);
+    } else {
+        // Reset instead of leaving the port in TIME_WAIT, or a long run would use them all up
+        struct linger linger = { .l_onoff = 1, .l_linger = 0 };
+
+        setsockopt(conn->fd, SOL_SOCKET, SO_LINGER, &linger, sizeof linger);
+        close(conn->fd);
+    }
+
+    conn->fd = -1;
+}
+
+static void make_idle(struct client_thread * thread, struct client_conn * conn) {
+    conn->state = Idle;
+
+    if (thread->interval_ns) {
+        thread->idle[thread->num_idle++] = conn;
+    }
+}
+
+static void drive_conn(struct client_thread * thread, struct client_conn * conn);
+
+static void start_request(struct client_thread * thread, struct client_conn * conn, uint64_t start_ns) {
+    size_t url = thread->next_url++ % num_urls;
+
+    conn->req = thread->scenario->keep_alive ? keep_alive_reqs[url] : close_reqs[url];
+    conn->req_len = strlen(conn->req);
+    conn->sent = 0;
+    conn->head_len = 0;
+    conn->start_ns = start_ns;
+    conn->state = Sending;
+
+    if (conn->fd == -1) {
+        conn->fd = open_client_socket();
+
+        struct epoll_event event = {
+            .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+            .data = {
+                .ptr = conn
+            }
+        };
+
+        if (conn->fd == -1 || epoll_ctl(thread->epoll_fd, EPOLL_CTL_ADD, conn->fd, &event) == -1) {
+            if (conn->fd != -1) {
+                close_conn(thread, conn);
+            }
+
+            thread->errors++;
+            make_idle(thread, conn);
+
+            return;
+        }
+    }
+
+    drive_conn(thread, conn);
+}
+
+static void fail_request(struct client_thread * thread, struct client_conn * conn) {
+    thread->errors++;
+    close_conn(thread, conn);
+    make_idle(thread, conn);
+
+    // A closed loop starts over right away, unless the run is over
+    if (! thread->interval_ns && now_ns() < thread->end_ns) {
+        start_request(thread, conn, now_ns());
+    }
+}
+
+static void finish_request(struct client_thread * thread, struct client_conn * conn) {
+    uint64_t now = now_ns();
+
+    record_latency(&thread->latency, now - conn->start_ns);
+    thread->completed++;
+
+    if (conn->status < 200 || conn->status > 299) {
+        thread->non_2xx++;
+    }
+
+    if (! thread->scenario->keep_alive) {
+        close_conn(thread, conn);
+    }
+
+    make_idle(thread, conn);
+
+    if (! thread->interval_ns && now < thread->end_ns) {
+        start_request(thread, conn, now);
+    }
+}
+
+// Parses the response head once it's all there. Returns 1 if the head is done, 0 if there's more
+// to read, or -1 if it isn't a response we understand.
+static int parse_head(struct client_thread * thread, struct client_conn * conn, size_t prev_len) {
+    size_t search_from = prev_len > 3 ? prev_len - 3 : 0;
+    char * end = memmem(conn->head + search_from, conn->head_len - search_from, "\r\n\r\n", 4);
+
+    if (! end) {
+        return conn->head_len == HEAD_BUF_SIZE - 1 ? -1 : 0;
+    }
+
+    *end = 0;
+
+    if (strncmp(conn->head, "HTTP/1.", 7) || conn->head_len < 12) {
+        return -1;
+    }
+
+    conn->status = atoi(conn->head + 9);
+
+    const char * length_header = strcasestr(conn->head, "\r\nContent-Length:");
+
+    if (! length_header) {
+        return -1;
+    }
+
+    size_t content_length = strtoull(length_header + 17, NULL, 10);
+    size_t head_size = end + 4 - conn->head;
+    size_t body_read = conn->head_len - head_size;
+
+    if (body_read > content_length) {
+        return -1;
+    }
+
+    conn->body_left = content_length - body_read;
+    thread->bytes += conn->head_len;
+
+    return 1;
+}
+
+// Moves the connection along until it has to wait for the socket
+static void drive_conn(struct client_thread * thread, struct client_conn * conn) {
+    while (1) {
+        switch (conn->state) {
+            case Idle: {
+                return;
+            }
+            case Sending: {
+                ssize_t sent = send(conn->fd, conn->req + conn->sent, conn->req_len - conn->sent, MSG_NOSIGNAL);
+
+                if (sent == -1) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOTCONN || errno == EINTR) {
+                        return;
+                    }
+
+                    fail_request(thread, conn);
+
+                    return;
+                }
+
+                conn->sent += sent;
+
+                if (conn->sent == conn->req_len) {
+                    conn->state = ReadingHead;
+                }
+
+                break;
+            }
+            case ReadingHead: {
+                size_t prev_len = conn->head_len;
+                ssize_t bytes = read(conn->fd, conn->head + conn->head_len, HEAD_BUF_SIZE - 1 - conn->head_len);
+
+                if (bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                    return;
+                }
+
+                if (bytes <= 0) {
+                    fail_request(thread, conn);
+
+                    return;
+                }
+
+                conn->head_len += bytes;
+
+                int status = parse_head(thread, conn, prev_len);
+
+                if (status == -1) {
+                    fail_request(thread, conn);
+
+                    return;
+                }
+
+                if (status == 1) {
+                    if (conn->body_left) {
+                        conn->state = ReadingBody;
+                    } else {
+                        finish_request(thread, conn);
+
+                        return;
+                    }
+                }
+
+                break;
+            }
+            case ReadingBody: {
+                size_t want = conn->body_left < DISCARD_BUF_SIZE ? conn->body_left : DISCARD_BUF_SIZE;
+                ssize_t bytes = read(conn->fd, thread->discard_buf, want);
+
+                if (bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                    return;
+                }
+
+                if (bytes <= 0) {
+                    fail_request(thread, conn);
+
+                    return;
+                }
+
+                conn->body_left -= bytes;
+                thread->bytes += bytes;
+
+                if (! conn->body_left) {
+                    finish_request(thread, conn);
+
+                    return;
+                }
+
+                break;
+            }
+        }
+    }
+}
+
+static void handle_event(struct client_thread * thread, struct client_conn * conn, uint32_t events) {
+    if (conn->state == Idle) {
+        // The server closed a persistent connection between requests
+        if (conn->fd != -1 && (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+            close_conn(thread, conn);
+        }
+
+        return;
+    }
+
+    drive_conn(thread, conn);
+}
+
+static void * run_client_thread(void * arg) {
+    struct client_thread * thread = arg;
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    uint64_t now = now_ns();
+
+    thread->next_due_ns = now;
+
+    for (size_t i = 0; i < thread->num_conns; i++) {
+        struct client_conn * conn = thread->conns + i;
+
+        conn->fd = -1;
+
+        if (thread->interval_ns) {
+            make_idle(thread, conn);
+        } else {
+            start_request(thread, conn, now);
+        }
+    }
+
+    while ((now = now_ns()) < thread->end_ns) {
+        uint64_t wake_ns = thread->end_ns;
+
+        if (thread->interval_ns) {
+            while (thread->num_idle && thread->next_due_ns <= now) {
+                struct client_conn * conn = thread->idle[--thread->num_idle];
+
+                start_request(thread, conn, thread->next_due_ns);
+                thread->next_due_ns += thread->interval_ns;
+            }
+
+            if (thread->num_idle && thread->next_due_ns < wake_ns) {
+                wake_ns = thread->next_due_ns;
+            }
+        }
+
+        uint64_t timeout_ns = wake_ns > now ? wake_ns - now : 0;
+        struct timespec timeout = {
+            .tv_sec = timeout_ns / 1000000000,
+            .tv_nsec = timeout_ns % 1000000000
+        };
+        int num_events = epoll_pwait2(thread->epoll_fd, events, EPOLL_MAX_EVENTS, &timeout, NULL);
+
+        if (num_events == -1) {
+            if (errno != EINTR) {
+                fail("Failed to wait for epoll events");
+            }
+
+            continue;
+        }
+
+        for (int i = 0; i < num_events; i++) {
+            handle_event(thread, events[i].data.ptr, events[i].events);
+        }
+    }
+
+    // Anything still in flight didn't finish in time, and isn't counted
+    for (size_t i = 0; i < thread->num_conns; i++) {
+        if (thread->conns[i].fd != -1) {
+            close_conn(thread, thread->conns + i);
+        }
+    }
+
+    return NULL;
+}
+
+struct result {
+    double elapsed_s;
+    size_t completed;
+    size_t non_2xx;
+    size_t errors;
+    size_t bytes;
+    struct latency_totals latency;
+};
+
+static void run_scenario(const struct scenario * scenario, struct result * result) {
+    size_t num_threads = options.threads < scenario->connections ? options.threads : scenario->connections;
+    struct client_thread * threads = calloc(num_threads, sizeof(struct client_thread));
+
+    if (! threads) {
+        fail("Failed to allocate client threads");
+    }
+
+    uint64_t start = now_ns();
+    uint64_t end = start + (uint64_t) (options.duration_s * 1e9);
+
+    for (size_t i = 0; i < num_threads; i++) {
+        struct client_thread * thread = threads + i;
+
+        thread->index = i;
+        thread->scenario = scenario;
+        thread->num_conns = scenario->connections / num_threads + (i < scenario->connections % num_threads);
+        thread->conns = calloc(thread->num_conns, sizeof(struct client_conn));
+        thread->idle = calloc(thread->num_conns, sizeof(struct client_conn *));
+        thread->discard_buf = malloc(DISCARD_BUF_SIZE);
+        thread->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        // Start each thread at a different point in the mix
+        thread->next_url = i * num_urls / num_threads;
+        thread->end_ns = end;
+        thread->interval_ns = scenario->rate ? (uint64_t) (1e9 * num_threads / scenario->rate) : 0;
+
+        if (! thread->conns || ! thread->idle || ! thread->discard_buf || thread->epoll_fd == -1) {
+            fail("Failed to set up client thread");
+        }
+
+        int status = pthread_create(&thread->thread, NULL, run_client_thread, thread);
+
+        if (status) {
+            errno = status;
+            fail("Failed to start client thread");
+        }
+    }
+
+    *result = (struct result) { 0 };
+
+    for (size_t i = 0; i < num_threads; i++) {
+        struct client_thread * thread = threads + i;
+
+        pthread_join(thread->thread, NULL);
+
+        result->completed += thread->completed;
+        result->non_2xx += thread->non_2xx;
+        result->errors += thread->errors;
+        result->bytes += thread->bytes;
+        add_latency_totals(&result->latency, &thread->latency);
+
+        close(thread->epoll_fd);
+        free(thread->conns);
+        free(thread->idle);
+        free(thread->discard_buf);
+    }
+
+    result->elapsed_s = (now_ns() - start) / 1e9;
+    free(threads);
+}
+
+static void print_result(const struct scenario * scenario, const struct result * result) {
+    const struct latency_totals * latency = &result->latency;
+
+    printf(
+        "%-18s %6zu %8.0f %5s %10zu %10.0f %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f %10.1f %7zu %7zu\n",
+        scenario->name,
+        scenario->connections,
+        scenario->rate,
+        scenario->keep_alive ? "yes" : "no",
+        result->completed,
+        result->completed / result->elapsed_s,
+        result->bytes / result->elapsed_s / (1024 * 1024),
+        latency->count ? latency->sum_ns / 1000.0 / latency->count : 0.0,
+        get_latency_quantile(latency, 0.5) / 1000.0,
+        get_latency_quantile(latency, 0.9) / 1000.0,
+        get_latency_quantile(latency, 0.99) / 1000.0,
+        get_latency_quantile(latency, 0.999) / 1000.0,
+        latency->max_ns / 1000.0,
+        result->non_2xx,
+        result->errors
+    );
+    fflush(stdout);
+}
+
+static void write_result(FILE * out, const struct scenario * scenario, const struct result * result) {
+    const struct latency_totals * latency = &result->latency;
+
+    fprintf(
+        out,
+        "{\"scenario\":\"%s\",\"connections\":%zu,\"threads\":%zu,\"rate\":%.0f,\"keep_alive\":%s,"
+        "\"duration_s\":%.3f,\"requests\":%zu,\"non_2xx\":%zu,\"errors\":%zu,"
+        "\"requests_per_s\":%.1f,\"mib_per_s\":%.3f,"
+        "\"latency_us\":{\"mean\":%.1f,\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}}\n",
+        scenario->name,
+        scenario->connections,
+        options.threads < scenario->connections ? options.threads : scenario->connections,
+        scenario->rate,
+        scenario->keep_alive ? "true" : "false",
+        result->elapsed_s,
+        result->completed,
+        result->non_2xx,
+        result->errors,
+        result->completed / result->elapsed_s,
+        result->bytes / result->elapsed_s / (1024 * 1024),
+        latency->count ? latency->sum_ns / 1000.0 / latency->count : 0.0,
+        get_latency_quantile(latency, 0.5) / 1000.0,
+        get_latency_quantile(latency, 0.9) / 1000.0,
+        get_latency_quantile(latency, 0.99) / 1000.0,
+        get_latency_quantile(latency, 0.999) / 1000.0,
+        latency->max_ns / 1000.0
+    );
+    fflush(out);
+}
+
+static void add_url(const char * url) {
+    if (num_urls == MAX_URLS) {
+        printf("Too many URLs, the limit is %d\n", MAX_URLS);
+        exit(1);
+    }
+
+    const char * format = "GET %s HTTP/1.1\r\nHost: 127.0.0.1\r\nUser-Agent: gru-http-loadgen\r\n%s\r\n";
+
+    if (asprintf(&keep_alive_reqs[num_urls], format, url, "") == -1
+        || asprintf(&close_reqs[num_urls], format, url, "Connection: close\r\n") == -1) {
+        fail("Failed to format request");
+    }
+
+    num_urls++;
+}
+
+static void load_urls() {
+    if (! options.url_file) {
+        for (size_t i = 0; i < sizeof default_urls / sizeof default_urls[0]; i++) {
+            add_url(default_urls[i]);
+        }
+
+        return;
+    }
+
+    FILE * file = fopen(options.url_file, "r");
+    char line[MAX_URL_LENGTH];
+
+    if (! file) {
+        fail("Failed to open URL list");
+    }
+
+    while (fgets(line, sizeof line, file)) {
+        line[strcspn(line, "\r\n")] = 0;
+
+        // Skip blank lines and comments
+        if (line[0] == '/') {
+            add_url(line);
+        }
+    }
+
+    fclose(file);
+
+    if (! num_urls) {
+        printf("The URL list has no paths in it\n");
+        exit(1);
+    }
+}
+
+static void make_site(const char * dir) {
+    char path[4096];
+    char * buf = malloc(256 * 1024);
+    static const char markup[] =
+        "<div class=\"card\"><h2 class=\"title\">Product</h2><p class=\"desc\">A short description "
+        "of the product goes here.</p><a href=\"/products/item.html\">Details</a></div>\n";
+
+    if (! buf) {
+        fail("Failed to allocate site file");
+    }
+
+    snprintf(path, sizeof path, "%s/img", dir);
+
+    if (mkdir(path, 0755) == -1) {
+        fail("Failed to make site directory");
+    }
+
+    srand(1);
+
+    for (size_t i = 0; i < sizeof site_files / sizeof site_files[0]; i++) {
+        const struct site_file * file = site_files + i;
+
+        for (size_t j = 0; j < file->size; j++) {
+            buf[j] = file->is_text ? markup[j % (sizeof markup - 1)] : rand();
+        }
+
+        snprintf(path, sizeof path, "%s/%s", dir, file->path);
+
+        FILE * out = fopen(path, "w");
+
+        if (! out || fwrite(buf, 1, file->size, out) != file->size || fclose(out)) {
+            fail("Failed to write site file");
+        }
+    }
+
+    free(buf);
+}
+
+static void remove_site(const char * dir) {
+    char path[4096];
+
+    for (size_t i = 0; i < sizeof site_files / sizeof site_files[0]; i++) {
+        snprintf(path, sizeof path, "%s/%s", dir, site_files[i].path);
+        unlink(path);
+    }
+
+    snprintf(path, sizeof path, "%s/img", dir);
+    rmdir(path);
+    rmdir(dir);
+}
+
+// Returns a port on loopback that nothing is listening on
+static int find_free_port() {
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr = { .s_addr = htonl(INADDR_LOOPBACK) },
+        .sin_port = 0
+    };
+    socklen_t len = sizeof addr;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (fd == -1 || bind(fd, (struct sockaddr *) &addr, sizeof addr) == -1 || getsockname(fd, (struct sockaddr *) &addr, &len) == -1) {
+        fail("Failed to find a free port");
+    }
+
+    close(fd);
+
+    return ntohs(addr.sin_port);
+}
+
+// Starts the server and waits until it accepts connections. Returns a pipe to its stdin.
+static int start_server(const char * dir, int port, pid_t * pid) {
+    int stdin_pipe[2];
+    char port_str[16];
+    const char * argv[16];
+    size_t argc = 0;
+
+    snprintf(port_str, sizeof port_str, "%d", port);
+
+    argv[argc++] = options.server;
+    argv[argc++] = "127.0.0.1";
+    argv[argc++] = port_str;
+    argv[argc++] = dir;
+    argv[argc++] = "--log";
+    argv[argc++] = "off";
+
+    if (options.workers) {
+        argv[argc++] = "--workers";
+        argv[argc++] = options.workers;
+    }
+
+    if (options.backend) {
+        argv[argc++] = "--backend";
+        argv[argc++] = options.backend;
+    }
+
+    argv[argc] = NULL;
+
+    if (pipe2(stdin_pipe, O_CLOEXEC) == -1) {
+        fail("Failed to make a pipe for the server");
+    }
+
+    *pid = fork();
+
+    if (*pid == -1) {
+        fail("Failed to start the server");
+    }
+
+    if (! *pid) {
+        // The connections that are cut off at the end of each run make the server print errors,
+        // which would only get in the way of the results
+        int null_fd = open("/dev/null", O_WRONLY);
+
+        dup2(stdin_pipe[0], STDIN_FILENO);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        execv(options.server, (char * const *) argv);
+        _exit(1);
+    }
+
+    close(stdin_pipe[0]);
+
+    uint64_t deadline = now_ns() + (uint64_t) SERVER_START_TIMEOUT_MS * 1000000;
+
+    while (now_ns() < deadline) {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+        if (fd != -1 && ! connect(fd, (struct sockaddr *) &server_addr, sizeof server_addr)) {
+            close(fd);
+
+            return stdin_pipe[1];
+        }
+
+        close(fd);
+
+        if (waitpid(*pid, NULL, WNOHANG) == *pid) {
+            printf("The server exited before it started listening\n");
+            exit(1);
+        }
+
+        usleep(50 * 1000);
+    }
+
+    printf("The server didn't start listening in time\n");
+    kill(*pid, SIGKILL);
+    exit(1);
+}
+
+static void stop_server(int stdin_fd, pid_t pid) {
+    if (write(stdin_fd, "q\n", 2) != 2) {
+        kill(pid, SIGTERM);
+    }
+
+    close(stdin_fd);
+    waitpid(pid, NULL, 0);
+}
+
+static const char doc[] = "Starts the server at SERVER on loopback with a generated site, and "
+"measures its throughput and latency. With none of --connections, --rate and --no-keep-alive, "
+"runs a closed loop with keep-alive, a closed loop with a new connection per request, and an open "
+"loop at a fixed rate. Otherwise runs one scenario with the given settings.";
+
+static struct argp_option argp_options[] = {
+    { .name = "connections", .key = 'c', .arg = "COUNT", .doc = "Concurrent connections (default 64)" },
+    { .name = "rate", .key = 'r', .arg = "REQS", .doc = "Start REQS requests per second (an open loop) "
+        "instead of sending each connection's next request as soon as it has a response" },
+    { .name = "no-keep-alive", .key = 'K', .doc = "Use a new connection for every request" },
+    { .name = "threads", .key = 't', .arg = "COUNT", .doc = "Client threads (default 2)" },
+    { .name = "duration", .key = 'd', .arg = "SECONDS", .doc = "How long to run each scenario (default 5)" },
+    { .name = "urls", .key = 'u', .arg = "FILE", .doc = "Request the paths in FILE, one per line, in "
+        "order, instead of the default mix" },
+    { .name = "output", .key = 'o', .arg = "FILE", .doc = "Write each scenario's results to FILE as a "
+        "line of JSON" },
+    { .name = "workers", .key = 'w', .arg = "COUNT", .doc = "Passed to the server's --workers" },
+    { .name = "backend", .key = 'b', .arg = "epoll|io_uring", .doc = "Passed to the server's --backend" },
+    { 0 }
+};
+
+static size_t parse_count(const char * arg, size_t max, struct argp_state * state) {
+    char * end;
+    long value = strtol(arg, &end, 10);
+
+    if (*end || value < 1 || (size_t) value > max) {
+        argp_error(state, "Invalid count \"%s\", must be in the range [1, %zu]", arg, max);
+    }
+
+    return value;
+}
+
+static error_t arg_parser(int key, char * arg, struct argp_state * state) {
+    switch (key) {
+        case 'c': {
+            options.custom.connections = parse_count(arg, MAX_CONNECTIONS, state);
+            options.has_custom = 1;
+            break;
+        }
+        case 'r': {
+            options.custom.rate = strtod(arg, NULL);
+            options.has_custom = 1;
+
+            if (options.custom.rate <= 0) {
+                argp_error(state, "Invalid rate \"%s\"", arg);
+            }
+
+            break;
+        }
+        case 'K': {
+            options.custom.keep_alive = 0;
+            options.has_custom = 1;
+            break;
+        }
+        case 't': {
+            options.threads = parse_count(arg, MAX_THREADS, state);
+            break;
+        }
+        case 'd': {
+            options.duration_s = strtod(arg, NULL);
+
+            if (options.duration_s <= 0) {
+                argp_error(state, "Invalid duration \"%s\"", arg);
+            }
+
+            break;
+        }
+        case 'u': {
+            options.url_file = arg;
+            break;
+        }
+        case 'o': {
+            options.output = arg;
+            break;
+        }
+        case 'w': {
+            options.workers = arg;
+            break;
+        }
+        case 'b': {
+            options.backend = arg;
+            break;
+        }
+        case ARGP_KEY_ARG: {
+            if (state->arg_num) {
+                argp_usage(state);
+            }
+
+            options.server = arg;
+            break;
+        }
+        case ARGP_KEY_END: {
+            if (! options.server) {
+                argp_usage(state);
+            }
+
+            break;
+        }
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+
+    return 0;
+}
+
+int main(int argc, char ** argv) {
+    struct argp parser = {
+        .options = argp_options,
+        .parser = arg_parser,
+        .args_doc = "SERVER",
+        .doc = doc
+    };
+
+    argp_parse(&parser, argc, argv, 0, NULL, NULL);
+    load_urls();
+
+    char dir[] = "/tmp/gru-http-loadgen-XXXXXX";
+    FILE * output = NULL;
+
+    if (! mkdtemp(dir)) {
+        fail("Failed to make a directory for the site");
+    }
+
+    if (options.output && ! (output = fopen(options.output, "w"))) {
+        fail("Failed to open output file");
+    }
+
+    make_site(dir);
+
+    int port = find_free_port();
+
+    server_addr = (struct sockaddr_in) {
+        .sin_family = AF_INET,
+        .sin_addr = { .s_addr = htonl(INADDR_LOOPBACK) },
+        .sin_port = htons(port)
+    };
+
+    pid_t server_pid;
+    int server_stdin = start_server(dir, port, &server_pid);
+    const struct scenario * scenarios = options.has_custom ? &options.custom : default_scenarios;
+    size_t num_scenarios = options.has_custom ? 1 : sizeof default_scenarios / sizeof default_scenarios[0];
+
+    printf(
+        "%-18s %6s %8s %5s %10s %10s %8s %8s %8s %8s %8s %8s %10s %7s %7s\n",
+        "scenario", "conns", "rate", "keep", "requests", "req/s", "MiB/s",
+        "mean us", "p50 us", "p90 us", "p99 us", "p99.9 us", "max us", "non-2xx", "errors"
+    );
+
+    for (size_t i = 0; i < num_scenarios; i++) {
+        struct result result;
+
+        run_scenario(scenarios + i, &result);
+        print_result(scenarios + i, &result);
+
+        if (output) {
+            write_result(output, scenarios + i, &result);
+        }
+    }
+
+    stop_server(server_stdin, server_pid);
+    remove_site(dir);
+
+    if (output) {
+        fclose(output);
+    }
+
+    for (size_t i = 0; i < num_urls; i++) {
+        free(keep_alive_reqs[i]);
+        free(close_reqs[i]);
+    }
+
+    return 0;
+}
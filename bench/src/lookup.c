@@ -0,0 +1,164 @@
+/*
+ * This file is part of gru-http, an HTTP server.
+ * Copyright (C) 2024  Joe Desmond
+ *
+ * gru-http is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * gru-http is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with gru-http.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Measures the cost of looking up a static file by path as the number of files grows, comparing
+// a walk of a linked list of files (the old lookup) with the hash index. The files are
+// made up in memory, so nothing is read from disk. Run with `make bench-lookup`.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "files.h"
+
+// Each measurement does about this many string comparisons (for the list) or lookups (for the
+// index), so that the big cases don't take forever
+#define WORK_PER_RUN    20000000
+
+static const size_t file_counts[] = { 10, 100, 1000, 10000, 100000 };
+
+static uint64_t now_ns() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ((uint64_t) ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// How the files used to be kept
+struct file_node {
+    struct file * file;
+    struct file_node * next;
+};
+
+static struct file_node * list;
+static struct static_snapshot * snapshot;
+
+static void make_files(size_t count) {
+    struct file_array files = { 0 };
+    struct file_node * nodes = calloc(count, sizeof(struct file_node));
+
+    if (! nodes) {
+        exit(1);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        struct file * file = calloc(1, sizeof(struct file));
+
+        if (! file) {
+            exit(1);
+        }
+
+        file->path_len = snprintf(file->path, sizeof file->path, "/assets/%03zu/file-%06zu.js", i % 97, i);
+        file->fd = -1;
+        atomic_init(&file->refs, 1);
+        push_file(&files, file);
+
+        nodes[i].file = file;
+        nodes[i].next = i + 1 < count ? nodes + i + 1 : NULL;
+    }
+
+    list = nodes;
+    snapshot = create_static_snapshot(&files);
+}
+
+static void free_files() {
+    free(list);
+    free_static_snapshot(snapshot);
+    list = NULL;
+    snapshot = NULL;
+}
+
+static struct file * find_in_list(const char * path) {
+    for (struct file_node * node = list; node; node = node->next) {
+        if (! strcmp(node->file->path, path)) {
+            return node->file;
+        }
+    }
+
+    return NULL;
+}
+
+// Makes `count` paths to look up. One in eight doesn't exist.
+static char (* make_queries(size_t num_files, size_t count))[256] {
+    char (* queries)[256] = malloc(count * 256);
+
+    if (! queries) {
+        exit(1);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        size_t n = rand() % num_files;
+
+        if (i % 8 == 7) {
+            snprintf(queries[i], 256, "/assets/%03zu/missing-%06zu.js", n % 97, n);
+        } else {
+            snprintf(queries[i], 256, "/assets/%03zu/file-%06zu.js", n % 97, n);
+        }
+    }
+
+    return queries;
+}
+
+int main(int argc, char ** argv) {
+    srand(1);
+
+    printf("%10s %16s %16s %10s\n", "files", "list ns/lookup", "hash ns/lookup", "speedup");
+
+    for (size_t i = 0; i < sizeof file_counts / sizeof file_counts[0]; i++) {
+        size_t num_files = file_counts[i];
+        size_t list_lookups = WORK_PER_RUN / num_files;
+        size_t hash_lookups = WORK_PER_RUN / 4;
+        size_t num_queries = list_lookups > hash_lookups ? list_lookups : hash_lookups;
+
+        if (num_queries > 1 << 16) {
+            num_queries = 1 << 16;
+        }
+
+        make_files(num_files);
+
+        char (* queries)[256] = make_queries(num_files, num_queries);
+        size_t found = 0;
+
+        uint64_t start = now_ns();
+
+        for (size_t j = 0; j < list_lookups; j++) {
+            found += find_in_list(queries[j % num_queries]) != NULL;
+        }
+
+        double list_ns = (double) (now_ns() - start) / list_lookups;
+
+        start = now_ns();
+
+        for (size_t j = 0; j < hash_lookups; j++) {
+            const char * query = queries[j % num_queries];
+
+            found += find_static_file(snapshot, query, strlen(query)) != NULL;
+        }
+
+        double hash_ns = (double) (now_ns() - start) / hash_lookups;
+
+        // Printing `found` keeps the lookups from being optimized away
+        printf("%10zu %16.1f %16.1f %9.1fx  (%zu hits)\n", num_files, list_ns, hash_ns, list_ns / hash_ns, found);
+
+        free(queries);
+        free_files();
+    }
+
+    return 0;
+}
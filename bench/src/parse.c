@@ -0,0 +1,164 @@
+/*
+ * This file is part of gru-http, an HTTP server.
+ * Copyright (C) 2024  Joe Desmond
+ *
+ * gru-http is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * gru-http is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with gru-http.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Measures how long it takes to parse the kind of requests that browsers send, with each level
+// of the request scanners that the CPU supports. The static directory is empty, so every
+// request gets a canned 404 and almost all of the time goes to parsing. Run with
+// `make bench-parse`.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "files.h"
+#include "http.h"
+#include "scan.h"
+#include "status.h"
+
+#define PARSES_PER_RUN  2000000
+
+static const char * requests[] = {
+    "GET /assets/js/app.3f9a1c.js HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) "
+        "Chrome/124.0.0.0 Safari/537.36\r\n"
+    "sec-ch-ua-platform: \"Windows\"\r\n"
+    "Accept: */*\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Dest: script\r\n"
+    "Referer: https://www.example.com/products/index.html\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "Cookie: session=8c1f0e2b9d4a47f6a3e5c7b1d2f4a6c8; theme=dark; _ga=GA1.2.1234567890.1700000000\r\n"
+    "If-None-Match: \"5d8c72a5b9e41f03\"\r\n"
+    "\r\n",
+
+    "GET /products/index.html HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:125.0) Gecko/20100101 Firefox/125.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Connection: keep-alive\r\n"
+    "Referer: https://www.example.com/\r\n"
+    "Cookie: session=8c1f0e2b9d4a47f6a3e5c7b1d2f4a6c8; theme=dark\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-User: ?1\r\n"
+    "If-Modified-Since: Tue, 14 May 2024 09:21:44 GMT\r\n"
+    "Priority: u=0, i\r\n"
+    "\r\n",
+
+    "GET /img/hero-1920.jpg HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Accept: image/webp,image/avif,image/jxl,image/heic,image/heic-sequence,video/*;q=0.8,"
+        "image/png,image/svg+xml,image/*;q=0.8,*/*;q=0.5\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "User-Agent: Mozilla/5.0 (Macintosh; Intel Mac OS X 10_15_7) AppleWebKit/605.1.15 "
+        "(KHTML, like Gecko) Version/17.4.1 Safari/605.1.15\r\n"
+    "Referer: https://www.example.com/products/index.html\r\n"
+    "Sec-Fetch-Dest: image\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "Priority: u=5, i\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n"
+};
+
+#define NUM_REQUESTS (sizeof requests / sizeof requests[0])
+
+static uint64_t now_ns() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ((uint64_t) ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// Parses a request and checks that the whole head was understood
+static void parse(const char * buf, size_t len) {
+    struct http_req req = create_http_req();
+    struct http_res res = create_http_res();
+
+    if (! handle_http_req(buf, len, &req, &res) || req.seek != len || res.status != HTTP_RESOURCE_NOT_FOUND) {
+        printf("Failed to parse request with the %s scanners\n", scan_level_names[get_scan_level()]);
+        exit(1);
+    }
+
+    reset_http_req(&req);
+    reset_http_res(&res);
+}
+
+int main(int argc, char ** argv) {
+    char dir[] = "/tmp/gru-http-bench-XXXXXX";
+    size_t lens[NUM_REQUESTS];
+    size_t total_len = 0;
+    double scalar_ns = 0;
+
+    if (! mkdtemp(dir)) {
+        perror("Failed to make an empty static directory");
+        return 1;
+    }
+
+    load_static_dir(dir);
+    init_error_responses();
+
+    for (size_t i = 0; i < NUM_REQUESTS; i++) {
+        lens[i] = strlen(requests[i]);
+        total_len += lens[i];
+    }
+
+    printf("%10s %16s %10s %10s\n", "scanners", "ns/request", "MB/s", "speedup");
+
+    for (int level = ScanScalar; level < NUM_SCAN_LEVELS; level++) {
+        if (use_scan_level(level)) {
+            printf("%10s %16s\n", scan_level_names[level], "(unsupported)");
+            continue;
+        }
+
+        uint64_t start = now_ns();
+
+        for (size_t i = 0; i < PARSES_PER_RUN; i++) {
+            parse(requests[i % NUM_REQUESTS], lens[i % NUM_REQUESTS]);
+        }
+
+        uint64_t elapsed = now_ns() - start;
+        double ns = (double) elapsed / PARSES_PER_RUN;
+        double bytes = (double) total_len / NUM_REQUESTS * PARSES_PER_RUN;
+
+        if (level == ScanScalar) {
+            scalar_ns = ns;
+        }
+
+        printf("%10s %16.1f %10.1f %9.2fx\n", scan_level_names[level], ns, bytes / elapsed * 1000, scalar_ns / ns);
+    }
+
+    free_error_responses();
+    free_static_dir();
+    rmdir(dir);
+
+    return 0;
+}
@@ -0,0 +1,109 @@
+/*
+ * This file is part of gru-http, an HTTP server.
+ * Copyright (C) 2024  Joe Desmond
+ *
+ * gru-http is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * gru-http is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with gru-http.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Generates a perfect hash of the request header names in src/req_headers.def, and prints it as
+// a header for the parser. It looks for the smallest table, and the first multiplier for that
+// size, that puts every name in its own slot. The make targets run it to produce
+// src/req_header_hash.h.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "header_key.h"
+
+#define MAX_BITS        10
+#define MAX_ATTEMPTS    1000000
+
+static const char * names[] = {
+#define REQ_HEADER(id, name) name,
+#include "req_headers.def"
+#undef REQ_HEADER
+};
+
+#define NUM_NAMES (sizeof names / sizeof names[0])
+
+// Fills `slots` with the index of the name in each slot, or -1. Returns nonzero if two names
+// land in the same slot.
+static int try_multiplier(uint32_t multiplier, int bits, int slots[1 << MAX_BITS]) {
+    for (size_t i = 0; i < ((size_t) 1 << bits); i++) {
+        slots[i] = -1;
+    }
+
+    for (size_t i = 0; i < NUM_NAMES; i++) {
+        size_t slot = header_slot(header_key(names[i], strlen(names[i])), multiplier, bits);
+
+        if (slots[slot] != -1) {
+            return -1;
+        }
+
+        slots[slot] = i;
+    }
+
+    return 0;
+}
+
+static void print_table(uint32_t multiplier, int bits, int slots[1 << MAX_BITS]) {
+    printf("// Generated from src/req_headers.def by gen/src/header_hash.c. Don't edit.\n");
+    printf("#ifndef SRC_REQ_HEADER_HASH_H\n");
+    printf("#define SRC_REQ_HEADER_HASH_H\n\n");
+    printf("#define REQ_HEADER_HASH_MULTIPLIER  0x%08xu\n", multiplier);
+    printf("#define REQ_HEADER_HASH_BITS        %d\n\n", bits);
+    printf("// The known header in each slot, or -1\n");
+    printf("static const signed char req_header_slots[1 << REQ_HEADER_HASH_BITS] = {");
+
+    for (size_t i = 0; i < ((size_t) 1 << bits); i++) {
+        printf("%s%d", i % 16 ? ", " : (i ? ",\n    " : "\n    "), slots[i]);
+    }
+
+    printf("\n};\n\n");
+    printf("static const unsigned char req_header_lengths[] = {");
+
+    for (size_t i = 0; i < NUM_NAMES; i++) {
+        printf("%s%zu", i ? ", " : "\n    ", strlen(names[i]));
+    }
+
+    printf("\n};\n\n#endif\n");
+}
+
+int main() {
+    static int slots[1 << MAX_BITS];
+    int bits = 1;
+
+    while (((size_t) 1 << bits) < NUM_NAMES) {
+        bits++;
+    }
+
+    for (; bits <= MAX_BITS; bits++) {
+        // Odd multipliers from a fixed sequence, so that the output is the same every time
+        uint32_t multiplier = 0x9e3779b1;
+
+        for (int attempt = 0; attempt < MAX_ATTEMPTS; attempt++) {
+            if (! try_multiplier(multiplier, bits, slots)) {
+                print_table(multiplier, bits, slots);
+
+                return 0;
+            }
+
+            multiplier = (multiplier * 1664525 + 1013904223) | 1;
+        }
+    }
+
+    fprintf(stderr, "Couldn't find a perfect hash of the request header names\n");
+
+    return 1;
+}
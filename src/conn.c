@@ -0,0 +1,296 @@
+/*
+ * This file is part of gru-http, an HTTP server.
+ * Copyright (C) 2024  Joe Desmond
+ *
+ * gru-http is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * gru-http is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with gru-http.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "params.h"
+#include "conn.h"
+#include "http.h"
+#include "latency.h"
+#include "log.h"
+#include "status.h"
+
+void log_http_req(struct http_req * req, const char * in_buf) {
+    struct log_record record;
+
+    begin_log_record(&record);
+
+    if (req->target.offset) {
+        append_log_record(
+            &record,
+            "-> %s %.*s\n",
+            http_method_names[req->method],
+            (int) req->target.length,
+            in_buf + req->target.offset
+        );
+
+        for (size_t i = 0; i < REQ_HEADER_MAX; i++) {
+            struct http_slice value = req->headers.known[i];
+
+            if (value.offset) {
+                append_log_record(&record, "\t\t %s: %.*s\n", req_header_names[i], (int) value.length, in_buf + value.offset);
+            }
+        }
+    } else {
+        append_log_record(&record, "-> %s (Undefined target)\n", http_method_names[req->method]);
+    }
+
+    commit_log_record(&record);
+}
+
+void log_http_res(struct http_res * res) {
+    struct log_record record;
+
+    begin_log_record(&record);
+    append_log_record(&record, "<- %d %s\n", res->status, http_status_names[res->status]);
+
+    if (res->head_block) {
+        // Skip the status line, and stop before the empty line at the end
+        const char * line = memchr(res->head_block, '\n', res->head_block_length) + 1;
+        const char * end = res->head_block + res->head_block_length - 2;
+
+        while (line < end) {
+            const char * line_end = memchr(line, '\r', end - line);
+
+            append_log_record(&record, "\t\t %.*s\n", (int) (line_end - line), line);
+            line = line_end + 2;
+        }
+    }
+
+    for (size_t i = 0; i < RES_HEADER_MAX; i++) {
+        if (res->headers.headers[i]) {
+            append_log_record(&record, "\t\t %s: %s\n", res_header_names[i], res->headers.headers[i]);
+        }
+    }
+
+    commit_log_record(&record);
+}
+
+void log_access(struct http_req * req, const char * in_buf, struct http_res * res) {
+    struct log_record record;
+
+    begin_log_record(&record);
+    append_log_record(
+        &record,
+        "%s %.*s %d %zu",
+        http_method_names[req->method],
+        req->target.offset ? (int) req->target.length : 1,
+        req->target.offset ? in_buf + req->target.offset : "-",
+        res->status,
+        res->bytes_sent
+    );
+    commit_log_record(&record);
+}
+
+uint64_t now_ms() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ((uint64_t) ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+void list_push_back(struct connection_list * list, struct connection * conn) {
+    conn->next = NULL;
+    conn->prev = list->tail;
+
+    if (list->tail) {
+        list->tail->next = conn;
+    } else {
+        list->head = conn;
+    }
+
+    list->tail = conn;
+}
+
+void list_remove(struct connection_list * list, struct connection * conn) {
+    if (conn->prev) {
+        conn->prev->next = conn->next;
+    } else {
+        list->head = conn->next;
+    }
+
+    if (conn->next) {
+        conn->next->prev = conn->prev;
+    } else {
+        list->tail = conn->prev;
+    }
+
+    conn->prev = NULL;
+    conn->next = NULL;
+}
+
+void list_insert_by_deadline(struct connection_list * list, struct connection * conn) {
+    struct connection * before = list->tail;
+
+    while (before && before->deadline_ms > conn->deadline_ms) {
+        before = before->prev;
+    }
+
+    if (! before) {
+        conn->prev = NULL;
+        conn->next = list->head;
+
+        if (list->head) {
+            list->head->prev = conn;
+        } else {
+            list->tail = conn;
+        }
+
+        list->head = conn;
+
+        return;
+    }
+
+    conn->prev = before;
+    conn->next = before->next;
+
+    if (before->next) {
+        before->next->prev = conn;
+    } else {
+        list->tail = conn;
+    }
+
+    before->next = conn;
+}
+
+struct connection * create_connection(int peer_fd) {
+    struct connection * conn = malloc(sizeof(struct connection));
+
+    if (! conn) {
+        return NULL;
+    }
+
+    conn->recv_buf = malloc(INITIAL_RECV_BUF_SIZE);
+
+    if (! conn->recv_buf) {
+        free(conn);
+
+        return NULL;
+    }
+
+    conn->fd = peer_fd;
+    conn->state = ReadingRequest;
+    conn->req = create_http_req();
+    conn->res = create_http_res();
+    conn->deadline_ms = 0;
+    conn->prev = NULL;
+    conn->next = NULL;
+    conn->discard_len = 0;
+    conn->recv_len = 0;
+    conn->recv_cap = INITIAL_RECV_BUF_SIZE;
+    conn->recv_buf[0] = 0;
+    conn->pending_ops = 0;
+    conn->fd_closed = 0;
+
+    return conn;
+}
+
+void free_connection(struct connection * conn) {
+    reset_http_req(&conn->req);
+    reset_http_res(&conn->res);
+    free(conn->recv_buf);
+    free(conn);
+}
+
+void consume_recv_buf(struct connection * conn, size_t len) {
+    memmove(conn->recv_buf, conn->recv_buf + len, conn->recv_len - len);
+    conn->recv_len -= len;
+    conn->recv_buf[conn->recv_len] = 0;
+}
+
+// Throws away as much of the previous request's body as we have.
+static void discard_body(struct connection * conn) {
+    size_t len = conn->discard_len < conn->recv_len ? conn->discard_len : conn->recv_len;
+
+    consume_recv_buf(conn, len);
+    conn->discard_len -= len;
+}
+
+size_t reserve_recv_buf(struct connection * conn) {
+    if (conn->recv_len + 1 == conn->recv_cap) {
+        // The buffer never has to hold more than one request head (plus the null terminator),
+        // because we stop reading as soon as we have a whole head
+        size_t max_cap = global_options.max_header_size + 1;
+        size_t new_cap = conn->recv_cap * 2 < max_cap ? conn->recv_cap * 2 : max_cap;
+        char * new_buf = new_cap > conn->recv_cap ? realloc(conn->recv_buf, new_cap) : NULL;
+
+        if (! new_buf) {
+            return 0;
+        }
+
+        conn->recv_buf = new_buf;
+        conn->recv_cap = new_cap;
+    }
+
+    return conn->recv_cap - 1 - conn->recv_len;
+}
+
+void commit_recv_buf(struct connection * conn, size_t len) {
+    conn->recv_len += len;
+    conn->recv_buf[conn->recv_len] = 0;
+    discard_body(conn);
+}
+
+int parse_request(struct connection * conn) {
+    if (conn->discard_len || ! handle_http_req(conn->recv_buf, conn->recv_len, &conn->req, &conn->res)) {
+        return 0;
+    }
+
+#ifdef DEBUG_PRINT_RAW_REQ
+    write(1, conn->recv_buf, conn->req.seek);
+#endif
+    if (log_enabled(LogVerbose)) {
+        log_http_req(&conn->req, conn->recv_buf);
+    }
+
+    if (! fmt_http_res_head(&conn->res, conn->res_head, RES_HEAD_BUF_SIZE)) {
+        printf("[Thread %d] Response head is too long\n", gettid());
+
+        return -1;
+    }
+
+    conn->res_ready_ns = now_ns();
+
+    return 1;
+}
+
+int finish_response(struct connection * conn) {
+    if (log_enabled(LogVerbose)) {
+        log_http_res(&conn->res);
+    } else if (log_enabled(LogAccess)) {
+        log_access(&conn->req, conn->recv_buf, &conn->res);
+    }
+
+    if (! conn->res.keep_alive) {
+        return 0;
+    }
+
+    consume_recv_buf(conn, conn->req.seek);
+    conn->discard_len = conn->req.body_length;
+    discard_body(conn);
+
+    reset_http_req(&conn->req);
+    reset_http_res(&conn->res);
+
+    return 1;
+}
@@ -0,0 +1,128 @@
+/*
+ * This file is part of gru-http, an HTTP server.
+ * Copyright (C) 2024  Joe Desmond
+ *
+ * gru-http is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * gru-http is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with gru-http.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef SRC_CONN_H
+#define SRC_CONN_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "params.h"
+#include "http.h"
+
+// Receive buffers start out this big and grow as needed to fit a request head
+#define INITIAL_RECV_BUF_SIZE   2048
+// Big enough for the status line and every response header
+#define RES_HEAD_BUF_SIZE       1024
+#define PRINT_BUF_SIZE          512
+
+enum connection_state {
+    ReadingRequest,
+    WritingResponse,
+    ClosingConnection
+};
+
+// The state of one client connection. This is shared by the I/O backends; each one decides
+// how the bytes get in and out of the buffers.
+struct connection {
+    int fd;
+    enum connection_state state;
+    struct http_req req;
+    struct http_res res;
+
+    // The time (in ms, on the monotonic clock) after which the connection is dropped if the
+    // client still hasn't sent a request, or hasn't taken any more of the response
+    uint64_t deadline_ms;
+    struct connection * prev;
+    struct connection * next;
+
+    // The number of bytes of a request body that still have to be read and thrown away
+    size_t discard_len;
+    // `recv_buf` can hold several pipelined requests. It's always null-terminated at
+    // `recv_len`, and it's only grown when a request head doesn't fit.
+    size_t recv_len;
+    size_t recv_cap;
+    char * recv_buf;
+
+    // The response's status line and headers are serialized here, so that they can be sent
+    // together with the body in one system call
+    char res_head[RES_HEAD_BUF_SIZE];
+    // When the response was ready to send (in ns, on the monotonic clock)
+    uint64_t res_ready_ns;
+
+    // The io_uring backend's SENDMSG arguments, which have to stay put until it completes
+    struct iovec iov[2];
+    struct msghdr msg;
+    // The number of io_uring operations that still refer to this connection. It can't be freed
+    // until this is zero.
+    int pending_ops;
+    // Set once the socket has been closed by a linked close operation
+    int fd_closed;
+};
+
+struct connection_list {
+    struct connection * head;
+    struct connection * tail;
+};
+
+// Returns the current time on the monotonic clock, in milliseconds.
+uint64_t now_ms();
+
+void list_push_back(struct connection_list * list, struct connection * conn);
+void list_remove(struct connection_list * list, struct connection * conn);
+
+// Puts the connection in the list, which is kept sorted by deadline. New deadlines are almost
+// always the latest ones, so we search from the back. The connection must not be in a list
+// already.
+void list_insert_by_deadline(struct connection_list * list, struct connection * conn);
+
+// Returns NULL if the connection couldn't be allocated.
+struct connection * create_connection(int peer_fd);
+
+// Frees the connection and its buffers. This doesn't close the socket.
+void free_connection(struct connection * conn);
+
+// Removes the first `len` bytes from the receive buffer.
+void consume_recv_buf(struct connection * conn, size_t len);
+
+// Makes sure there's free space at the end of the receive buffer, growing it if it's full.
+// Returns the number of bytes that can be read into `recv_buf + recv_len`, or 0 if the buffer
+// can't grow.
+size_t reserve_recv_buf(struct connection * conn);
+
+// Records that `len` bytes were read into the free space at the end of the receive buffer, then
+// throws away as much of the previous request's body as we have.
+void commit_recv_buf(struct connection * conn, size_t len);
+
+// Tries to parse the next request from the receive buffer. Returns 1 if there's a response to
+// send (with its head already serialized), 0 if we have to wait for more data, or -1 if the
+// connection should be closed.
+int parse_request(struct connection * conn);
+
+// Called after the whole response has been sent. If the connection is persistent, moves on to
+// the next request (which may already be in the buffer if the client is pipelining) and returns
+// nonzero. Otherwise returns zero, and the connection should be closed.
+int finish_response(struct connection * conn);
+
+// `in_buf` is the buffer that the request was parsed from.
+void log_http_req(struct http_req * req, const char * in_buf);
+void log_http_res(struct http_res * res);
+// Logs one line with the request's method and target, and the response's status and size
+void log_access(struct http_req * req, const char * in_buf, struct http_res * res);
+
+#endif
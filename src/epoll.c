@@ -0,0 +1,375 @@
+/*
+ * This file is part of gru-http, an HTTP server.
+ * Copyright (C) 2024  Joe Desmond
+ *
+ * gru-http is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * gru-http is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with gru-http.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// The epoll backend. Sockets are handed to the workers by the shard's acceptor thread, and each
+// worker multiplexes its connections over an edge-triggered epoll instance.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include "params.h"
+#include "error.h"
+#include "http.h"
+#include "log.h"
+#include "worker.h"
+
+struct epoll_worker {
+    int epoll_fd;
+};
+
+// Stands in for the connection pointer in epoll events on the shard's `stop_fd`. Events on a
+// shard's `accept_fd` carry a pointer to the shard.
+static char stop_marker;
+
+static void close_connection(struct worker * worker, struct connection * conn) {
+    char print_buf[PRINT_BUF_SIZE];
+
+    list_remove(list_for_state(worker, conn->state), conn);
+
+    log_line(LogVerbose, "Closing socket");
+    // Closing the socket also removes it from the epoll instance
+    int status = shutdown(conn->fd, SHUT_RDWR);
+
+    if (status == -1 && errno != ENOTCONN) {
+        perror("Failed to call 'shutdown' on socket");
+    }
+
+    status = close(conn->fd);
+
+    if (status == -1) {
+        snprintf(print_buf, PRINT_BUF_SIZE, "[Thread %d] Failed to close socket", gettid());
+        perror(print_buf);
+    }
+
+    free_connection(conn);
+    increment_counter(&worker->metrics.connections_closed);
+}
+
+// Reads from the socket into the free space at the end of the receive buffer, growing it first if
+// it's full. Returns the number of bytes read, 0 if the socket would block, and -1 if the
+// connection should be closed.
+static ssize_t read_more(struct worker * worker, struct connection * conn) {
+    char print_buf[PRINT_BUF_SIZE];
+    size_t space = reserve_recv_buf(conn);
+
+    if (! space) {
+        return -1;
+    }
+
+    while (1) {
+        uint64_t start_ns = now_ns();
+        ssize_t bytes_read = read(conn->fd, conn->recv_buf + conn->recv_len, space);
+
+        record_latency(&worker->metrics.latency[PhaseRead], now_ns() - start_ns);
+
+        if (bytes_read > 0) {
+            commit_recv_buf(conn, bytes_read);
+
+            return bytes_read;
+        } else if (bytes_read == 0) {
+            // The client closed its end of the connection
+            return -1;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        } else if (errno != EINTR) {
+            snprintf(print_buf, PRINT_BUF_SIZE, "[Thread %d] Failed to read data from socket", gettid());
+            perror(print_buf);
+
+            return -1;
+        }
+    }
+}
+
+// Feeds the client's data to the parser until we have the next request, reading more as needed.
+// Returns nonzero if the connection changed state, or zero if we have to wait for more data.
+static int read_request(struct worker * worker, struct connection * conn) {
+    while (1) {
+        int parse_status = parse_request(conn);
+
+        if (parse_status) {
+            set_connection_state(worker, conn, parse_status == 1 ? WritingResponse : ClosingConnection);
+
+            return 1;
+        }
+
+        ssize_t status = read_more(worker, conn);
+
+        if (status == -1) {
+            set_connection_state(worker, conn, ClosingConnection);
+
+            return 1;
+        }
+
+        if (! status) {
+            return 0;
+        }
+    }
+}
+
+// Sends the response to the current request. Returns nonzero if the connection changed state,
+// or zero if the socket would block.
+static int write_response(struct worker * worker, struct connection * conn) {
+    size_t bytes_sent = conn->res.bytes_sent;
+    int status = send_http_res(&conn->res, conn->fd);
+
+    if (status == 1) {
+        if (conn->res.bytes_sent != bytes_sent) {
+            extend_send_deadline(worker, conn);
+        }
+
+        // We'll get another event when the socket is writable again
+        return 0;
+    }
+
+    if (status == -1) {
+        set_connection_state(worker, conn, ClosingConnection);
+
+        return 1;
+    }
+
+    record_response(&worker->metrics, conn);
+
+    if (! finish_response(conn)) {
+        set_connection_state(worker, conn, ClosingConnection);
+
+        return 1;
+    }
+
+    list_remove(&worker->sending, conn);
+    wait_for_request(worker, conn, KEEP_ALIVE_TIMEOUT_MS);
+
+    return 1;
+}
+
+// Advances the connection's state machine as far as it can go without blocking. With
+// edge-triggered events we have to keep going until the socket would block, otherwise we may
+// never be told about the data that's left.
+static void drive_connection(struct worker * worker, struct connection * conn) {
+    while (1) {
+        switch (conn->state) {
+            case ReadingRequest: {
+                if (! read_request(worker, conn)) {
+                    return;
+                }
+
+                break;
+            }
+            case WritingResponse: {
+                if (! write_response(worker, conn)) {
+                    return;
+                }
+
+                break;
+            }
+            case ClosingConnection: {
+                close_connection(worker, conn);
+
+                return;
+            }
+        }
+    }
+}
+
+static void add_connection(struct worker * worker, int peer_fd) {
+    struct epoll_worker * ew = worker->backend_data;
+    struct connection * conn = create_connection(peer_fd);
+
+    if (! conn) {
+        perror("Failed to allocate connection");
+        close(peer_fd);
+
+        return;
+    }
+
+    increment_counter(&worker->metrics.connections_opened);
+    wait_for_request(worker, conn, POLL_TIMEOUT_MS);
+
+    struct epoll_event event = {
+        .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+        .data = {
+            .ptr = conn
+        }
+    };
+
+    if (epoll_ctl(ew->epoll_fd, EPOLL_CTL_ADD, conn->fd, &event) == -1) {
+        perror("Failed to add socket to epoll instance");
+        close_connection(worker, conn);
+    }
+}
+
+// Takes accepted sockets off the shared queue and adds them to the worker's epoll instance.
+// Each successful read of the semaphore eventfd entitles the worker to exactly one socket, so
+// workers never take more connections than they were woken for.
+static void take_accepted_connections(struct worker * worker) {
+    struct shard * shard = worker->shard;
+
+    for (size_t i = 0; i < ACCEPT_BATCH_SIZE; i++) {
+        uint64_t count;
+
+        if (read(shard->accept_fd, &count, sizeof count) == -1) {
+            if (errno != EAGAIN) {
+                perror("Failed to read accept queue eventfd");
+            }
+
+            return;
+        }
+
+        int peer_fd;
+        uint64_t accepted_ns;
+
+        // The acceptor pushes to the queue before it signals the eventfd, so the socket is
+        // already there
+        while (fd_queue_pop(&shard->accept_queue, &peer_fd, &accepted_ns)) {
+            sched_yield();
+        }
+
+        record_latency(&worker->metrics.latency[PhaseAccept], now_ns() - accepted_ns);
+        add_connection(worker, peer_fd);
+    }
+}
+
+// Drops connections whose clients haven't sent a request, or taken any more of a response, in
+// time. Returns the number of milliseconds until the next connection's deadline, or -1 if no
+// connection has one.
+static int expire_connections(struct worker * worker) {
+    uint64_t now = now_ms();
+
+    while (worker->waiting.head && worker->waiting.head->deadline_ms <= now) {
+        log_line(LogVerbose, "Timed out while waiting for request");
+        close_connection(worker, worker->waiting.head);
+    }
+
+    while (worker->sending.head && worker->sending.head->deadline_ms <= now) {
+        log_line(LogVerbose, "Timed out while sending response");
+        close_connection(worker, worker->sending.head);
+    }
+
+    return get_next_timeout(worker, now);
+}
+
+static void * run_epoll_worker(void * worker_ptr) {
+    struct worker * worker = worker_ptr;
+    struct epoll_worker * ew = worker->backend_data;
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+
+    name_worker_thread(worker);
+    register_static_reader(&worker->reader);
+
+    int stop = 0;
+
+    while (! stop) {
+        int timeout = expire_connections(worker);
+
+        static_reader_offline(&worker->reader);
+        uint64_t wait_start_ns = now_ns();
+        int num_events = epoll_wait(ew->epoll_fd, events, EPOLL_MAX_EVENTS, timeout);
+        record_latency(&worker->metrics.latency[PhaseWait], now_ns() - wait_start_ns);
+        static_reader_online(&worker->reader);
+
+        if (num_events == -1) {
+            if (errno != EINTR) {
+                perror("Failed to wait for epoll events");
+            }
+
+            continue;
+        }
+
+        for (int i = 0; i < num_events; i++) {
+            if (events[i].data.ptr == &stop_marker) {
+                stop = 1;
+            } else if (events[i].data.ptr == worker->shard) {
+                take_accepted_connections(worker);
+            } else {
+                drive_connection(worker, events[i].data.ptr);
+            }
+        }
+    }
+
+    while (worker->waiting.head) {
+        close_connection(worker, worker->waiting.head);
+    }
+
+    while (worker->sending.head) {
+        close_connection(worker, worker->sending.head);
+    }
+
+    while (worker->closing.head) {
+        close_connection(worker, worker->closing.head);
+    }
+
+    unregister_static_reader(&worker->reader);
+
+    return NULL;
+}
+
+static void add_to_epoll(int epoll_fd, int fd, uint32_t events, void * ptr) {
+    struct epoll_event event = {
+        .events = events,
+        .data = {
+            .ptr = ptr
+        }
+    };
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        die();
+    }
+}
+
+static int probe_epoll() {
+    return 0;
+}
+
+static void init_epoll_worker(struct worker * worker) {
+    struct epoll_worker * ew = malloc(sizeof(struct epoll_worker));
+
+    if (! ew) {
+        die();
+    }
+
+    ew->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+    if (ew->epoll_fd == -1) {
+        die();
+    }
+
+    add_to_epoll(ew->epoll_fd, worker->shard->accept_fd, EPOLLIN | EPOLLEXCLUSIVE, worker->shard);
+    add_to_epoll(ew->epoll_fd, worker->shard->stop_fd, EPOLLIN, &stop_marker);
+
+    worker->backend_data = ew;
+}
+
+static void free_epoll_worker(struct worker * worker) {
+    struct epoll_worker * ew = worker->backend_data;
+
+    close(ew->epoll_fd);
+    free(ew);
+    worker->backend_data = NULL;
+}
+
+const struct net_backend epoll_backend = {
+    .name = "epoll",
+    .uses_acceptor = 1,
+    .probe = probe_epoll,
+    .init_worker = init_epoll_worker,
+    .run_worker = run_epoll_worker,
+    .free_worker = free_epoll_worker
+};
@@ -17,298 +17,963 @@
  */
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
+#include <zlib.h>
+#include <brotli/encode.h>
 #include "error.h"
 #include "files.h"
+#include "http.h"
+#include "watch.h"
 
-struct http_static_dir static_files;
+struct http_static_dir static_files = {
+    .root = NULL,
+    .root_fd = -1,
+    .snapshot = NULL
+};
 
-struct dir_stack {
-    char path[PATH_MAX];
+// The seed and prime of the 64-bit FNV-1a hash, which is used for paths and small files
+#define FNV_OFFSET          0xcbf29ce484222325ULL
+#define FNV_PRIME           0x100000001b3ULL
+
+// How long the thread that swaps snapshots sleeps between checks on a reader that's still using
+// the old one
+#define READER_POLL_NS      (1000 * 1000)
+
+const char * content_encoding_names[NUM_ENCODINGS] = {
+    [Brotli] = "br",
+    [Gzip] = "gzip"
+};
+
+// The suffixes of precompressed files, indexed by encoding
+static const char * const encoding_suffixes[NUM_ENCODINGS] = {
+    [Brotli] = ".br",
+    [Gzip] = ".gz"
+};
+
+// Files with these extensions are compressed at load time
+static const char * const compressible_extensions[] = {
+    "html", "htm", "css", "js", "mjs", "json", "map", "svg", "xml", "txt", "csv", "md"
+};
+
+// Incremented every time a snapshot is swapped out. Starts at 1 because 0 means offline.
+static atomic_uint_fast64_t snapshot_epoch = 1;
+
+static pthread_mutex_t readers_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct static_reader * readers = NULL;
+
+// Set while the thread is copying out of a mapped file, so that the SIGBUS it gets if the file
+// was truncated can be caught
+static _Thread_local sigjmp_buf * volatile mapped_read_guard = NULL;
+
+// A directory that still has to be scanned. `fd` is open, and `path` is the path that the
+// directory is served at, relative to the root (empty for the root itself).
+struct dir_job {
+    int fd;
     size_t path_len;
-    struct dir_stack * next;
+    char path[PATH_MAX];
+    struct dir_job * next;
+};
+
+// Shared by the threads that load a directory tree
+struct dir_loader {
+    pthread_mutex_t lock;
+    // Signalled when a directory is queued, and broadcast once there's nothing left to do
+    pthread_cond_t cond;
+    struct dir_job * jobs;
+    // The number of directories that are queued or being scanned. A thread that finds the queue
+    // empty has to wait until this is zero, because the directories being scanned may still
+    // have subdirectories.
+    size_t pending;
+};
+
+struct loader_thread {
+    pthread_t thread;
+    struct dir_loader * loader;
+    // The files that this thread loaded, so that the threads don't contend on one array
+    struct file_array files;
 };
 
-static size_t path_join(char * restrict first, char * restrict second, size_t first_len) {
-    size_t second_len = strlen(second);
-    size_t memcpy_dst = 0;
-    size_t memcpy_src = 0;
-    size_t out_len = 0;
-
-    if (first[first_len - 1] == '/') {
-        if (second[0] == '/') {
-            out_len = first_len + second_len - 1;
-            memcpy_dst = first_len;
-            memcpy_src = 1;
-        } else {
-            out_len = first_len + second_len;
-            memcpy_dst = first_len;
-            memcpy_src = 0;
+// Returns nonzero if a file of the given size should be sent with `sendfile`.
+static int use_sendfile(off_t size) {
+    return global_options.sendfile_min_size && (size_t) size >= global_options.sendfile_min_size;
+}
+
+// Returns nonzero if the file served at `path` matches one of the --warm patterns.
+static int is_warm(const char * path) {
+    for (size_t i = 0; i < global_options.num_warm_patterns; i++) {
+        if (! fnmatch(global_options.warm_patterns[i], path, 0)) {
+            return 1;
         }
-    } else {
-        if (second[0] == '/') {
-            out_len = first_len + second_len;
-            memcpy_dst = first_len;
-            memcpy_src = 0;
-        } else {
-            out_len = first_len + second_len + 1;
-            memcpy_dst = first_len + 1;
-            memcpy_src = 0;
-
-            if (out_len < PATH_MAX) {
-                first[first_len] = '/';
+    }
+
+    return 0;
+}
+
+// Maps the file read-only into memory. Nothing is read yet: pages are faulted in from the page
+// cache the first time they're sent, unless the file is warm, in which case the kernel starts
+// reading it in the background. Empty files can't be mapped and get a NULL `*out`. Returns 0 on
+// success, or -1 with errno set.
+static int map_file(int fd, size_t size, const char * path, char ** out) {
+    *out = NULL;
+
+    if (! size) {
+        return 0;
+    }
+
+    char * bytes = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+
+    if (bytes == MAP_FAILED) {
+        return -1;
+    }
+
+    if (is_warm(path) && madvise(bytes, size, MADV_WILLNEED) == -1) {
+        perror("Failed to warm up mapped file");
+    }
+
+    *out = bytes;
+
+    return 0;
+}
+
+static uint64_t hash_bytes(uint64_t hash, const void * bytes, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        hash ^= ((const unsigned char *) bytes)[i];
+        hash *= FNV_PRIME;
+    }
+
+    return hash;
+}
+
+// Sets the file's ETag and Last-Modified time. The ETag has to change whenever the contents do.
+// Small files in memory are hashed, so that identical content gets the same tag even if it's
+// rewritten. Other files are identified by their inode and size and their modification time
+// (to the nanosecond), like most servers do, so that loading them doesn't read them. Returns -1
+// if a mapped file was truncated before it could be hashed, or 0 otherwise.
+static int set_validators(struct file * file, const struct stat * statbuf) {
+    uint64_t hash = FNV_OFFSET;
+
+    if (file->content_allocated) {
+        hash = hash_bytes(hash, file->content, file->content_length);
+    } else if (file->fd == -1 && file->content_length <= ETAG_CONTENT_HASH_MAX_SIZE) {
+        // The file can be truncated while we're hashing it, so it's read through a guarded copy
+        char chunk[4096];
+
+        for (size_t offset = 0; offset < file->content_length; offset += sizeof chunk) {
+            size_t len = file->content_length - offset < sizeof chunk ? file->content_length - offset : sizeof chunk;
+
+            if (copy_file_content(file, offset, len, chunk)) {
+                return -1;
             }
+
+            hash = hash_bytes(hash, chunk, len);
         }
+    } else {
+        hash = hash_bytes(hash, &statbuf->st_dev, sizeof statbuf->st_dev);
+        hash = hash_bytes(hash, &statbuf->st_ino, sizeof statbuf->st_ino);
+        hash = hash_bytes(hash, &statbuf->st_size, sizeof statbuf->st_size);
+        hash = hash_bytes(hash, &statbuf->st_mtim, sizeof statbuf->st_mtim);
     }
 
-    if (out_len >= PATH_MAX) {
-        printf("Result of joining %s and %s would be %ld, max length is %d\n", first, second, out_len, PATH_MAX);
-        exit(1);
+    snprintf(file->etag, sizeof file->etag, "\"%016llx\"", (unsigned long long) hash);
+
+    struct tm tm;
+
+    file->mtime = statbuf->st_mtime;
+    gmtime_r(&file->mtime, &tm);
+    strftime(file->last_modified, sizeof file->last_modified, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+
+    return 0;
+}
+
+static void free_file(struct file * file) {
+    for (size_t i = 0; i < NUM_ENCODINGS; i++) {
+        if (file->encodings[i]) {
+            free_file(file->encodings[i]);
+        }
+    }
+
+    if (file->content_allocated) {
+        free(file->content);
+    } else if (file->content) {
+        munmap(file->content, file->content_length);
     }
 
-    memcpy(first + memcpy_dst, second + memcpy_src, second_len - memcpy_src);
-    first[out_len] = 0;
+    if (file->fd != -1) {
+        close(file->fd);
+    }
 
-    return out_len;
+    free(file->head);
+    free(file);
 }
 
-int reload_static_file(struct file * file_entry) {
-    char msg_buf[PATH_MAX * 2];
-    char path_buf[PATH_MAX];
-    size_t root_len = strlen(static_files.root);
+static void handle_sigbus(int sig, siginfo_t * info, void * context) {
+    if (mapped_read_guard) {
+        siglongjmp(*mapped_read_guard, 1);
+    }
 
-    memcpy(path_buf, static_files.root, root_len + 1);
-    path_join(path_buf, file_entry->path, root_len);
+    // The fault wasn't in a guarded read, so it's a real bug. With the default action back, the
+    // faulting instruction runs again and kills the process like it would have.
+    signal(SIGBUS, SIG_DFL);
+}
 
-    int fd = open(path_buf, O_RDONLY);
+static void install_sigbus_handler() {
+    // SIGBUS isn't blocked while the handler runs, so jumping out of it leaves the mask alone
+    struct sigaction action = {
+        .sa_sigaction = handle_sigbus,
+        .sa_flags = SA_SIGINFO | SA_NODEFER
+    };
 
-    if (fd == -1) {
-        snprintf(msg_buf, PATH_MAX * 2, "Failed to open %s", path_buf);
-        perror(msg_buf);
+    sigemptyset(&action.sa_mask);
 
-        return -1;
+    if (sigaction(SIGBUS, &action, NULL) == -1) {
+        die();
     }
+}
 
-    struct stat statbuf;
+int copy_file_content(const struct file * file, size_t offset, size_t len, char * dest) {
+    if (file->content_allocated) {
+        memcpy(dest, file->content + offset, len);
 
-    int status = fstat(fd, &statbuf);
+        return 0;
+    }
+
+    sigjmp_buf guard;
 
-    if (status == -1) {
-        snprintf(msg_buf, PATH_MAX * 2, "Failed to stat %s", path_buf);
-        perror(msg_buf);
+    if (sigsetjmp(guard, 0)) {
+        mapped_read_guard = NULL;
 
         return -1;
     }
 
-    char * bytes = malloc(statbuf.st_size);
-    size_t pos = 0;
-    size_t bytes_read;
+    mapped_read_guard = &guard;
+    // Keep the compiler from moving the copy out from between the guard being set and cleared
+    atomic_signal_fence(memory_order_seq_cst);
+    memcpy(dest, file->content + offset, len);
+    atomic_signal_fence(memory_order_seq_cst);
+    mapped_read_guard = NULL;
+
+    return 0;
+}
 
-    while ((bytes_read = read(fd, bytes + pos, statbuf.st_size - pos)) > 0) {
-        if (bytes_read == -1) {
-            free(bytes);
-            snprintf(msg_buf, PATH_MAX * 2, "Failed to read from %s", path_buf);
-            perror(msg_buf);
+void push_file(struct file_array * array, struct file * file) {
+    if (array->len == array->cap) {
+        size_t new_cap = array->cap ? array->cap * 2 : 64;
+        struct file ** new_files = realloc(array->files, new_cap * sizeof(struct file *));
 
-            return -1;
+        if (! new_files) {
+            die();
         }
 
-        pos += bytes_read;
+        array->files = new_files;
+        array->cap = new_cap;
     }
 
-    int close_status = close(fd);
+    array->files[array->len++] = file;
+}
 
-    if (close_status == -1) {
-        free(bytes);
-        snprintf(msg_buf, PATH_MAX * 2, "Failed to close %s", path_buf);
-        perror(msg_buf);
+// Builds the path that the entry `name` in the directory served at `dir_path` is served at. The
+// result is null-terminated. Returns its length, or 0 if it's too long.
+static size_t served_path(char out[PATH_MAX], const char * dir_path, size_t dir_path_len, const char * name) {
+    size_t name_len = strlen(name);
+    size_t out_len = dir_path_len + 1 + name_len;
 
-        return -1;
+    if (out_len >= PATH_MAX) {
+        printf("Path must not be longer than %d characters: %s/%s\n", PATH_MAX - 1, dir_path, name);
+
+        return 0;
     }
 
-    free(file_entry->content);
-    file_entry->content = bytes;
-    file_entry->content_length = statbuf.st_size;
+    memcpy(out, dir_path, dir_path_len);
+    out[dir_path_len] = '/';
+    memcpy(out + dir_path_len + 1, name, name_len + 1);
 
-    return 0;
+    return out_len;
 }
 
-struct file * read_full_file(const char * path, size_t root_offset) {
-    int fd = open(path, O_RDONLY);
+// Loads the open file `fd`, which is served at `path`. Takes ownership of the fd. Returns the
+// file with one reference, or NULL if it couldn't be loaded.
+static struct file * read_full_file(int fd, const char * path, size_t path_len) {
+    struct file * out = malloc(sizeof(struct file));
 
-    if (fd == -1) {
+    if (! out) {
         die();
     }
 
-    struct stat statbuf;
+    if (path_len >= sizeof out->path) {
+        printf("Path must not be longer than %zu characters: %s\n", sizeof out->path - 1, path);
+        close(fd);
+        free(out);
 
-    int status = fstat(fd, &statbuf);
+        return NULL;
+    }
+
+    struct stat statbuf;
 
-    if (status == -1) {
+    if (fstat(fd, &statbuf) == -1) {
+        printf("Failed to stat %s%s\n", static_files.root, path);
         close(fd);
-        die();
+        free(out);
+
+        return NULL;
     }
 
-    char * bytes = malloc(statbuf.st_size);
-    size_t pos = 0;
+    char * bytes = NULL;
+
+    if (use_sendfile(statbuf.st_size)) {
+        // Big files are kept open so that they can be sent without ever being copied into memory
+        if (is_warm(path) && posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED)) {
+            printf("Failed to warm up %s%s\n", static_files.root, path);
+        }
+    } else {
+        int status = map_file(fd, statbuf.st_size, path, &bytes);
+
+        close(fd);
+        fd = -1;
 
-    while ((status = read(fd, bytes + pos, statbuf.st_size - pos)) > 0) {
         if (status == -1) {
-            printf("Error reading from %s\n", path);
-            die();
+            printf("Failed to map %s%s\n", static_files.root, path);
+            free(out);
+
+            return NULL;
         }
+    }
 
-        pos += status;
+    out->content = bytes;
+    out->content_allocated = 0;
+    out->fd = fd;
+    out->content_length = statbuf.st_size;
+    out->path_len = path_len;
+    memcpy(out->path, path, path_len + 1);
+    memset(out->encodings, 0, sizeof out->encodings);
+    out->head = NULL;
+    out->head_length = 0;
+    atomic_init(&out->refs, 1);
+
+    if (set_validators(out, &statbuf)) {
+        printf("%s%s was truncated while it was being loaded\n", static_files.root, path);
+        free_file(out);
+
+        return NULL;
     }
 
-    status = close(fd);
+    return out;
+}
+
+static int is_compressible(const struct file * file) {
+    const char * ext = strrchr(file->path, '.');
 
-    if (status == -1) {
-        printf("Error closing %s\n", path);
+    if (! ext || strchr(ext, '/')) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < ARR_SIZE(compressible_extensions); i++) {
+        if (! strcasecmp(ext + 1, compressible_extensions[i])) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Compresses `len` bytes into a new buffer. Returns the buffer and sets `*out_len`, or returns
+// NULL if compression failed.
+static char * compress_gzip(const char * content, size_t len, size_t * out_len) {
+    z_stream stream = { 0 };
+
+    // 16 more than the largest window size gets us a gzip header instead of a zlib one
+    if (deflateInit2(&stream, GZIP_LEVEL, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return NULL;
+    }
+
+    size_t cap = deflateBound(&stream, len);
+    char * out = malloc(cap);
+
+    if (! out) {
         die();
     }
 
+    stream.next_in = (Bytef *) content;
+    stream.avail_in = len;
+    stream.next_out = (Bytef *) out;
+    stream.avail_out = cap;
+
+    int status = deflate(&stream, Z_FINISH);
+
+    *out_len = stream.total_out;
+    deflateEnd(&stream);
+
+    if (status != Z_STREAM_END) {
+        free(out);
+
+        return NULL;
+    }
+
+    return out;
+}
+
+static char * compress_brotli(const char * content, size_t len, size_t * out_len) {
+    size_t cap = BrotliEncoderMaxCompressedSize(len);
+    char * out = malloc(cap);
+
+    if (! out) {
+        die();
+    }
+
+    *out_len = cap;
+
+    if (! BrotliEncoderCompress(
+        BROTLI_QUALITY,
+        BROTLI_DEFAULT_WINDOW,
+        BROTLI_MODE_TEXT,
+        len,
+        (const uint8_t *) content,
+        out_len,
+        (uint8_t *) out
+    )) {
+        free(out);
+
+        return NULL;
+    }
+
+    return out;
+}
+
+// Compresses `content`, which holds the file's content, into a new version that has the file's
+// path and modification time. Returns NULL if compression fails.
+static struct file * compress_file(const struct file * file, const char * content, enum content_encoding encoding) {
+    size_t len;
+    char * bytes = encoding == Gzip ?
+        compress_gzip(content, file->content_length, &len) :
+        compress_brotli(content, file->content_length, &len);
+
+    if (! bytes) {
+        printf("Failed to compress %s%s with %s\n", static_files.root, file->path, content_encoding_names[encoding]);
+
+        return NULL;
+    }
+
     struct file * out = malloc(sizeof(struct file));
 
-    out->content = bytes;
-    out->content_length = statbuf.st_size;
-    out->next = NULL;
-    memcpy(out->path, path + root_offset, strlen(path) + 1 - root_offset);
+    if (! out) {
+        die();
+    }
+
+    struct stat statbuf = {
+        .st_mtime = file->mtime
+    };
+
+    *out = (struct file) {
+        .path_len = file->path_len,
+        .content = bytes,
+        .content_allocated = 1,
+        .fd = -1,
+        .content_length = len,
+        .encodings = { NULL }
+    };
+    memcpy(out->path, file->path, file->path_len + 1);
+    // Compressed files are always in memory, so their ETag is a hash of their contents
+    set_validators(out, &statbuf);
 
     return out;
 }
 
-static struct file * read_full_dir(char * root_dir_name) {
-    struct dir_stack * last_dir = malloc(sizeof(struct dir_stack));
-    struct dir_stack * top_dir = last_dir;
+// Loads the precompressed version of the file named `name` in `dir_fd` (like "name.gz"), if
+// there is one. It's ignored if it's older than the file itself, because then it's probably out
+// of date.
+static struct file * load_precompressed(const struct file * file, int dir_fd, const char * name, enum content_encoding encoding) {
+    char sibling[PATH_MAX];
+
+    if ((size_t) snprintf(sibling, sizeof sibling, "%s%s", name, encoding_suffixes[encoding]) >= sizeof sibling) {
+        return NULL;
+    }
 
-    last_dir->next = NULL;
-    last_dir->path_len = strlen(root_dir_name);
+    int fd = openat(dir_fd, sibling, O_RDONLY | O_CLOEXEC);
 
-    if (last_dir->path_len > PATH_MAX) {
-        printf("Path must not be longer than %d characters: %s\n", PATH_MAX, root_dir_name);
-        exit(1);
+    if (fd == -1) {
+        return NULL;
     }
 
-    memcpy(last_dir->path, root_dir_name, last_dir->path_len + 1);
+    struct stat statbuf;
 
-    if (last_dir->path[last_dir->path_len - 1] == '/') {
-        last_dir->path_len--;
+    if (fstat(fd, &statbuf) == -1 || ! S_ISREG(statbuf.st_mode) || statbuf.st_mtime < file->mtime) {
+        close(fd);
+
+        return NULL;
     }
 
-    last_dir->path[last_dir->path_len] = 0;
+    struct file * out = read_full_file(fd, file->path, file->path_len);
 
-    struct file * files = NULL;
-    struct file * top_file = NULL;
+    if (out) {
+        out->mtime = file->mtime;
+        memcpy(out->last_modified, file->last_modified, sizeof out->last_modified);
+    }
 
-    char tmp_buf[256];
+    return out;
+}
 
-    while (last_dir) {
-        DIR * dir = opendir(last_dir->path);
+// Finds or builds the compressed versions of the file named `name` in `dir_fd`. Versions that
+// aren't smaller than the file are thrown away.
+static void add_encodings(struct file * file, int dir_fd, const char * name) {
+    int compressible = is_compressible(file) && file->content &&
+        file->content_length >= COMPRESS_MIN_SIZE && file->content_length <= COMPRESS_MAX_SIZE;
+    // A copy of the mapped content, made the first time it's needed. The compressors can't be
+    // stopped safely if the file is truncated under them, so they never read the mapping.
+    char * plain = NULL;
 
-        if (! dir) {
-            printf("Failed to open %s\n", last_dir->path);
-            die();
+    for (size_t i = 0; i < NUM_ENCODINGS; i++) {
+        struct file * encoded = load_precompressed(file, dir_fd, name, i);
+
+        if (! encoded && compressible && ! plain) {
+            plain = malloc(file->content_length);
+
+            if (! plain) {
+                die();
+            }
+
+            if (copy_file_content(file, 0, file->content_length, plain)) {
+                printf("%s%s was truncated while it was being compressed\n", static_files.root, file->path);
+                compressible = 0;
+            }
         }
 
-        int dir_fd = dirfd(dir);
+        if (! encoded && compressible) {
+            encoded = compress_file(file, plain, i);
+        }
 
-        if (dir_fd == -1) {
-            printf("Failed to get file descriptor for dir %s\n", last_dir->path);
-            closedir(dir);
-            free(last_dir);
-            // TODO: Free everything else when dying
-            die();
+        if (encoded && encoded->content_length >= file->content_length) {
+            free_file(encoded);
+            encoded = NULL;
         }
 
-        struct dirent * ent;
+        file->encodings[i] = encoded;
+    }
 
-        while ((ent = readdir(dir))) {
-            int is_dot_dir = !(strcmp(ent->d_name, ".") && strcmp(ent->d_name, ".."));
+    free(plain);
+    render_file_heads(file);
+}
 
-            if (is_dot_dir) {
-                continue;
-            }
+// Opens `path` (a served path, or an empty string for the root) relative to the root directory.
+static int open_served_path(const char * path, int flags) {
+    return openat(static_files.root_fd, path[0] ? path + 1 : ".", flags | O_CLOEXEC);
+}
+
+struct file * load_static_file(const char * path, size_t path_len) {
+    int fd = open_served_path(path, O_RDONLY);
+
+    if (fd == -1) {
+        return NULL;
+    }
+
+    struct stat statbuf;
+
+    if (fstat(fd, &statbuf) == -1 || ! S_ISREG(statbuf.st_mode)) {
+        close(fd);
+
+        return NULL;
+    }
+
+    struct file * file = read_full_file(fd, path, path_len);
+
+    if (file) {
+        add_encodings(file, static_files.root_fd, path + 1);
+    }
+
+    return file;
+}
+
+// Adds a directory to the loader's queue. Called with the lock held, or before the threads
+// have been started.
+static void push_dir_job(struct dir_loader * loader, struct dir_job * job) {
+    job->next = loader->jobs;
+    loader->jobs = job;
+    loader->pending++;
+    pthread_cond_signal(&loader->cond);
+}
+
+// Takes the next directory off the queue, waiting for one if other threads are still scanning
+// directories that may have subdirectories. Returns NULL once every directory has been scanned.
+static struct dir_job * pop_dir_job(struct dir_loader * loader) {
+    pthread_mutex_lock(&loader->lock);
+
+    while (! loader->jobs && loader->pending) {
+        pthread_cond_wait(&loader->cond, &loader->lock);
+    }
+
+    struct dir_job * job = loader->jobs;
+
+    if (job) {
+        loader->jobs = job->next;
+    }
+
+    pthread_mutex_unlock(&loader->lock);
+
+    return job;
+}
+
+static void finish_dir_job(struct dir_loader * loader) {
+    pthread_mutex_lock(&loader->lock);
+
+    if (! --loader->pending) {
+        // Wake up everyone who's waiting for more work so that they can exit
+        pthread_cond_broadcast(&loader->cond);
+    }
+
+    pthread_mutex_unlock(&loader->lock);
+}
+
+// Loads every regular file in the directory and queues its subdirectories. Everything is
+// opened relative to the directory's fd, so the kernel never has to walk a full path. Entries
+// that disappear or can't be read while we're scanning are skipped.
+static void scan_dir(struct loader_thread * self, struct dir_job * job) {
+    // The directory is watched before it's read, so that nothing that's added to it afterwards
+    // can be missed
+    add_dir_watch(job->path, job->path_len);
+
+    DIR * dir = fdopendir(job->fd);
 
+    if (! dir) {
+        printf("Failed to open %s%s\n", static_files.root, job->path);
+        close(job->fd);
+
+        return;
+    }
+
+    char path[PATH_MAX];
+    struct dirent * ent;
+
+    errno = 0;
+
+    while ((ent = readdir(dir))) {
+        int is_dot_dir = !(strcmp(ent->d_name, ".") && strcmp(ent->d_name, ".."));
+        int is_dir = ent->d_type == DT_DIR;
+        int is_reg = ent->d_type == DT_REG;
+        size_t path_len = is_dot_dir ? 0 : served_path(path, job->path, job->path_len, ent->d_name);
+
+        // Symlinks are followed, and some filesystems don't fill in the type at all
+        if (path_len && ! is_dir && ! is_reg) {
             struct stat statbuf;
-            int status = fstatat(dir_fd, ent->d_name, &statbuf, 0);
 
-            if (status == -1) {
-                printf("Failed to stat %s in %s\n", ent->d_name, last_dir->path);
-                closedir(dir);
-                free(last_dir);
-                die();
+            if (fstatat(job->fd, ent->d_name, &statbuf, 0) == -1) {
+                printf("Failed to stat %s%s\n", static_files.root, path);
+                path_len = 0;
+            } else {
+                is_dir = S_ISDIR(statbuf.st_mode);
+                is_reg = S_ISREG(statbuf.st_mode);
             }
+        }
+
+        if (! path_len) {
+            // Skip it
+        } else if (is_dir) {
+            int fd = openat(job->fd, ent->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
 
-            if (S_ISDIR(statbuf.st_mode)) {
-                top_dir->next = malloc(sizeof(struct dir_stack));
-                top_dir = top_dir->next;
-                top_dir->next = NULL;
-                memcpy(top_dir->path, last_dir->path, last_dir->path_len + 1);
-                top_dir->path_len = path_join(top_dir->path, ent->d_name, last_dir->path_len);
-            } else if (S_ISREG(statbuf.st_mode)) {
-                memcpy(tmp_buf, last_dir->path, last_dir->path_len + 1);
-                path_join(tmp_buf, ent->d_name, last_dir->path_len);
-
-                struct file * next_file = read_full_file(tmp_buf, last_dir->path_len);
-
-                if (! files) {
-                    files = next_file;
-                    top_file = files;
-                } else {
-                    top_file->next = next_file;
-                    top_file = top_file->next;
+            if (fd == -1) {
+                printf("Failed to open %s%s\n", static_files.root, path);
+            } else {
+                struct dir_job * sub = malloc(sizeof(struct dir_job));
+
+                if (! sub) {
+                    die();
                 }
+
+                sub->fd = fd;
+                sub->path_len = path_len;
+                memcpy(sub->path, path, path_len + 1);
+
+                pthread_mutex_lock(&self->loader->lock);
+                push_dir_job(self->loader, sub);
+                pthread_mutex_unlock(&self->loader->lock);
             }
- 
-            errno = 0;
+        } else if (is_reg) {
+            int fd = openat(job->fd, ent->d_name, O_RDONLY | O_CLOEXEC);
+            struct file * file = fd == -1 ? NULL : read_full_file(fd, path, path_len);
+
+            if (file) {
+                add_encodings(file, job->fd, ent->d_name);
+                push_file(&self->files, file);
+            } else if (fd == -1) {
+                printf("Failed to open %s%s\n", static_files.root, path);
+            }
+        }
+
+        errno = 0;
+    }
+
+    if (errno) {
+        printf("Failed to read %s%s\n", static_files.root, job->path);
+    }
+
+    // This closes the directory's fd too
+    closedir(dir);
+}
+
+static void * run_loader_thread(void * self_ptr) {
+    struct loader_thread * self = self_ptr;
+    struct dir_job * job;
+
+    while ((job = pop_dir_job(self->loader))) {
+        scan_dir(self, job);
+        free(job);
+        finish_dir_job(self->loader);
+    }
+
+    return NULL;
+}
+
+// Directories are scanned and files are loaded by a pool of threads, which take directories
+// from a shared queue and add the subdirectories they find to it. The files end up in no
+// particular order.
+void load_static_tree(const char * path, size_t path_len, struct file_array * out) {
+    struct dir_loader loader = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER,
+        .jobs = NULL,
+        .pending = 0
+    };
+    struct dir_job * top = malloc(sizeof(struct dir_job));
+
+    if (! top) {
+        die();
+    }
+
+    top->fd = open_served_path(path, O_RDONLY | O_DIRECTORY);
+
+    if (top->fd == -1) {
+        printf("Failed to open %s%s\n", static_files.root, path);
+        free(top);
+
+        return;
+    }
+
+    top->path_len = path_len;
+    memcpy(top->path, path, path_len + 1);
+    push_dir_job(&loader, top);
+
+    struct loader_thread threads[LOAD_THREADS];
+
+    for (size_t i = 0; i < LOAD_THREADS; i++) {
+        threads[i].loader = &loader;
+        threads[i].files = (struct file_array) { 0 };
+
+        if (pthread_create(&threads[i].thread, NULL, run_loader_thread, threads + i)) {
+            die();
         }
+    }
 
-        if (errno) {
-            closedir(dir);
-            free(last_dir);
+    for (size_t i = 0; i < LOAD_THREADS; i++) {
+        if (pthread_join(threads[i].thread, NULL)) {
             die();
         }
 
-        int close_result = closedir(dir);
+        for (size_t j = 0; j < threads[i].files.len; j++) {
+            push_file(out, threads[i].files.files[j]);
+        }
 
-        struct dir_stack * next_dir = last_dir->next;
-        free(last_dir);
-        last_dir = next_dir;
+        free(threads[i].files.files);
+    }
 
-        if (close_result == -1) {
-            printf("Failed to close %s\n", top_dir->path);
-            die();
+    pthread_mutex_destroy(&loader.lock);
+    pthread_cond_destroy(&loader.cond);
+}
+
+static uint64_t hash_path(const char * path, size_t path_len) {
+    return hash_bytes(FNV_OFFSET, path, path_len);
+}
+
+struct static_snapshot * create_static_snapshot(struct file_array * files) {
+    size_t num_slots = 16;
+
+    while (num_slots < files->len * 2) {
+        num_slots *= 2;
+    }
+
+    struct static_snapshot * snapshot = malloc(sizeof(struct static_snapshot));
+    struct file_slot * index = calloc(num_slots, sizeof(struct file_slot));
+
+    if (! snapshot || ! index) {
+        die();
+    }
+
+    for (size_t j = 0; j < files->len; j++) {
+        struct file * file = files->files[j];
+        uint64_t hash = hash_path(file->path, file->path_len);
+        size_t i = hash & (num_slots - 1);
+
+        while (index[i].file) {
+            i = (i + 1) & (num_slots - 1);
         }
+
+        index[i].hash = hash;
+        index[i].file = file;
     }
 
-    return files;
+    snapshot->index = index;
+    snapshot->index_mask = num_slots - 1;
+    snapshot->num_files = files->len;
+
+    free(files->files);
+    *files = (struct file_array) { 0 };
+
+    return snapshot;
+}
+
+void free_static_snapshot(struct static_snapshot * snapshot) {
+    for (size_t i = 0; i <= snapshot->index_mask; i++) {
+        if (snapshot->index[i].file) {
+            release_static_file(snapshot->index[i].file);
+        }
+    }
+
+    free(snapshot->index);
+    free(snapshot);
+}
+
+struct file * find_static_file(const struct static_snapshot * snapshot, const char * path, size_t path_len) {
+    uint64_t hash = hash_path(path, path_len);
+    size_t i = hash & snapshot->index_mask;
+
+    while (snapshot->index[i].file) {
+        struct file_slot * slot = snapshot->index + i;
+
+        if (slot->hash == hash && slot->file->path_len == path_len && ! memcmp(slot->file->path, path, path_len)) {
+            return slot->file;
+        }
+
+        i = (i + 1) & snapshot->index_mask;
+    }
+
+    return NULL;
+}
+
+struct file * acquire_static_file(const char * path, size_t path_len) {
+    struct static_snapshot * snapshot = atomic_load(&static_files.snapshot);
+    struct file * file = find_static_file(snapshot, path, path_len);
+
+    if (file) {
+        // The snapshot holds a reference, so this can't be the first one
+        atomic_fetch_add_explicit(&file->refs, 1, memory_order_relaxed);
+    }
+
+    return file;
+}
+
+void release_static_file(struct file * file) {
+    if (atomic_fetch_sub_explicit(&file->refs, 1, memory_order_acq_rel) == 1) {
+        free_file(file);
+    }
+}
+
+void register_static_reader(struct static_reader * reader) {
+    pthread_mutex_lock(&readers_lock);
+    atomic_store(&reader->epoch, atomic_load(&snapshot_epoch));
+    reader->next = readers;
+    readers = reader;
+    pthread_mutex_unlock(&readers_lock);
+}
+
+void unregister_static_reader(struct static_reader * reader) {
+    // The reader has to be offline before we take the lock, because a swap may be holding it
+    // while it waits for this reader
+    static_reader_offline(reader);
+    pthread_mutex_lock(&readers_lock);
+
+    struct static_reader ** prev = &readers;
+
+    while (*prev != reader) {
+        prev = &(*prev)->next;
+    }
+
+    *prev = reader->next;
+    pthread_mutex_unlock(&readers_lock);
+}
+
+void static_reader_offline(struct static_reader * reader) {
+    atomic_store(&reader->epoch, 0);
+}
+
+void static_reader_online(struct static_reader * reader) {
+    // This is ordered before any load of the snapshot pointer that follows it. A swap that
+    // happens after this store sees that the reader is online and waits for it.
+    atomic_store(&reader->epoch, atomic_load(&snapshot_epoch));
+}
+
+// Waits until every reader has been offline or come back online since the epoch was incremented
+// to `epoch`.
+static void wait_for_readers(uint_fast64_t epoch) {
+    const struct timespec poll_interval = {
+        .tv_sec = 0,
+        .tv_nsec = READER_POLL_NS
+    };
+
+    pthread_mutex_lock(&readers_lock);
+
+    for (struct static_reader * reader = readers; reader; reader = reader->next) {
+        uint_fast64_t reader_epoch;
+
+        while ((reader_epoch = atomic_load(&reader->epoch)) && reader_epoch < epoch) {
+            nanosleep(&poll_interval, NULL);
+        }
+    }
+
+    pthread_mutex_unlock(&readers_lock);
+}
+
+void swap_static_snapshot(struct static_snapshot * snapshot) {
+    struct static_snapshot * old = atomic_exchange(&static_files.snapshot, snapshot);
+    uint_fast64_t epoch = atomic_fetch_add(&snapshot_epoch, 1) + 1;
+
+    // Once every reader has passed through a quiescent state, none of them can still have the
+    // old pointer. Responses that are still sending old files hold their own references.
+    wait_for_readers(epoch);
+    free_static_snapshot(old);
 }
 
 void load_static_dir(const char * dir) {
     size_t dir_len = strlen(dir);
 
+    install_sigbus_handler();
     static_files.root = malloc(dir_len + 1);
-    static_files.files = NULL;
-
     memcpy(static_files.root, dir, dir_len + 1);
-    static_files.files = read_full_dir(static_files.root);
-}
 
-void free_static_dir() {
-    free(static_files.root);
+    // Error messages print the root followed by a served path, which starts with '/'
+    if (dir_len > 1 && static_files.root[dir_len - 1] == '/') {
+        static_files.root[dir_len - 1] = 0;
+    }
 
-    struct file * curr_file = static_files.files;
+    static_files.root_fd = open(static_files.root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
 
-    while (curr_file) {
-        struct file * next = curr_file->next;
+    if (static_files.root_fd == -1) {
+        printf("Failed to open %s\n", static_files.root);
+        die();
+    }
+
+    struct file_array files = { 0 };
+
+    load_static_tree("", 0, &files);
+    atomic_store(&static_files.snapshot, create_static_snapshot(&files));
+}
 
-        free(curr_file->content);
-        free(curr_file);
-        curr_file = next;
+void free_static_dir() {
+    struct static_snapshot * snapshot = atomic_exchange(&static_files.snapshot, NULL);
+
+    if (snapshot) {
+        free_static_snapshot(snapshot);
     }
+
+    close(static_files.root_fd);
+    static_files.root_fd = -1;
+    free(static_files.root);
+    static_files.root = NULL;
 }
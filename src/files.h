@@ -15,23 +15,162 @@
  * You should have received a copy of the GNU Affero General Public License
  * along with gru-http.  If not, see <https://www.gnu.org/licenses/>.
  */
+#ifndef SRC_FILES_H
+#define SRC_FILES_H
+
+#include <stdatomic.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <dirent.h>
+#include <time.h>
+
+// Content codings that files can be precompressed with, in order of preference
+enum content_encoding {
+    Brotli = 0,
+    Gzip = 1
+};
+
+#define NUM_ENCODINGS   2
 
+// The names of the content codings, as they appear in Accept-Encoding and Content-Encoding
+extern const char * content_encoding_names[NUM_ENCODINGS];
+
+// Big enough for a quoted 64-bit hash in hex
+#define ETAG_SIZE       24
+// Big enough for an IMF-fixdate, like "Sun, 06 Nov 1994 08:49:37 GMT"
+#define HTTP_DATE_SIZE  32
+
+// One version of a static file. When the file on disk changes, a new version is loaded and
+// swapped in, and the old one is freed once nothing uses it anymore. A version's metadata never
+// changes, but mapped content is shared with the file on disk. If the file is replaced by
+// renaming a new one over it, the old version keeps the old content until it's freed. If it's
+// written in place, every version that maps it sees the new bytes (or loses the pages past a
+// truncation) until the watcher reloads it, so reads from the mapping in user space have to go
+// through `copy_file_content`.
 struct file {
+    // The path that the file is served at, relative to the root directory and starting with '/'
     char path[256];
+    size_t path_len;
     char * content;
+    // Nonzero if `content` was allocated rather than mapped
+    int content_allocated;
+    // Big files are kept open and sent with `sendfile` instead of being mapped into `content`.
+    // This is -1 for files that are in memory.
+    int fd;
     size_t content_length;
-    struct file * next;
+    // A strong validator for this version of the file, with the quotes
+    char etag[ETAG_SIZE];
+    // The file's modification time, and the same time formatted for the Last-Modified header
+    time_t mtime;
+    char last_modified[HTTP_DATE_SIZE];
+    // Compressed versions of the file, indexed by encoding, or NULL if there isn't a smaller
+    // one. They belong to this file, and they have its path and modification time but their own
+    // ETags.
+    struct file * encodings[NUM_ENCODINGS];
+    // The status line and headers of a 200 response with this file, including the empty line
+    // at the end. It's rendered when the file is loaded, so most requests don't have to format
+    // anything. This is NULL if it couldn't be rendered.
+    char * head;
+    size_t head_length;
+    // One for every snapshot that contains this version, plus one for every response that's
+    // sending it
+    atomic_size_t refs;
+};
+
+struct file_slot {
+    uint64_t hash;
+    struct file * file;
+};
+
+// An immutable set of static files. Workers look files up in the current snapshot without
+// taking any locks. When files change, the watcher builds a new snapshot and swaps it in, then
+// waits until no worker can still be using the old one before freeing it.
+struct static_snapshot {
+    // An open-addressed hash table of the files keyed by path, with linear probing. Slots hold
+    // the path's hash so that most mismatches are rejected without touching the file. There are
+    // at least twice as many slots as files and the count is a power of two. Empty slots have a
+    // NULL file.
+    struct file_slot * index;
+    size_t index_mask;
+    size_t num_files;
 };
 
 struct http_static_dir {
     char * root;
-    struct file * files;
+    // Kept open so that files can be opened relative to it
+    int root_fd;
+    _Atomic(struct static_snapshot *) snapshot;
+};
+
+// A growable array of files
+struct file_array {
+    struct file ** files;
+    size_t len;
+    size_t cap;
+};
+
+// A thread that looks up static files. Snapshots are reclaimed with quiescent-state-based
+// reclamation: a reader may only use the snapshot pointer that it loaded between a call to
+// `static_reader_online` and the next call to `static_reader_offline`. Outside of that, it has
+// to hold references to the files it's using.
+struct static_reader {
+    // The snapshot epoch that was current when the reader last came online, or 0 while it's
+    // offline
+    atomic_uint_fast64_t epoch;
+    struct static_reader * next;
 };
 
 extern struct http_static_dir static_files;
 
+// Loads every file under `dir` into the first snapshot. If the watcher has been set up, the
+// directories are watched for changes as they're scanned.
 void load_static_dir(const char * dir);
 void free_static_dir();
-int reload_static_file(struct file * file_entry);
+
+// Loads every file under the directory served at `path` (which is empty for the root) into
+// `out`, with one reference each.
+void load_static_tree(const char * path, size_t path_len, struct file_array * out);
+
+// Loads the file served at `path`. Returns NULL if it's not a regular file.
+struct file * load_static_file(const char * path, size_t path_len);
+
+void push_file(struct file_array * array, struct file * file);
+
+// Copies `len` bytes of the file's content, starting at `offset`, into `dest`. A mapped file can
+// be truncated on disk while it's loaded, and reading the pages past its new end raises SIGBUS.
+// That's caught, and this returns -1 instead of the server crashing. Returns 0 on success. Files
+// have to be loaded with `load_static_dir` for the signal to be caught.
+int copy_file_content(const struct file * file, size_t offset, size_t len, char * dest);
+
+// Builds a snapshot of the files, taking over the reference that the array holds on each one.
+// Frees the array.
+struct static_snapshot * create_static_snapshot(struct file_array * files);
+
+// Drops the snapshot's references to its files and frees it. Nothing may be using it.
+void free_static_snapshot(struct static_snapshot * snapshot);
+
+// Makes `snapshot` the current one, then waits for every reader to stop using the old one and
+// frees it. Only one thread may call this.
+void swap_static_snapshot(struct static_snapshot * snapshot);
+
+// Returns the file served at `path` in the snapshot, or NULL if there isn't one. The path
+// doesn't need to be null-terminated.
+struct file * find_static_file(const struct static_snapshot * snapshot, const char * path, size_t path_len);
+
+// Looks the file up in the current snapshot and takes a reference to it, which must be given
+// back with `release_static_file`. The calling thread has to be an online reader.
+struct file * acquire_static_file(const char * path, size_t path_len);
+void release_static_file(struct file * file);
+
+// Readers are registered on their own thread, before they look anything up, and start out
+// online.
+void register_static_reader(struct static_reader * reader);
+void unregister_static_reader(struct static_reader * reader);
+
+// A reader goes offline before it blocks, so that it doesn't hold up the reclamation of old
+// snapshots. Coming back online is a quiescent state: the reader forgets any snapshot that it
+// loaded before.
+void static_reader_offline(struct static_reader * reader);
+void static_reader_online(struct static_reader * reader);
+
+#endif
@@ -0,0 +1,39 @@
+/*
+ * This file is part of gru-http, an HTTP server.
+ * Copyright (C) 2024  Joe Desmond
+ *
+ * gru-http is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * gru-http is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with gru-http.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef SRC_HEADER_KEY_H
+#define SRC_HEADER_KEY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The hash of the known request header names, which is shared by the parser and the generator
+// that picks its multiplier. A name's key is its length and its first, middle and last bytes,
+// folded to lower case. The name must be at least one byte long.
+static inline uint32_t header_key(const char * name, size_t len) {
+    return (uint32_t) len
+        ^ ((uint32_t) (unsigned char) (name[0] | 0x20) << 8)
+        ^ ((uint32_t) (unsigned char) (name[len / 2] | 0x20) << 16)
+        ^ ((uint32_t) (unsigned char) (name[len - 1] | 0x20) << 24);
+}
+
+// Maps a key to one of `1 << bits` slots.
+static inline size_t header_slot(uint32_t key, uint32_t multiplier, int bits) {
+    return (uint32_t) (key * multiplier) >> (32 - bits);
+}
+
+#endif
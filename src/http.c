@@ -15,40 +15,65 @@
  * You should have received a copy of the GNU Affero General Public License
  * along with gru-http.  If not, see <https://www.gnu.org/licenses/>.
  */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
+#include "error.h"
 #include "files.h"
+#include "header_key.h"
 #include "http.h"
-
-#define write_sock(...)     { \
-    int result = send(__VA_ARGS__, MSG_NOSIGNAL); \
-    if (result == -1) { \
-        perror("Failed to write to socket"); \
-        return; \
-    } \
-} noop()
-
-static void noop() {}
+#include "latency.h"
+#include "metrics.h"
+#include "params.h"
+#include "req_header_hash.h"
+#include "scan.h"
 
 struct server_options global_options = {
-    .cache_option = DefaultUseCache
+    .cache_option = DefaultUseCache,
+    .num_workers = 0,
+    .num_shards = 0,
+    .max_header_size = DEFAULT_MAX_HEADER_SIZE,
+    .sendfile_min_size = DEFAULT_SENDFILE_MIN_SIZE,
+    .backend = EpollBackend,
+    .error_pages = 0,
+    .metrics_path = NULL,
+    .log_level = LogAccess
+};
+
+// A whole error response, head and body, serialized in one buffer
+struct canned_response {
+    char * data;
+    size_t head_length;
+    size_t body_length;
 };
 
+// Indexed by status code. Only the error statuses are filled in.
+static struct canned_response error_responses[HTTP_STATUS_MAX];
+
 const char * req_header_names[REQ_HEADER_MAX] = {
-    [REQ_HEADER_ACCEPT] = "Accept",
-    [REQ_HEADER_CACHE_CONTROL] = "Cache-Control",
-    [REQ_HEADER_CONTENT_TYPE] = "Content-Type",
-    [REQ_HEADER_CONTENT_LENGTH] = "Content-Length",
-    [REQ_HEADER_HOST] = "Host",
-    [REQ_HEADER_USER_AGENT] = "User-Agent"
+#define REQ_HEADER(id, name) [REQ_HEADER_##id] = name,
+#include "req_headers.def"
+#undef REQ_HEADER
 };
 
 const char * res_header_names[RES_HEADER_MAX] = {
     [RES_HEADER_CONTENT_LENGTH] = "Content-Length",
-    [RES_HEADER_CONTENT_TYPE] = "Content-Type"
+    [RES_HEADER_CONTENT_TYPE] = "Content-Type",
+    [RES_HEADER_CONNECTION] = "Connection",
+    [RES_HEADER_ETAG] = "ETag",
+    [RES_HEADER_LAST_MODIFIED] = "Last-Modified",
+    [RES_HEADER_CONTENT_ENCODING] = "Content-Encoding",
+    [RES_HEADER_VARY] = "Vary",
+    [RES_HEADER_ACCEPT_RANGES] = "Accept-Ranges",
+    [RES_HEADER_CONTENT_RANGE] = "Content-Range"
 };
 
 const char * http_method_names[] = {
@@ -66,26 +91,31 @@ static const size_t http_method_max = ARR_SIZE(http_method_names);
 
 // We (loosely) support 1.0 and 1.1
 static const char * http_versions[] = {
-    "HTTP/1.0",
-    "HTTP/1.1"
+    [Http10] = "HTTP/1.0",
+    [Http11] = "HTTP/1.1"
 };
 
 static const char http_version_out[] = "HTTP/1.1";
 
 // Parses an HTTP request line into an `http_req` object and returns either a status code or
 // zero. If a status code is returned, then that should be sent back to the client immediately.
-// Otherwise, the remainder of the request should be processed.
+// Otherwise, the remainder of the request should be processed. The line starts at `req->seek`
+// and `buf_size` is the index just past its line feed.
 static http_status_code parse_req_line(const char * restrict in_buf, size_t buf_size, struct http_req * req) {
-    while (in_buf[req->seek] != ' ') {
-        if (req->seek >= buf_size - 1) {
-            return HTTP_BAD_REQUEST;
-        }
+    const size_t method_start = req->seek;
 
-        req->seek++;
+    // The line ends with a line feed, which isn't part of a token, so this never reaches the end
+    req->seek += scan_token(in_buf + req->seek, buf_size - req->seek);
+
+    if (in_buf[req->seek] != ' ' || req->seek == method_start) {
+        return HTTP_BAD_REQUEST;
     }
 
+    const size_t method_len = req->seek - method_start;
+
     for (int i = 0; i < http_method_max; i++) {
-        if (! strncmp(in_buf, http_method_names[i], req->seek)) {
+        if (strlen(http_method_names[i]) == method_len &&
+            ! strncmp(in_buf + method_start, http_method_names[i], method_len)) {
             req->method = i;
             break;
         }
@@ -97,21 +127,23 @@ static http_status_code parse_req_line(const char * restrict in_buf, size_t buf_
 
     // Consume the space
     req->seek++;
-    size_t seek_end = req->seek;
 
-    // A request target must not contain whitespace. For now, we'll just keep reading until we hit
-    // a space.
-    while (in_buf[seek_end] != ' ') {
-        if (seek_end >= buf_size - 1) {
-            return HTTP_URI_TOO_LONG;
-        }
+    // A request target must not contain whitespace or control characters
+    size_t seek_end = req->seek + scan_target(in_buf + req->seek, buf_size - req->seek);
 
-        seek_end++;
+    // The whole line is here, so a target that runs to the end of it means the version is
+    // missing. A request line that's too long to buffer never gets this far: `handle_http_req`
+    // answers it with 414 once the buffer is full.
+    if (seek_end >= buf_size - 2) {
+        return HTTP_BAD_REQUEST;
     }
 
-    req->target = malloc(seek_end - req->seek + 1);
-    memcpy(req->target, in_buf + req->seek, seek_end - req->seek);
-    req->target[seek_end - req->seek] = 0;
+    if (in_buf[seek_end] != ' ') {
+        return HTTP_BAD_REQUEST;
+    }
+
+    req->target.offset = req->seek;
+    req->target.length = seek_end - req->seek;
 
     // Consume the space
     req->seek = seek_end + 1;
@@ -122,6 +154,7 @@ static http_status_code parse_req_line(const char * restrict in_buf, size_t buf_
         size_t version_len = strlen(http_versions[i]);
 
         if (! strncmp(in_buf + req->seek, http_versions[i], version_len)) {
+            req->version = i;
             req->seek += version_len;
             goto version_found;
         }
@@ -131,8 +164,8 @@ static http_status_code parse_req_line(const char * restrict in_buf, size_t buf_
 
 version_found:
 
-    if (req->seek >= (buf_size - 2)) {
-        return HTTP_URI_TOO_LONG;
+    if (req->seek + 2 != buf_size) {
+        return HTTP_BAD_REQUEST;
     }
 
     if (in_buf[req->seek++] != '\r') {
@@ -158,52 +191,31 @@ static int is_whitespace(char in) {
     return in == ' ' || in == '\t';
 }
 
-static int is_known_header(const char * restrict header_in, size_t known_header_i, size_t header_in_len) {
-    size_t i = 0;
-
-    const char * restrict known_header = req_header_names[known_header_i];
-    const size_t known_header_len = strlen(known_header);
-
-    if (known_header_len != header_in_len) {
-        return 0;
-    }
-
-    const size_t n = header_in_len;
-
-    while (i < n && header_in[i] && known_header[i]) {
-        if (lowercase(header_in[i]) != lowercase(known_header[i])) {
-            break;
-        }
-
-        i++;
-    }
+// Returns the known header that the field name is, or -1. The name must be a token, and at least
+// one byte long.
+static int find_known_header(const char * name, size_t len) {
+    size_t slot = header_slot(header_key(name, len), REQ_HEADER_HASH_MULTIPLIER, REQ_HEADER_HASH_BITS);
+    int header = req_header_slots[slot];
 
-    if (i < n) {
-        return ((unsigned char) lowercase(header_in[i])) == ((unsigned char) lowercase(known_header[i]));
+    // Names that we don't know can land in any slot
+    if (header == -1 || req_header_lengths[header] != len || ! equals_ignore_case(name, req_header_names[header], len)) {
+        return -1;
     }
 
-    return 1;
+    return header;
 }
 
+// Parses a field line that starts at `req->seek`. `buf_size` is the index just past the line's
+// line feed.
 static http_status_code parse_field_line(const char * in_buf, size_t buf_size, struct http_req * req) {
-    size_t seek_end = req->seek;
-
-    while (in_buf[seek_end] != ':') {
-        if (seek_end >= buf_size - 1) {
-            return HTTP_BAD_REQUEST;
-        }
+    // The field name is a token, and there can't be any whitespace between it and the colon
+    size_t seek_end = req->seek + scan_token(in_buf + req->seek, buf_size - req->seek);
 
-        seek_end++;
+    if (in_buf[seek_end] != ':' || seek_end == req->seek) {
+        return HTTP_BAD_REQUEST;
     }
 
-    int req_header = -1;
-
-    for (int i = 0; i < REQ_HEADER_MAX; i++) {
-        if (is_known_header(in_buf + req->seek, i, seek_end - req->seek)) {
-            req_header = i;
-            break;
-        }
-    }
+    int req_header = find_known_header(in_buf + req->seek, seek_end - req->seek);
 
     req->seek = seek_end + 1;
 
@@ -217,59 +229,68 @@ static http_status_code parse_field_line(const char * in_buf, size_t buf_size, s
         req->seek++;
     }
 
-    seek_end = req->seek;
-
-    while (in_buf[seek_end] != '\r') {
-        if (seek_end >= buf_size - 3) {
-            return HTTP_BAD_REQUEST;
-        }
-
-        seek_end++;
-    }
+    // The value has to run right up to the CR at the end of the line
+    seek_end = req->seek + scan_field_value(in_buf + req->seek, buf_size - req->seek);
 
-    if (in_buf[seek_end + 1] != '\n') {
+    if (seek_end != buf_size - 2 || in_buf[seek_end] != '\r') {
         return HTTP_BAD_REQUEST;
     }
 
-    while (is_whitespace(in_buf[seek_end])) {
+    while (seek_end > req->seek && is_whitespace(in_buf[seek_end - 1])) {
         seek_end--;
     }
 
-    if (req_header == -1) {
-        req->seek = seek_end + 2;
-        return 0;
+    if (req_header != -1 && ! req->headers.known[req_header].offset) {
+        req->headers.known[req_header].offset = req->seek;
+        req->headers.known[req_header].length = seek_end - req->seek;
     }
 
-    req->headers.known[req_header] = malloc(seek_end - req->seek + 1);
-    memcpy(req->headers.known[req_header], in_buf + req->seek, seek_end - req->seek);
-    req->headers.known[req_header][seek_end - req->seek] = 0;
-
-    req->seek = seek_end + 2;
+    req->seek = buf_size;
 
     return 0;
 }
 
-static http_status_code parse_field_lines(const char * in_buf, size_t buf_size, struct http_req * req) {
-    http_status_code last_line_result = 0;
+// Parses every complete line of the request head that hasn't been parsed yet. Lines are only
+// parsed once their line feed has arrived, and `req->scan` remembers how far we've searched for
+// it, so each byte is only looked at once no matter how the head is split up. Returns a status
+// code if the request is invalid.
+static http_status_code parse_req_head(const char * in_buf, size_t buf_size, struct http_req * req) {
+    while (req->parse_state != ParsingDone) {
+        const char * line_feed = memchr(in_buf + req->scan, '\n', buf_size - req->scan);
 
-    if (req->seek >= buf_size) {
-        return HTTP_BAD_REQUEST;
-    }
+        if (! line_feed) {
+            req->scan = buf_size;
 
-    while (in_buf[req->seek] != '\r' && ! last_line_result) {
-        last_line_result = parse_field_line(in_buf, buf_size, req);
-    }
+            return 0;
+        }
 
-    if (last_line_result) {
-        return last_line_result;
-    }
+        const size_t line_end = line_feed - in_buf + 1;
+        const int is_empty_line = line_end - req->seek == 2 && in_buf[req->seek] == '\r';
+        http_status_code status = 0;
 
-    if (req->seek >= buf_size - 1) {
-        return HTTP_BAD_REQUEST;
-    }
+        req->scan = line_end;
 
-    if (in_buf[++req->seek] != '\n') {
-        return HTTP_BAD_REQUEST;
+        if (req->parse_state == ParsingRequestLine) {
+            if (is_empty_line) {
+                // Clients may send an extra CRLF after a request body
+                req->seek = line_end;
+                continue;
+            }
+
+            status = parse_req_line(in_buf, line_end, req);
+            req->parse_state = ParsingFieldLines;
+        } else if (is_empty_line) {
+            req->seek = line_end;
+            req->parse_state = ParsingDone;
+        } else {
+            status = parse_field_line(in_buf, line_end, req);
+        }
+
+        if (status) {
+            req->parse_state = ParsingDone;
+
+            return status;
+        }
     }
 
     return 0;
@@ -280,29 +301,28 @@ struct http_req create_http_req() {
         .headers = {
             .known = {}
         },
-        .target = NULL,
+        .target = {
+            .offset = 0,
+            .length = 0
+        },
         .method = Unknown,
-        .seek = 0
+        .version = Http11,
+        .parse_state = ParsingRequestLine,
+        .seek = 0,
+        .scan = 0,
+        .body_length = 0,
+        .parse_ns = 0
     };
 
     for (size_t i = 0; i < REQ_HEADER_MAX; i++) {
-        out.headers.known[i] = NULL;
+        out.headers.known[i].offset = 0;
+        out.headers.known[i].length = 0;
     }
 
     return out;
 }
 
 void reset_http_req(struct http_req * req) {
-    for (size_t i = 0; i < REQ_HEADER_MAX; i++) {
-        if (req->headers.known[i]) {
-            free(req->headers.known[i]);
-        }
-    }
-
-    if (req->target) {
-        free(req->target);
-    }
-
     *req = create_http_req();
 }
 
@@ -312,7 +332,18 @@ struct http_res create_http_res() {
             .headers = {}
         },
         .status = HTTP_INTERNAL_SERVER_ERROR,
-        .content = NULL
+        .head = NULL,
+        .head_length = 0,
+        .head_block = NULL,
+        .head_block_length = 0,
+        .content = NULL,
+        .content_fd = -1,
+        .content_offset = 0,
+        .owned_content = NULL,
+        .file = NULL,
+        .bytes_sent = 0,
+        .keep_alive = 0,
+        .lookup_ns = 0
     };
 
     for (size_t i = 0; i < RES_HEADER_MAX; i++) {
@@ -322,12 +353,23 @@ struct http_res create_http_res() {
     return out;
 }
 
-void reset_http_res(struct http_res * res) {
+static void free_res_headers(struct http_res * res) {
     for (size_t i = 0; i < RES_HEADER_MAX; i++) {
         if (res->headers.headers[i]) {
             free(res->headers.headers[i]);
+            res->headers.headers[i] = NULL;
         }
     }
+}
+
+void reset_http_res(struct http_res * res) {
+    free_res_headers(res);
+
+    if (res->file) {
+        release_static_file(res->file);
+    }
+
+    free(res->owned_content);
 
     *res = create_http_res();
 }
@@ -335,26 +377,23 @@ void reset_http_res(struct http_res * res) {
 static void set_http_status(struct http_res * res, http_status_code status) {
     res->status = status;
 
-    if (res->content) {
+    // Only errors get a default body
+    if (res->content || status < HTTP_BAD_REQUEST) {
         return;
     }
 
-    // We'll try to send a default message in the response body
-    int len = strlen(http_status_names[status]);
-
-    res->content = http_status_names[status];
-    res->content_length = len;
+    // A 500 means the response couldn't be put together, so the headers that were set for it
+    // don't belong with the canned one
+    if (status == HTTP_INTERNAL_SERVER_ERROR) {
+        free_res_headers(res);
+    }
 
-    size_t buf_size = sizeof(long) * 8 + 1;
-    char * len_str = malloc(buf_size);
-    snprintf(len_str, buf_size, "%d", len);
-    res->headers.headers[RES_HEADER_CONTENT_LENGTH] = len_str;
+    const struct canned_response * canned = &error_responses[status];
 
-    static const char default_content_type[] = "text/plain; charset=us-ascii";
-    char * type_str = malloc(ARR_SIZE(default_content_type) + 1);
-    memcpy(type_str, default_content_type, ARR_SIZE(default_content_type));
-    type_str[ARR_SIZE(default_content_type)] = 0;
-    res->headers.headers[RES_HEADER_CONTENT_TYPE] = type_str;
+    res->head_block = canned->data;
+    res->head_block_length = canned->head_length;
+    res->content = canned->data + canned->head_length;
+    res->content_length = canned->body_length;
 }
 
 static int strcmp_ignore_case(const char * a, const char * b) {
@@ -379,7 +418,310 @@ static int strcmp_ignore_case(const char * a, const char * b) {
     return 0;
 }
 
-static char * get_content_type(char * filename) {
+static char * copy_str(const char * str) {
+    size_t len = strlen(str);
+    char * out = malloc(len + 1);
+
+    if (! out) {
+        return NULL;
+    }
+
+    memcpy(out, str, len + 1);
+
+    return out;
+}
+
+// Returns nonzero if the slice of `in_buf` is exactly `str`.
+static int slice_equals(const char * in_buf, struct http_slice slice, const char * str) {
+    return slice.length == strlen(str) && ! memcmp(in_buf + slice.offset, str, slice.length);
+}
+
+// Returns nonzero if the slice of `in_buf` is a comma-separated list of tokens that contains
+// `token`, ignoring case and optional whitespace.
+static int has_token(const char * in_buf, struct http_slice slice, const char * token) {
+    size_t token_len = strlen(token);
+    const char * list = in_buf + slice.offset;
+    const char * const list_end = list + slice.length;
+
+    while (list < list_end) {
+        while (list < list_end && (*list == ',' || is_whitespace(*list))) {
+            list++;
+        }
+
+        size_t len = 0;
+
+        while (list + len < list_end && list[len] != ',' && ! is_whitespace(list[len])) {
+            len++;
+        }
+
+        if (len == token_len) {
+            size_t i = 0;
+
+            while (i < len && lowercase(list[i]) == lowercase(token[i])) {
+                i++;
+            }
+
+            if (i == len) {
+                return 1;
+            }
+        }
+
+        list += len;
+    }
+
+    return 0;
+}
+
+// Returns nonzero if the slice of `in_buf` is an If-None-Match list that matches `etag`. The
+// list is either "*", which matches anything, or a comma-separated list of entity tags. They're
+// compared weakly, as the spec requires for If-None-Match, so a "W/" prefix is ignored.
+static int etag_matches(const char * in_buf, struct http_slice slice, const char * etag) {
+    size_t etag_len = strlen(etag);
+    const char * list = in_buf + slice.offset;
+    const char * const list_end = list + slice.length;
+
+    while (list < list_end) {
+        while (list < list_end && (*list == ',' || is_whitespace(*list))) {
+            list++;
+        }
+
+        if (list < list_end && *list == '*') {
+            return 1;
+        }
+
+        if (list_end - list >= 2 && list[0] == 'W' && list[1] == '/') {
+            list += 2;
+        }
+
+        // Entity tags are quoted, and they can have commas in them
+        const char * tag_end = list;
+
+        if (tag_end < list_end && *tag_end == '"') {
+            tag_end++;
+
+            while (tag_end < list_end && *tag_end != '"') {
+                tag_end++;
+            }
+
+            tag_end += tag_end < list_end;
+        }
+
+        if ((size_t) (tag_end - list) == etag_len && ! memcmp(list, etag, etag_len)) {
+            return 1;
+        }
+
+        // Skip anything malformed up to the next tag
+        while (tag_end < list_end && *tag_end != ',') {
+            tag_end++;
+        }
+
+        list = tag_end;
+    }
+
+    return 0;
+}
+
+// Parses an IMF-fixdate, like "Sun, 06 Nov 1994 08:49:37 GMT". This is the only format that
+// we send, and the one that clients send back. Returns zero if the slice isn't a valid date.
+static int parse_http_date(const char * in_buf, struct http_slice slice, time_t * out) {
+    char date[HTTP_DATE_SIZE];
+
+    if (slice.length >= sizeof date) {
+        return 0;
+    }
+
+    memcpy(date, in_buf + slice.offset, slice.length);
+    date[slice.length] = 0;
+
+    struct tm tm = { 0 };
+    const char * end = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+
+    if (! end || *end) {
+        return 0;
+    }
+
+    *out = timegm(&tm);
+
+    return 1;
+}
+
+// Parses a qvalue ("1", "0.5", "0.125" and so on) and returns it in thousandths. Returns -1 if
+// it's invalid.
+static int parse_qvalue(const char * str, size_t len) {
+    if (! len || (str[0] != '0' && str[0] != '1') || (len > 1 && str[1] != '.') || len > 5) {
+        return -1;
+    }
+
+    int value = (str[0] - '0') * 1000;
+    int scale = 100;
+
+    for (size_t i = 2; i < len; i++, scale /= 10) {
+        if (str[i] < '0' || str[i] > '9') {
+            return -1;
+        }
+
+        value += (str[i] - '0') * scale;
+    }
+
+    return value > 1000 ? -1 : value;
+}
+
+// Returns how much the client wants `coding`, according to an Accept-Encoding list like
+// "gzip, br;q=0.8, *;q=0.1", in thousandths. Zero means the client doesn't accept it. A coding
+// that isn't in the list gets the weight of "*", or `unlisted_weight` if that isn't there either.
+static int get_encoding_weight(const char * in_buf, struct http_slice slice, const char * coding, int unlisted_weight) {
+    size_t coding_len = strlen(coding);
+    const char * list = in_buf + slice.offset;
+    const char * const list_end = list + slice.length;
+    int star_weight = unlisted_weight;
+
+    while (list < list_end) {
+        while (list < list_end && (*list == ',' || is_whitespace(*list))) {
+            list++;
+        }
+
+        size_t len = 0;
+
+        while (list + len < list_end && list[len] != ',' && list[len] != ';' && ! is_whitespace(list[len])) {
+            len++;
+        }
+
+        const char * name = list;
+        int weight = 1000;
+
+        list += len;
+
+        // The only parameter is the weight, but there can be whitespace around the semicolon
+        while (list < list_end && *list != ',') {
+            if (list_end - list > 2 && (list[0] == 'q' || list[0] == 'Q') && list[1] == '=') {
+                size_t q_len = 0;
+
+                list += 2;
+
+                while (list + q_len < list_end && list[q_len] != ',' && ! is_whitespace(list[q_len])) {
+                    q_len++;
+                }
+
+                weight = parse_qvalue(list, q_len);
+                list += q_len;
+            } else {
+                list++;
+            }
+        }
+
+        if (weight < 0) {
+            continue;
+        }
+
+        if (len == coding_len && ! strncasecmp(name, coding, len)) {
+            return weight;
+        }
+
+        if (len == 1 && *name == '*') {
+            star_weight = weight;
+        }
+    }
+
+    return star_weight;
+}
+
+// Picks the compressed version of the file that the client wants most, or returns -1 if the
+// client should get the file as it is. Ties go to the better compression, and any compressed
+// version that the client accepts is preferred to the file as it is. Returns -2 if the client
+// accepts none of them: the file as it is is acceptable unless "identity;q=0" or "*;q=0" (without
+// "identity") rules it out.
+static int choose_encoding(const char * in_buf, struct http_req * req, struct file * resource) {
+    struct http_slice accept_encoding = req->headers.known[REQ_HEADER_ACCEPT_ENCODING];
+    int best = -1;
+    int best_weight = 0;
+
+    if (! accept_encoding.offset) {
+        return -1;
+    }
+
+    for (int i = 0; i < NUM_ENCODINGS; i++) {
+        if (resource->encodings[i]) {
+            int weight = get_encoding_weight(in_buf, accept_encoding, content_encoding_names[i], 0);
+
+            if (weight > best_weight) {
+                best = i;
+                best_weight = weight;
+            }
+        }
+    }
+
+    if (best == -1 && ! get_encoding_weight(in_buf, accept_encoding, "identity", 1000)) {
+        return -2;
+    }
+
+    return best;
+}
+
+// Returns nonzero if the client already has the current version of the file. If-Modified-Since
+// is only looked at when there's no If-None-Match, because the ETag is the more precise
+// validator. An invalid date is ignored.
+static int is_not_modified(const char * in_buf, struct http_req * req, struct file * resource) {
+    struct http_slice if_none_match = req->headers.known[REQ_HEADER_IF_NONE_MATCH];
+    struct http_slice if_modified_since = req->headers.known[REQ_HEADER_IF_MODIFIED_SINCE];
+    time_t since;
+
+    if (if_none_match.offset) {
+        return etag_matches(in_buf, if_none_match, resource->etag);
+    }
+
+    return if_modified_since.offset &&
+        parse_http_date(in_buf, if_modified_since, &since) &&
+        resource->mtime <= since;
+}
+
+// Works out how long the request body is so that we can skip over it. We don't support chunked
+// request bodies, and without a Content-Length there is no body.
+static http_status_code parse_body_length(const char * in_buf, struct http_req * req) {
+    if (req->headers.known[REQ_HEADER_TRANSFER_ENCODING].offset) {
+        return HTTP_METHOD_NOT_IMPLEMENTED;
+    }
+
+    struct http_slice content_length = req->headers.known[REQ_HEADER_CONTENT_LENGTH];
+
+    if (! content_length.offset) {
+        req->body_length = 0;
+
+        return 0;
+    }
+
+    if (! content_length.length) {
+        return HTTP_BAD_REQUEST;
+    }
+
+    size_t length = 0;
+    const char * const end = in_buf + content_length.offset + content_length.length;
+
+    for (const char * c = in_buf + content_length.offset; c < end; c++) {
+        if (*c < '0' || *c > '9' || length > (SIZE_MAX - 9) / 10) {
+            return HTTP_BAD_REQUEST;
+        }
+
+        length = length * 10 + (*c - '0');
+    }
+
+    req->body_length = length;
+
+    return 0;
+}
+
+// HTTP/1.1 connections are persistent unless the client says otherwise. HTTP/1.0 connections
+// are closed unless the client asks for Keep-Alive.
+static int wants_keep_alive(const char * in_buf, struct http_req * req) {
+    struct http_slice connection = req->headers.known[REQ_HEADER_CONNECTION];
+
+    if (req->version == Http10) {
+        return connection.offset && has_token(in_buf, connection, "keep-alive");
+    }
+
+    return ! (connection.offset && has_token(in_buf, connection, "close"));
+}
+
+const char * get_content_type(const char * filename) {
     size_t end = strlen(filename);
     size_t start = end;
 
@@ -413,88 +755,495 @@ static char * get_content_type(char * filename) {
         }
     }
 
-    size_t len = strlen(content_type);
-    char * out = malloc(len + 1);
+    return content_type;
+}
+
+// A range of bytes in a representation, with inclusive bounds
+struct byte_range {
+    size_t first;
+    size_t last;
+};
 
-    memcpy(out, content_type, len + 1);
+// Parses a string of digits. Returns -1 if there aren't any or the number is too big.
+static ssize_t parse_range_pos(const char * str, size_t len) {
+    ssize_t value = 0;
 
-    return out;
+    if (! len) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < len; i++) {
+        if (str[i] < '0' || str[i] > '9' || value > (SSIZE_MAX - 9) / 10) {
+            return -1;
+        }
+
+        value = value * 10 + str[i] - '0';
+    }
+
+    return value;
 }
 
-static http_status_code try_get_resource(struct http_res * res, struct http_req * req) {
-    struct file * resource = static_files.files;
-    int is_index_query = ! strcmp(req->target, "/");
+// Parses a Range header like "bytes=0-499, 1000-, -500" for a representation that's `length`
+// bytes long. Ranges that start past the end are dropped, and the rest are clipped to the end.
+// Returns the number of ranges left, or -1 if the header is invalid or asks for too many ranges,
+// in which case it should be ignored.
+static int parse_ranges(const char * in_buf, struct http_slice slice, size_t length, struct byte_range ranges[MAX_RANGES]) {
+    static const char unit[] = "bytes=";
+    const size_t unit_len = ARR_SIZE(unit) - 1;
+    const char * list = in_buf + slice.offset;
+    const char * const list_end = list + slice.length;
+    int num_ranges = 0;
+    int num_specs = 0;
+
+    if (slice.length < unit_len || strncasecmp(list, unit, unit_len)) {
+        return -1;
+    }
 
-    while (resource) {
-        if (is_index_query && ! strcmp("/index.html", resource->path)) {
-            break;
+    list += unit_len;
+
+    while (list < list_end) {
+        while (list < list_end && (*list == ',' || is_whitespace(*list))) {
+            list++;
         }
 
-        if (! strcmp(resource->path, req->target)) {
+        if (list == list_end) {
             break;
         }
 
-        resource = resource->next;
+        const char * spec_end = list;
+
+        while (spec_end < list_end && *spec_end != ',' && ! is_whitespace(*spec_end)) {
+            spec_end++;
+        }
+
+        const char * dash = memchr(list, '-', spec_end - list);
+
+        if (! dash || ++num_specs > MAX_RANGES) {
+            return -1;
+        }
+
+        ssize_t first = parse_range_pos(list, dash - list);
+        ssize_t last = parse_range_pos(dash + 1, spec_end - dash - 1);
+
+        if (dash == list) {
+            // A suffix range, which asks for the last `last` bytes
+            if (last == -1) {
+                return -1;
+            }
+
+            if (last && length) {
+                ranges[num_ranges].first = (size_t) last < length ? length - last : 0;
+                ranges[num_ranges].last = length - 1;
+                num_ranges++;
+            }
+        } else {
+            if (first == -1 || (dash + 1 < spec_end && (last == -1 || last < first))) {
+                return -1;
+            }
+
+            if ((size_t) first < length) {
+                ranges[num_ranges].first = first;
+                ranges[num_ranges].last = dash + 1 == spec_end || (size_t) last >= length ? length - 1 : (size_t) last;
+                num_ranges++;
+            }
+        }
+
+        list = spec_end;
+    }
+
+    return num_specs ? num_ranges : -1;
+}
+
+// Returns nonzero if the Range header should be used. With If-Range, the client only wants the
+// ranges if it still has the same version of the file, otherwise it wants the whole thing. The
+// validator has to match exactly: weak ETags never do.
+static int if_range_matches(const char * in_buf, struct http_req * req, struct file * representation) {
+    struct http_slice if_range = req->headers.known[REQ_HEADER_IF_RANGE];
+    time_t date;
+
+    if (! if_range.offset) {
+        return 1;
+    }
+
+    if (in_buf[if_range.offset] == '"') {
+        return slice_equals(in_buf, if_range, representation->etag);
+    }
+
+    return parse_http_date(in_buf, if_range, &date) && date == representation->mtime;
+}
+
+// Builds a multipart/byteranges body with one part for each range, and points the response at
+// it. Each part has its own Content-Type and Content-Range. Returns nonzero if the body couldn't
+// be built.
+static int build_multipart_body(
+    struct http_res * res,
+    struct file * representation,
+    const char * content_type,
+    struct byte_range * ranges,
+    int num_ranges
+) {
+    // The ETag is unique enough that it's not going to show up in the file
+    char boundary[ETAG_SIZE + 16];
+    char part_head[256];
+    size_t length = 0;
+
+    snprintf(boundary, sizeof boundary, "gru-http-%.*s", (int) strlen(representation->etag) - 2, representation->etag + 1);
+
+    for (int pass = 0; pass < 2; pass++) {
+        size_t pos = 0;
+
+        for (int i = 0; i < num_ranges; i++) {
+            size_t part_length = ranges[i].last - ranges[i].first + 1;
+            int head_len = snprintf(
+                part_head,
+                sizeof part_head,
+                "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %zu-%zu/%zu\r\n\r\n",
+                boundary,
+                content_type,
+                ranges[i].first,
+                ranges[i].last,
+                representation->content_length
+            );
+
+            if (head_len < 0 || (size_t) head_len >= sizeof part_head) {
+                return -1;
+            }
+
+            if (pass) {
+                memcpy(res->owned_content + pos, part_head, head_len);
+
+                if (representation->content) {
+                    if (copy_file_content(representation, ranges[i].first, part_length, res->owned_content + pos + head_len)) {
+                        return -1;
+                    }
+                } else if (pread(representation->fd, res->owned_content + pos + head_len, part_length, ranges[i].first) != (ssize_t) part_length) {
+                    return -1;
+                }
+            }
+
+            pos += head_len + part_length;
+        }
+
+        int tail_len = snprintf(part_head, sizeof part_head, "\r\n--%s--\r\n", boundary);
+
+        if (pass) {
+            memcpy(res->owned_content + pos, part_head, tail_len);
+        } else {
+            length = pos + tail_len;
+
+            if (length > MULTIPART_MAX_SIZE) {
+                return -1;
+            }
+
+            res->owned_content = malloc(length);
+
+            if (! res->owned_content) {
+                return -1;
+            }
+        }
+    }
+
+    size_t type_size = sizeof boundary + 64;
+    char * type_str = malloc(type_size);
+
+    if (! type_str) {
+        return -1;
+    }
+
+    snprintf(type_str, type_size, "multipart/byteranges; boundary=%s", boundary);
+    res->headers.headers[RES_HEADER_CONTENT_TYPE] = type_str;
+    res->content = res->owned_content;
+    res->content_length = length;
+
+    return 0;
+}
+
+// Sets up a 206 response with the requested ranges of the representation. If there's more than
+// one, they're sent as a multipart body. Returns the status code, or 0 if the whole
+// representation should be sent after all.
+static http_status_code serve_ranges(
+    struct http_res * res,
+    struct file * representation,
+    char * path,
+    struct byte_range * ranges,
+    int num_ranges
+) {
+    size_t len_str_size = sizeof(long) * 8 + 1;
+    char * len_str = malloc(len_str_size);
+
+    if (! len_str) {
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (num_ranges > 1) {
+        if (build_multipart_body(res, representation, get_content_type(path), ranges, num_ranges)) {
+            free(len_str);
+            free(res->owned_content);
+            res->owned_content = NULL;
+
+            return 0;
+        }
+    } else {
+        size_t range_str_size = sizeof(long) * 24 + 16;
+        char * range_str = malloc(range_str_size);
+        char * content_type = copy_str(get_content_type(path));
+
+        if (! range_str || ! content_type) {
+            free(range_str);
+            free(content_type);
+            free(len_str);
+
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        snprintf(
+            range_str,
+            range_str_size,
+            "bytes %zu-%zu/%zu",
+            ranges[0].first,
+            ranges[0].last,
+            representation->content_length
+        );
+        res->headers.headers[RES_HEADER_CONTENT_RANGE] = range_str;
+        res->headers.headers[RES_HEADER_CONTENT_TYPE] = content_type;
+        res->content = representation->content ? representation->content + ranges[0].first : NULL;
+        res->content_fd = representation->fd;
+        res->content_offset = ranges[0].first;
+        res->content_length = ranges[0].last - ranges[0].first + 1;
+    }
+
+    snprintf(len_str, len_str_size, "%zu", res->content_length);
+    res->headers.headers[RES_HEADER_CONTENT_LENGTH] = len_str;
+
+    return HTTP_PARTIAL_CONTENT;
+}
+
+// Sets up a response with the server's metrics. They're formatted on every request, because
+// they're meant to be scraped every few seconds at most.
+static http_status_code serve_metrics(struct http_res * res) {
+    size_t length;
+
+    res->owned_content = fmt_metrics(&length);
+
+    if (! res->owned_content) {
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    size_t len_str_size = sizeof(long) * 8 + 1;
+    char * len_str = malloc(len_str_size);
+    char * content_type = copy_str("text/plain; version=0.0.4");
+
+    if (! len_str || ! content_type) {
+        free(len_str);
+        free(content_type);
+
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    snprintf(len_str, len_str_size, "%zu", length);
+    res->headers.headers[RES_HEADER_CONTENT_LENGTH] = len_str;
+    res->headers.headers[RES_HEADER_CONTENT_TYPE] = content_type;
+    res->content = res->owned_content;
+    res->content_length = length;
+
+    return 0;
+}
+
+http_status_code try_get_resource(const char * in_buf, struct http_res * res, struct http_req * req) {
+    static const char index_path[] = "/index.html";
+    struct file * resource;
+
+    if (global_options.metrics_path && slice_equals(in_buf, req->target, global_options.metrics_path)) {
+        return serve_metrics(res);
+    }
+
+    if (slice_equals(in_buf, req->target, "/")) {
+        resource = acquire_static_file(index_path, ARR_SIZE(index_path) - 1);
+    } else {
+        resource = acquire_static_file(in_buf + req->target.offset, req->target.length);
     }
 
     if (! resource) {
         return HTTP_RESOURCE_NOT_FOUND;
     }
 
-    int never_use_cache = global_options.cache_option == NeverUseCache;
-    int must_use_cache = global_options.cache_option == AlwaysUseCache;
-    int will_use_cache = never_use_cache ||
-        (! must_use_cache &&
-         req->headers.known[REQ_HEADER_CACHE_CONTROL] &&
-         ! strcmp(req->headers.known[REQ_HEADER_CACHE_CONTROL], "no-cache")
-        );
+    res->file = resource;
+
+    // The file that we'll actually send, which may be a compressed version of the resource
+    struct file * representation = resource;
 
-    if (will_use_cache) {
-        reload_static_file(resource);
+    int encoding = choose_encoding(in_buf, req, resource);
+
+    if (encoding == -2) {
+        return HTTP_NOT_ACCEPTABLE;
+    }
+
+    if (encoding != -1) {
+        representation = resource->encodings[encoding];
+    }
+
+    int not_modified = is_not_modified(in_buf, req, representation);
+    int wants_ranges = req->method == Get && req->headers.known[REQ_HEADER_RANGE].offset;
+
+    // Most requests are for the whole file, and the head for those was rendered when it was
+    // loaded
+    if (representation->head && ! not_modified && ! wants_ranges) {
+        res->head_block = representation->head;
+        res->head_block_length = representation->head_length;
+        res->content = representation->content;
+        res->content_fd = representation->fd;
+        res->content_length = representation->content_length;
+
+        return 0;
+    }
+
+    for (size_t i = 0; i < NUM_ENCODINGS; i++) {
+        if (resource->encodings[i]) {
+            // Caches have to know that the response depends on Accept-Encoding, even if it
+            // isn't compressed
+            res->headers.headers[RES_HEADER_VARY] = copy_str("Accept-Encoding");
+
+            if (! res->headers.headers[RES_HEADER_VARY]) {
+                return HTTP_INTERNAL_SERVER_ERROR;
+            }
+
+            break;
+        }
+    }
+
+    res->headers.headers[RES_HEADER_ETAG] = copy_str(representation->etag);
+    res->headers.headers[RES_HEADER_LAST_MODIFIED] = copy_str(representation->last_modified);
+
+    // A 304 without its validators wouldn't tell the client what it should keep using
+    if (! res->headers.headers[RES_HEADER_ETAG] || ! res->headers.headers[RES_HEADER_LAST_MODIFIED]) {
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (not_modified) {
+        return HTTP_NOT_MODIFIED;
+    }
+
+    if (encoding != -1) {
+        res->headers.headers[RES_HEADER_CONTENT_ENCODING] = copy_str(content_encoding_names[encoding]);
+
+        // Without the header, the client would take the compressed body for the plain one
+        if (! res->headers.headers[RES_HEADER_CONTENT_ENCODING]) {
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    res->headers.headers[RES_HEADER_ACCEPT_RANGES] = copy_str("bytes");
+
+    // Ranges are counted in the bytes of the representation, so a client that asked for a
+    // compressed one gets ranges of the compressed file
+    if (wants_ranges && if_range_matches(in_buf, req, representation)) {
+        struct byte_range ranges[MAX_RANGES];
+        int num_ranges = parse_ranges(in_buf, req->headers.known[REQ_HEADER_RANGE], representation->content_length, ranges);
+
+        if (num_ranges == 0) {
+            size_t range_str_size = sizeof(long) * 8 + 16;
+            char * range_str = malloc(range_str_size);
+
+            if (! range_str) {
+                return HTTP_INTERNAL_SERVER_ERROR;
+            }
+
+            snprintf(range_str, range_str_size, "bytes */%zu", representation->content_length);
+            res->headers.headers[RES_HEADER_CONTENT_RANGE] = range_str;
+
+            return HTTP_RANGE_NOT_SATISFIABLE;
+        }
+
+        if (num_ranges > 0) {
+            http_status_code status = serve_ranges(res, representation, resource->path, ranges, num_ranges);
+
+            if (status) {
+                return status;
+            }
+        }
     }
 
     size_t len_str_size = sizeof(long) * 8 + 1;
     char * len_str = malloc(len_str_size);
-    snprintf(len_str, len_str_size, "%ld", resource->content_length);
+
+    if (! len_str) {
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    snprintf(len_str, len_str_size, "%zu", representation->content_length);
     res->headers.headers[RES_HEADER_CONTENT_LENGTH] = len_str;
-    res->headers.headers[RES_HEADER_CONTENT_TYPE] = get_content_type(resource->path);
+    res->headers.headers[RES_HEADER_CONTENT_TYPE] = copy_str(get_content_type(resource->path));
 
     if (req->method == Head) {
         return 0;
     }
 
-    res->content = resource->content;
-    res->content_length = resource->content_length;
+    res->content = representation->content;
+    res->content_fd = representation->fd;
+    res->content_length = representation->content_length;
 
     return 0;
 }
 
-void handle_http_req(const char * in_buf, size_t buf_size, struct http_req * req, struct http_res * res) {
-    http_status_code req_line_status = parse_req_line(in_buf, buf_size, req);
+int handle_http_req(const char * in_buf, size_t buf_size, struct http_req * req, struct http_res * res) {
+    uint64_t start_ns = now_ns();
+    // The receive buffer starts out bigger than small limits, so a whole head that's over the
+    // limit can arrive at once. Only the bytes within the limit may belong to the head.
+    size_t max_head_size = global_options.max_header_size;
+    size_t head_buf_size = buf_size < max_head_size ? buf_size : max_head_size;
+    http_status_code status = parse_req_head(in_buf, head_buf_size, req);
 
-    if (req_line_status) {
-        set_http_status(res, req_line_status);
+    if (req->parse_state != ParsingDone) {
+        if (buf_size < max_head_size) {
+            req->parse_ns += now_ns() - start_ns;
 
-        return;
+            return 0;
+        }
+
+        // The client has sent more than we're willing to buffer without finishing the head
+        if (req->parse_state == ParsingRequestLine) {
+            status = HTTP_URI_TOO_LONG;
+        } else {
+            status = HTTP_REQUEST_HEADER_FIELDS_TOO_LARGE;
+        }
+
+        req->parse_state = ParsingDone;
+    }
+
+    if (! status) {
+        status = parse_body_length(in_buf, req);
     }
 
-    http_status_code field_lines_status = parse_field_lines(in_buf, buf_size, req);
+    uint64_t parsed_ns = now_ns();
 
-    if (field_lines_status) {
-        set_http_status(res, field_lines_status);
+    req->parse_ns += parsed_ns - start_ns;
 
-        return;
+    if (! status) {
+        // The request is well-formed, so we know where the next one starts
+        res->keep_alive = wants_keep_alive(in_buf, req);
+        status = try_get_resource(in_buf, res, req);
     }
 
-    http_status_code get_resource_status = try_get_resource(res, req);
+    if (status) {
+        set_http_status(res, status);
+    } else {
+        res->status = HTTP_OK;
+    }
 
-    if (get_resource_status) {
-        set_http_status(res, get_resource_status);
+    if (req->method == Head) {
+        res->content = NULL;
+        res->content_fd = -1;
+    }
 
-        return;
+    if (req->version == Http11 && ! res->keep_alive) {
+        res->headers.headers[RES_HEADER_CONNECTION] = copy_str("close");
+    } else if (req->version == Http10 && res->keep_alive) {
+        res->headers.headers[RES_HEADER_CONNECTION] = copy_str("keep-alive");
     }
 
-    set_http_status(res, HTTP_OK);
+    res->lookup_ns = now_ns() - parsed_ns;
+
+    return 1;
 }
 
 static void status_to_str(http_status_code status, char out[4]) {
@@ -508,33 +1257,306 @@ static void status_to_str(http_status_code status, char out[4]) {
     out[3] = 0;
 }
 
-void send_http_res(struct http_res * res, int out_sock_fd) {
-    // TODO: Buffered write
+// Appends `len` bytes of `str` to `buf` at `*pos` if they fit. Returns -1 if they don't.
+static int append_str(char * buf, size_t buf_size, size_t * pos, const char * str, size_t len) {
+    if (*pos + len > buf_size) {
+        return -1;
+    }
 
-    write_sock(out_sock_fd, http_version_out, ARR_SIZE(http_version_out) - 1);
-    write_sock(out_sock_fd, " ", 1);
+    memcpy(buf + *pos, str, len);
+    *pos += len;
+
+    return 0;
+}
 
+size_t fmt_http_res_head(struct http_res * res, char * buf, size_t buf_size) {
+    size_t pos = 0;
     char status[4];
-    status_to_str(res->status, status);
+    int result = 0;
 
-    write_sock(out_sock_fd, status, 3);
-    write_sock(out_sock_fd, " \r\n", 3);
+    if (res->head_block) {
+        size_t i = 0;
+
+        while (i < RES_HEADER_MAX && ! res->headers.headers[i]) {
+            i++;
+        }
+
+        // Usually the block is the whole head, so it can be sent as it is
+        if (i == RES_HEADER_MAX) {
+            res->head = res->head_block;
+            res->head_length = res->head_block_length;
+
+            return res->head_length;
+        }
+
+        // Otherwise the other headers go before the empty line at the end of the block
+        result |= append_str(buf, buf_size, &pos, res->head_block, res->head_block_length - 2);
+    } else {
+        status_to_str(res->status, status);
+
+        result |= append_str(buf, buf_size, &pos, http_version_out, ARR_SIZE(http_version_out) - 1);
+        result |= append_str(buf, buf_size, &pos, " ", 1);
+        result |= append_str(buf, buf_size, &pos, status, 3);
+        result |= append_str(buf, buf_size, &pos, " \r\n", 3);
+    }
 
     for (size_t i = 0; i < RES_HEADER_MAX; i++) {
         if (res->headers.headers[i]) {
-            int name_len = strlen(res_header_names[i]);
-            int val_len = strlen(res->headers.headers[i]);
+            result |= append_str(buf, buf_size, &pos, res_header_names[i], strlen(res_header_names[i]));
+            result |= append_str(buf, buf_size, &pos, ": ", 2);
+            result |= append_str(buf, buf_size, &pos, res->headers.headers[i], strlen(res->headers.headers[i]));
+            result |= append_str(buf, buf_size, &pos, "\r\n", 2);
+        }
+    }
+
+    result |= append_str(buf, buf_size, &pos, "\r\n", 2);
+
+    if (result) {
+        return 0;
+    }
+
+    res->head = buf;
+    res->head_length = pos;
+
+    return pos;
+}
+
+// Renders the head of a 200 response with the file, and stores it in the file. `resource` is the
+// file that's requested, which may be `file` itself or the file that it's a compressed version
+// of.
+static void render_file_head(struct file * file, const struct file * resource, int encoding) {
+    char buf[HEAD_BLOCK_MAX_SIZE];
+    char len_str[sizeof(long) * 8 + 1];
+    struct http_res res = create_http_res();
+
+    snprintf(len_str, sizeof len_str, "%zu", file->content_length);
+
+    // The strings aren't copied, so the response must not be reset
+    res.status = HTTP_OK;
+    res.headers.headers[RES_HEADER_CONTENT_LENGTH] = len_str;
+    res.headers.headers[RES_HEADER_CONTENT_TYPE] = (char *) get_content_type(resource->path);
+    res.headers.headers[RES_HEADER_ETAG] = file->etag;
+    res.headers.headers[RES_HEADER_LAST_MODIFIED] = file->last_modified;
+    res.headers.headers[RES_HEADER_ACCEPT_RANGES] = "bytes";
+
+    if (encoding != -1) {
+        res.headers.headers[RES_HEADER_CONTENT_ENCODING] = (char *) content_encoding_names[encoding];
+    }
+
+    for (size_t i = 0; i < NUM_ENCODINGS; i++) {
+        if (resource->encodings[i]) {
+            res.headers.headers[RES_HEADER_VARY] = "Accept-Encoding";
+            break;
+        }
+    }
+
+    size_t length = fmt_http_res_head(&res, buf, sizeof buf);
+
+    if (! length) {
+        return;
+    }
+
+    file->head = malloc(length);
+
+    if (! file->head) {
+        return;
+    }
+
+    memcpy(file->head, buf, length);
+    file->head_length = length;
+}
+
+void render_file_heads(struct file * file) {
+    render_file_head(file, file, -1);
+
+    for (size_t i = 0; i < NUM_ENCODINGS; i++) {
+        if (file->encodings[i]) {
+            render_file_head(file->encodings[i], file, i);
+        }
+    }
+}
+
+// Serializes the response for an error status. The body is the status's name, unless there's a
+// custom error page for it.
+static void init_error_response(http_status_code status) {
+    char head[HEAD_BLOCK_MAX_SIZE];
+    char path[16];
+    char len_str[sizeof(long) * 8 + 1];
+    struct http_res res = create_http_res();
+    struct file * page = NULL;
+    char * page_body = NULL;
+    const char * body = http_status_names[status];
+    size_t body_length = strlen(body);
+
+    // The strings aren't copied, so the response must not be reset
+    res.status = status;
+    res.headers.headers[RES_HEADER_CONTENT_TYPE] = "text/plain; charset=us-ascii";
+
+    if (global_options.error_pages) {
+        snprintf(path, sizeof path, "/%d.html", status);
+        page = acquire_static_file(path, strlen(path));
+    }
+
+    if (page && ! page->content) {
+        printf("Error page %s is too big to be kept in memory, so it won't be used\n", path);
+    } else if (page) {
+        page_body = malloc(page->content_length);
 
-            write_sock(out_sock_fd, res_header_names[i], name_len);
-            write_sock(out_sock_fd, ": ", 2);
-            write_sock(out_sock_fd, res->headers.headers[i], val_len);
-            write_sock(out_sock_fd, "\r\n", 2);
+        if (! page_body) {
+            die();
         }
+
+        if (copy_file_content(page, 0, page->content_length, page_body)) {
+            printf("Error page %s was truncated while it was being loaded, so it won't be used\n", path);
+        } else {
+            body = page_body;
+            body_length = page->content_length;
+            res.headers.headers[RES_HEADER_CONTENT_TYPE] = "text/html";
+        }
+    }
+
+    snprintf(len_str, sizeof len_str, "%zu", body_length);
+    res.headers.headers[RES_HEADER_CONTENT_LENGTH] = len_str;
+
+    size_t head_length = fmt_http_res_head(&res, head, sizeof head);
+
+    if (! head_length) {
+        die();
     }
 
-    write_sock(out_sock_fd, "\r\n", 2);
+    char * data = malloc(head_length + body_length);
+
+    if (! data) {
+        die();
+    }
+
+    memcpy(data, head, head_length);
+    memcpy(data + head_length, body, body_length);
+    free(page_body);
+
+    error_responses[status] = (struct canned_response) {
+        .data = data,
+        .head_length = head_length,
+        .body_length = body_length
+    };
+
+    if (page) {
+        release_static_file(page);
+    }
+}
+
+void init_error_responses() {
+    for (http_status_code status = HTTP_BAD_REQUEST; status < HTTP_STATUS_MAX; status++) {
+        if (http_status_names[status]) {
+            init_error_response(status);
+        }
+    }
+}
+
+void free_error_responses() {
+    for (http_status_code status = HTTP_BAD_REQUEST; status < HTTP_STATUS_MAX; status++) {
+        free(error_responses[status].data);
+        error_responses[status].data = NULL;
+    }
+}
+
+size_t get_http_res_length(struct http_res * res) {
+    int has_body = res->content || res->content_fd != -1;
+
+    return res->head_length + (has_body ? res->content_length : 0);
+}
+
+int get_unsent_http_res(struct http_res * res, struct iovec iov[2]) {
+    size_t sent = res->bytes_sent;
+    size_t body_length = res->content ? res->content_length : 0;
+    int count = 0;
+
+    if (sent < res->head_length) {
+        iov[count].iov_base = (void *) (res->head + sent);
+        iov[count].iov_len = res->head_length - sent;
+        count++;
+        sent = 0;
+    } else {
+        sent -= res->head_length;
+    }
 
-    if (res->content) {
-        write_sock(out_sock_fd, res->content, res->content_length);
+    if (sent < body_length) {
+        iov[count].iov_base = (void *) (res->content + sent);
+        iov[count].iov_len = body_length - sent;
+        count++;
     }
+
+    return count;
+}
+
+// Sends as much of a file body as the socket will take with `sendfile`, once the head is out.
+// Returns the same values as `send_http_res`.
+static int send_file_body(struct http_res * res, int out_sock_fd) {
+    const size_t length = get_http_res_length(res);
+
+    while (res->bytes_sent < length) {
+        off_t offset = res->content_offset + res->bytes_sent - res->head_length;
+        ssize_t result = sendfile(out_sock_fd, res->content_fd, &offset, length - res->bytes_sent);
+
+        if (result == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 1;
+            }
+
+            if (errno == EINTR) {
+                continue;
+            }
+
+            perror("Failed to send file to socket");
+            return -1;
+        }
+
+        if (! result) {
+            // The file got shorter after we sent its Content-Length, so we can't finish the
+            // response
+            printf("File was truncated while it was being sent\n");
+            return -1;
+        }
+
+        res->bytes_sent += result;
+    }
+
+    return 0;
+}
+
+int send_http_res(struct http_res * res, int out_sock_fd) {
+    struct iovec iov[2];
+    struct msghdr msg;
+    // If the body comes from a file, we'd rather the head go out in the same segment as the
+    // start of the body
+    const int flags = MSG_NOSIGNAL | (res->content_fd != -1 ? MSG_MORE : 0);
+
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = iov;
+
+    // Usually the whole response goes out in the first call
+    while ((msg.msg_iovlen = get_unsent_http_res(res, iov))) {
+        ssize_t result = sendmsg(out_sock_fd, &msg, flags);
+
+        if (result == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 1;
+            }
+
+            if (errno == EINTR) {
+                continue;
+            }
+
+            perror("Failed to write to socket");
+            return -1;
+        }
+
+        res->bytes_sent += result;
+    }
+
+    if (res->content_fd != -1) {
+        return send_file_body(res, out_sock_fd);
+    }
+
+    return 0;
 }
@@ -17,20 +17,30 @@
  */
 #ifndef SRC_HTTP_H
 #define SRC_HTTP_H
+#include <stdint.h>
 #include <stdlib.h>
+#include <sys/uio.h>
+#include "params.h"
 #include "status.h"
 
-#define REQ_HEADER_ACCEPT           0
-#define REQ_HEADER_CACHE_CONTROL    1
-#define REQ_HEADER_CONTENT_TYPE     2
-#define REQ_HEADER_CONTENT_LENGTH   3
-#define REQ_HEADER_HOST             4
-#define REQ_HEADER_USER_AGENT       5
-#define REQ_HEADER_MAX              6
+// The known request headers are listed in req_headers.def
+enum req_header {
+#define REQ_HEADER(id, name) REQ_HEADER_##id,
+#include "req_headers.def"
+#undef REQ_HEADER
+    REQ_HEADER_MAX
+};
 
 #define RES_HEADER_CONTENT_LENGTH   0
 #define RES_HEADER_CONTENT_TYPE     1
-#define RES_HEADER_MAX              2
+#define RES_HEADER_CONNECTION       2
+#define RES_HEADER_ETAG             3
+#define RES_HEADER_LAST_MODIFIED    4
+#define RES_HEADER_CONTENT_ENCODING 5
+#define RES_HEADER_VARY             6
+#define RES_HEADER_ACCEPT_RANGES    7
+#define RES_HEADER_CONTENT_RANGE    8
+#define RES_HEADER_MAX              9
 
 #define ARR_SIZE(arr)           ((sizeof (arr)) / sizeof ((arr)[0]))
 
@@ -40,8 +50,46 @@ enum response_cache_option {
     AlwaysUseCache
 };
 
+enum io_backend {
+    EpollBackend,
+    IoUringBackend
+};
+
+enum log_level {
+    // Nothing is logged
+    LogOff,
+    // One line per response
+    LogAccess,
+    // Every request and response with its headers, and every connection that's opened or closed
+    LogVerbose
+};
+
 struct server_options {
     enum response_cache_option cache_option;
+    // The number of worker threads to start. Zero means one per CPU core.
+    size_t num_workers;
+    // The number of listen sockets to open with SO_REUSEPORT, each with its threads pinned to a
+    // CPU. This applies to a count of 1 as well. Zero means one socket, without SO_REUSEPORT or
+    // CPU pinning.
+    size_t num_shards;
+    // The largest request head (request line and field lines) that we'll buffer
+    size_t max_header_size;
+    // Files at least this big are kept open and sent with `sendfile` instead of being mapped into
+    // memory. Zero means every file is mapped.
+    size_t sendfile_min_size;
+    // Glob patterns (matched against the path that a file is served at) for the files whose
+    // pages should be read in at startup, instead of on the first request for them
+    const char * warm_patterns[MAX_WARM_PATTERNS];
+    size_t num_warm_patterns;
+    // How the workers do socket I/O. If io_uring isn't available, we fall back to epoll.
+    enum io_backend backend;
+    // Nonzero if files like "/404.html" in the static directory should be used as the bodies of
+    // error responses
+    int error_pages;
+    // The path that the server's metrics are served at, or NULL if they aren't served
+    const char * metrics_path;
+    // The log level that the server starts with. It can be changed while the server is running.
+    enum log_level log_level;
 };
 
 extern struct server_options global_options;
@@ -49,8 +97,17 @@ extern struct server_options global_options;
 extern const char * req_header_names[REQ_HEADER_MAX];
 extern const char * res_header_names[RES_HEADER_MAX];
 
+// A part of the buffer that a request was parsed from. Parsing doesn't copy anything out of the
+// buffer, so slices are offsets rather than pointers: they stay valid if the buffer is moved or
+// grown, as long as the request head is still at the start of it. Nothing in a request can start
+// at offset zero, so a slice with a zero offset means the field wasn't there.
+struct http_slice {
+    size_t offset;
+    size_t length;
+};
+
 struct req_headers {
-    char * known[REQ_HEADER_MAX];
+    struct http_slice known[REQ_HEADER_MAX];
     // TODO: Custom headers
 };
 
@@ -71,27 +128,121 @@ enum http_method {
     Unknown = 8,
 };
 
+#define NUM_HTTP_METHODS (Unknown + 1)
+
 extern const char * http_method_names[];
 
+enum http_version {
+    Http10 = 0,
+    Http11 = 1
+};
+
+enum http_parse_state {
+    ParsingRequestLine,
+    ParsingFieldLines,
+    ParsingDone
+};
+
 struct http_req {
     struct req_headers headers;
-    char * target;
+    struct http_slice target;
     enum http_method method;
+    enum http_version version;
+    enum http_parse_state parse_state;
+    // The start of the first line that hasn't been parsed yet. Once parsing is done, this is
+    // the length of the request head.
     size_t seek;
+    // How far we've searched for the end of the line at `seek`
+    size_t scan;
+    // The length of the message body that follows the request head. We don't do anything with
+    // request bodies, but we need to know where the next request starts.
+    size_t body_length;
+    // The time spent parsing the request head, in ns
+    uint64_t parse_ns;
 };
 struct http_req create_http_req();
 void reset_http_req(struct http_req * req);
 
 struct http_res {
     struct res_headers headers;
+    // The serialized status line and headers, set by `fmt_http_res_head`. This points into a
+    // buffer that the caller owns, or at `head_block`.
+    const char * head;
+    size_t head_length;
+    // A 200 response head that was rendered ahead of time, which belongs to `file`. The
+    // response's own headers are added to it.
+    const char * head_block;
+    size_t head_block_length;
     const char * content;
+    // If this isn't -1, the body is read from this file with `sendfile` instead of being in
+    // `content`
+    int content_fd;
+    // Where the body starts in `content_fd`
+    off_t content_offset;
     size_t content_length;
+    // A body that was built for this response (like a multipart one), which `content` points to.
+    // It's freed when the response is reset.
+    char * owned_content;
+    // The static file that the body comes from. The response holds a reference to it, so that
+    // `content` and `content_fd` stay valid even if the file is reloaded while it's being sent.
+    struct file * file;
+    // How many bytes of the response (head and body) have been written to the socket so far
+    size_t bytes_sent;
     http_status_code status;
+    // Nonzero if the connection should stay open for another request after this response
+    int keep_alive;
+    // The time spent looking up the resource and setting up the response, in ns
+    uint64_t lookup_ns;
 };
+struct file;
+
+// Serializes a response for every error status, so that errors can be sent without formatting
+// or allocating anything. With `error_pages` set, the bodies are taken from the static files
+// named after the status codes, if there are any. This must be called after the static files
+// have been loaded and before any requests are handled.
+void init_error_responses();
+void free_error_responses();
+
 struct http_res create_http_res();
 void reset_http_res(struct http_res * res);
 
-void handle_http_req(const char * in_buf, size_t buf_size, struct http_req * req, struct http_res * res);
-void send_http_res(struct http_res * res, int out_sock_fd);
+// Parses the request head at the start of `in_buf` and prepares a response. The head can arrive
+// in pieces: if it isn't complete yet, this returns 0 and should be called again with the same
+// buffer once more data has been appended to it. Parsing resumes where it left off. Returns 1
+// once the response is ready. Sets `res->keep_alive` if the request could be framed and the
+// client wants a persistent connection. The request's slices refer to `in_buf`, so the head must
+// stay at the start of the buffer until the request is reset.
+int handle_http_req(const char * in_buf, size_t buf_size, struct http_req * req, struct http_res * res);
+
+// Finds the resource for a request whose head has been parsed and sets up the response, apart
+// from its status line. Returns 0 if the resource can be sent, or the status to send instead.
+http_status_code try_get_resource(const char * in_buf, struct http_res * res, struct http_req * req);
+
+// Returns the media type of the file at the given path, going by its extension.
+const char * get_content_type(const char * filename);
+
+// Writes the status line and headers of the response (including the empty line that ends them)
+// to `buf` and points `res->head` at it, so that the head can be sent together with the body.
+// Returns the length of the head, or 0 if it doesn't fit in `buf_size` bytes.
+size_t fmt_http_res_head(struct http_res * res, char * buf, size_t buf_size);
+
+// Renders the head of a 200 response for the file and for each of its compressed versions, and
+// stores them in the files.
+void render_file_heads(struct file * file);
+
+// Returns the length of the whole response, head and body.
+size_t get_http_res_length(struct http_res * res);
+
+// Fills `iov` with the parts of the response that haven't been sent yet: what's left of the head,
+// then what's left of the body. Returns the number of entries used, which is 0 once everything
+// has been sent. A body in `content_fd` isn't included, because it has to be sent with
+// `sendfile`.
+int get_unsent_http_res(struct http_res * res, struct iovec iov[2]);
+
+// Sends as much of the formatted response as the socket will take without blocking, with one
+// `sendmsg` per attempt, followed by `sendfile` if the body is in a file. Returns 0 once the
+// whole response has been sent, 1 if the socket would block (call this again when it's
+// writable), and -1 if the connection failed.
+int send_http_res(struct http_res * res, int out_sock_fd);
 
 #endif
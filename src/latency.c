@@ -0,0 +1,142 @@
+/*
+ * This file is part of gru-http, an HTTP server.
+ * Copyright (C) 2024  Joe Desmond
+ *
+ * gru-http is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * gru-http is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with gru-http.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <time.h>
+#include "latency.h"
+#include "metrics.h"
+
+const char * latency_phase_names[NUM_LATENCY_PHASES] = {
+    [PhaseAccept] = "accept",
+    [PhaseWait] = "wait",
+    [PhaseRead] = "read",
+    [PhaseParse] = "parse",
+    [PhaseLookup] = "lookup",
+    [PhaseSend] = "send"
+};
+
+uint64_t now_ns() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ((uint64_t) ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// Durations below LATENCY_SUB_BUCKETS ns get a bucket each. Above that, the bucket is picked by
+// the position of the highest set bit and the LATENCY_SUB_BUCKET_BITS bits after it.
+static size_t get_bucket(uint64_t duration_ns) {
+    if (duration_ns < LATENCY_SUB_BUCKETS) {
+        return duration_ns;
+    }
+
+    int top_bit = 63 - __builtin_clzll(duration_ns);
+
+    if (top_bit >= LATENCY_MAX_BITS) {
+        return LATENCY_BUCKETS - 1;
+    }
+
+    int shift = top_bit - LATENCY_SUB_BUCKET_BITS;
+
+    return (size_t) (shift + 1) * LATENCY_SUB_BUCKETS + ((duration_ns >> shift) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+// Returns the longest duration that goes in the bucket
+static uint64_t get_bucket_end(size_t bucket) {
+    if (bucket < LATENCY_SUB_BUCKETS) {
+        return bucket;
+    }
+
+    int shift = bucket / LATENCY_SUB_BUCKETS - 1;
+    uint64_t sub_bucket = LATENCY_SUB_BUCKETS + bucket % LATENCY_SUB_BUCKETS;
+
+    return ((sub_bucket + 1) << shift) - 1;
+}
+
+void record_latency(struct latency_histogram * hist, uint64_t duration_ns) {
+    increment_counter(&hist->counts[get_bucket(duration_ns)]);
+    add_to_counter(&hist->sum_ns, duration_ns);
+
+    if (duration_ns > atomic_load_explicit(&hist->max_ns, memory_order_relaxed)) {
+        atomic_store_explicit(&hist->max_ns, duration_ns, memory_order_relaxed);
+    }
+}
+
+void add_latency_totals(struct latency_totals * totals, struct latency_histogram * hist) {
+    for (size_t i = 0; i < LATENCY_BUCKETS; i++) {
+        size_t count = atomic_load_explicit(&hist->counts[i], memory_order_relaxed);
+
+        totals->counts[i] += count;
+        totals->count += count;
+    }
+
+    totals->sum_ns += atomic_load_explicit(&hist->sum_ns, memory_order_relaxed);
+
+    size_t max_ns = atomic_load_explicit(&hist->max_ns, memory_order_relaxed);
+
+    if (max_ns > totals->max_ns) {
+        totals->max_ns = max_ns;
+    }
+}
+
+uint64_t get_latency_quantile(const struct latency_totals * totals, double quantile) {
+    if (! totals->count) {
+        return 0;
+    }
+
+    // The rank of the duration we want, counting from 1
+    size_t rank = (size_t) (quantile * totals->count);
+
+    if (rank < quantile * totals->count || ! rank) {
+        rank++;
+    }
+
+    size_t seen = 0;
+
+    for (size_t i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += totals->counts[i];
+
+        if (seen >= rank) {
+            uint64_t end = get_bucket_end(i);
+
+            // The max is exact, so there's no need to round past it
+            return end < totals->max_ns ? end : totals->max_ns;
+        }
+    }
+
+    return totals->max_ns;
+}
+
+void print_latency_report(FILE * out, const struct latency_totals totals[NUM_LATENCY_PHASES]) {
+    fprintf(out, "%-8s %12s %10s %10s %10s %10s %12s\n", "phase", "count", "mean us", "p50 us", "p99 us", "p99.9 us", "max us");
+
+    for (size_t i = 0; i < NUM_LATENCY_PHASES; i++) {
+        const struct latency_totals * phase = totals + i;
+
+        fprintf(
+            out,
+            "%-8s %12zu %10.1f %10.1f %10.1f %10.1f %12.1f\n",
+            latency_phase_names[i],
+            phase->count,
+            phase->count ? phase->sum_ns / 1000.0 / phase->count : 0.0,
+            get_latency_quantile(phase, 0.5) / 1000.0,
+            get_latency_quantile(phase, 0.99) / 1000.0,
+            get_latency_quantile(phase, 0.999) / 1000.0,
+            phase->max_ns / 1000.0
+        );
+    }
+}
@@ -0,0 +1,86 @@
+/*
+ * This file is part of gru-http, an HTTP server.
+ * Copyright (C) 2024  Joe Desmond
+ *
+ * gru-http is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * gru-http is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with gru-http.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef SRC_LATENCY_H
+#define SRC_LATENCY_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Durations are counted in log-linear buckets, like an HDR histogram: each power of two is split
+// into 2^LATENCY_SUB_BUCKET_BITS equal buckets, so a duration is known to within about 3% no
+// matter how long it is. Durations of 2^LATENCY_MAX_BITS ns (about 18 minutes) or more all go in
+// the last bucket.
+#define LATENCY_SUB_BUCKET_BITS     5
+#define LATENCY_SUB_BUCKETS         (1 << LATENCY_SUB_BUCKET_BITS)
+#define LATENCY_MAX_BITS            40
+#define LATENCY_BUCKETS             ((LATENCY_MAX_BITS - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+// The parts of handling a connection that we time
+enum latency_phase {
+    // From the acceptor accepting a socket to a worker taking it off the accept queue. Only the
+    // backends with an acceptor thread have this phase.
+    PhaseAccept,
+    // A worker blocking in the kernel until it has something to do
+    PhaseWait,
+    // One read from a socket. The io_uring backend's reads are done by the kernel while the worker
+    // is waiting, so they aren't timed.
+    PhaseRead,
+    // Parsing a request head, across every time more of it arrived
+    PhaseParse,
+    // Finding the static file (or error response) for a request and setting up the response
+    PhaseLookup,
+    // From a response being ready to its last byte being handed to the kernel
+    PhaseSend,
+    NUM_LATENCY_PHASES
+};
+
+extern const char * latency_phase_names[NUM_LATENCY_PHASES];
+
+// One thread's durations for one phase. Like the other metrics, only that thread writes to it.
+struct latency_histogram {
+    atomic_size_t counts[LATENCY_BUCKETS];
+    atomic_size_t sum_ns;
+    atomic_size_t max_ns;
+};
+
+// The sum of several threads' histograms, taken at one point in time
+struct latency_totals {
+    size_t counts[LATENCY_BUCKETS];
+    size_t count;
+    size_t sum_ns;
+    size_t max_ns;
+};
+
+// Returns the current time on the monotonic clock, in nanoseconds.
+uint64_t now_ns();
+
+void record_latency(struct latency_histogram * hist, uint64_t duration_ns);
+
+// Adds the histogram to the totals. `totals` must be zeroed before the first call.
+void add_latency_totals(struct latency_totals * totals, struct latency_histogram * hist);
+
+// Returns the duration that the given fraction of durations were at most, rounded up to the end
+// of its bucket, or 0 if there are none.
+uint64_t get_latency_quantile(const struct latency_totals * totals, double quantile);
+
+// Prints a table with the count, percentiles and max of each phase, in microseconds.
+void print_latency_report(FILE * out, const struct latency_totals totals[NUM_LATENCY_PHASES]);
+
+#endif
@@ -0,0 +1,421 @@
+/*
+ * This file is part of gru-http, an HTTP server.
+ * Copyright (C) 2024  Joe Desmond
+ *
+ * gru-http is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * gru-http is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with gru-http.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include "error.h"
+#include "log.h"
+#include "metrics.h"
+#include "queue.h"
+
+_Static_assert(! (LOG_RING_SIZE & (LOG_RING_SIZE - 1)), "LOG_RING_SIZE must be a power of 2");
+_Static_assert(LOG_RECORD_MAX_SIZE <= LOG_RING_SIZE, "A log record must fit in a thread's buffer");
+
+const char * log_level_names[] = {
+    [LogOff] = "off",
+    [LogAccess] = "access",
+    [LogVerbose] = "verbose"
+};
+
+// A single-producer, single-consumer ring of log text. The thread that owns it appends whole
+// records and the writer takes whatever is there. The positions only ever grow, and are taken
+// modulo the size to index `data`.
+struct log_ring {
+    // Only written by the owning thread
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t head;
+    atomic_size_t dropped;
+    // Set when the owning thread exits. The writer frees the ring once it's empty.
+    atomic_bool dead;
+    pid_t tid;
+    // Only written by the writer
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t tail;
+    struct log_ring * next;
+    char data[LOG_RING_SIZE];
+};
+
+static atomic_int level = LogAccess;
+
+// Every thread's ring, newest first. Rings are added the first time a thread logs something.
+// Only the writer takes them out, after their threads have exited, so it never has to worry
+// about a ring going away while it's draining the list.
+static _Atomic(struct log_ring *) rings = NULL;
+static _Thread_local struct log_ring * thread_ring = NULL;
+// Marks the calling thread's ring as dead when the thread exits
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+// Held to take rings out of the list, and by anything other than the writer that walks it
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+// The dropped records of rings that have been freed
+static size_t freed_dropped = 0;
+
+static pthread_t writer;
+static int writer_started = 0;
+// Becomes readable when the writer should stop
+static int stop_fd = -1;
+
+void set_log_level(enum log_level new_level) {
+    atomic_store_explicit(&level, new_level, memory_order_relaxed);
+}
+
+enum log_level get_log_level() {
+    return atomic_load_explicit(&level, memory_order_relaxed);
+}
+
+int log_enabled(enum log_level record_level) {
+    return record_level <= get_log_level();
+}
+
+static void release_thread_ring(void * arg) {
+    struct log_ring * ring = arg;
+
+    // Anything the thread logged is visible to the writer once it sees this
+    atomic_store_explicit(&ring->dead, 1, memory_order_release);
+    thread_ring = NULL;
+}
+
+static void create_ring_key() {
+    int status = pthread_key_create(&ring_key, release_thread_ring);
+
+    if (status) {
+        errno = status;
+        die();
+    }
+}
+
+// Returns the calling thread's ring, or NULL if it didn't have one and it couldn't be allocated
+static struct log_ring * get_thread_ring() {
+    if (thread_ring) {
+        return thread_ring;
+    }
+
+    pthread_once(&ring_key_once, create_ring_key);
+
+    struct log_ring * ring = aligned_alloc(CACHE_LINE_SIZE, sizeof(struct log_ring));
+
+    if (! ring) {
+        return NULL;
+    }
+
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->dropped, 0);
+    atomic_init(&ring->dead, 0);
+    atomic_init(&ring->tail, 0);
+    ring->tid = gettid();
+    ring->next = atomic_load_explicit(&rings, memory_order_relaxed);
+
+    while (! atomic_compare_exchange_weak_explicit(&rings, &ring->next, ring, memory_order_release, memory_order_relaxed));
+
+    // The main thread's ring has no destructor to run, so it's freed when the writer stops
+    pthread_setspecific(ring_key, ring);
+    thread_ring = ring;
+
+    return ring;
+}
+
+void begin_log_record(struct log_record * record) {
+    struct log_ring * ring = get_thread_ring();
+
+    record->length = 0;
+    append_log_record(record, "[Thread %d] ", ring ? ring->tid : gettid());
+}
+
+static void append_log_record_v(struct log_record * record, const char * fmt, va_list args) {
+    size_t space = LOG_RECORD_MAX_SIZE - record->length;
+    int len = vsnprintf(record->data + record->length, space, fmt, args);
+
+    if (len < 0) {
+        return;
+    }
+
+    // vsnprintf always leaves room for a null terminator, which we don't need
+    record->length += (size_t) len < space ? (size_t) len : space - 1;
+}
+
+void append_log_record(struct log_record * record, const char * fmt, ...) {
+    va_list args;
+
+    va_start(args, fmt);
+    append_log_record_v(record, fmt, args);
+    va_end(args);
+}
+
+void commit_log_record(struct log_record * record) {
+    struct log_ring * ring = get_thread_ring();
+
+    if (! ring) {
+        return;
+    }
+
+    if (! record->length || record->data[record->length - 1] != '\n') {
+        if (record->length == LOG_RECORD_MAX_SIZE) {
+            record->length--;
+        }
+
+        record->data[record->length++] = '\n';
+    }
+
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    if (LOG_RING_SIZE - (head - tail) < record->length) {
+        increment_counter(&ring->dropped);
+
+        return;
+    }
+
+    size_t start = head & (LOG_RING_SIZE - 1);
+    size_t first_part = LOG_RING_SIZE - start;
+
+    if (first_part >= record->length) {
+        memcpy(ring->data + start, record->data, record->length);
+    } else {
+        memcpy(ring->data + start, record->data, first_part);
+        memcpy(ring->data, record->data + first_part, record->length - first_part);
+    }
+
+    atomic_store_explicit(&ring->head, head + record->length, memory_order_release);
+}
+
+void log_line(enum log_level record_level, const char * fmt, ...) {
+    if (! log_enabled(record_level)) {
+        return;
+    }
+
+    struct log_record record;
+    va_list args;
+
+    begin_log_record(&record);
+    va_start(args, fmt);
+    append_log_record_v(&record, fmt, args);
+    va_end(args);
+    commit_log_record(&record);
+}
+
+size_t get_dropped_log_records() {
+    pthread_mutex_lock(&rings_lock);
+
+    size_t dropped = freed_dropped;
+
+    for (struct log_ring * ring = atomic_load_explicit(&rings, memory_order_acquire); ring; ring = ring->next) {
+        dropped += atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+    }
+
+    pthread_mutex_unlock(&rings_lock);
+
+    return dropped;
+}
+
+static void write_batch(const char * batch, size_t length) {
+    while (length) {
+        ssize_t written = write(STDOUT_FILENO, batch, length);
+
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            // There's nowhere to report this, and the records can't be kept forever
+            return;
+        }
+
+        batch += written;
+        length -= written;
+    }
+}
+
+// Takes the ring of a thread that has exited out of the list and frees it. `prev` is the ring
+// before it, or NULL if it was first in the list when the writer loaded it. Only the writer
+// calls this, after emptying the ring.
+static void free_dead_ring(struct log_ring * prev, struct log_ring * ring) {
+    pthread_mutex_lock(&rings_lock);
+
+    if (! prev) {
+        struct log_ring * first = ring;
+
+        // Threads only ever add rings at the front, so if it isn't first anymore then it's
+        // somewhere after the new ones
+        if (! atomic_compare_exchange_strong_explicit(&rings, &first, ring->next, memory_order_acquire, memory_order_acquire)) {
+            for (prev = first; prev->next != ring; prev = prev->next);
+        }
+    }
+
+    if (prev) {
+        prev->next = ring->next;
+    }
+
+    freed_dropped += atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+    pthread_mutex_unlock(&rings_lock);
+    free(ring);
+}
+
+// Moves everything in the threads' buffers to stdout, and frees the buffers of threads that have
+// exited. Returns the number of bytes written.
+static size_t drain_rings(char * batch) {
+    size_t batch_length = 0;
+    size_t total = 0;
+    struct log_ring * prev = NULL;
+    struct log_ring * next;
+
+    for (struct log_ring * ring = atomic_load_explicit(&rings, memory_order_acquire); ring; ring = next) {
+        // Checked before loading the head, so that a dead ring is always drained all the way
+        int dead = atomic_load_explicit(&ring->dead, memory_order_acquire);
+        size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+        while (tail != head) {
+            if (batch_length == LOG_BATCH_SIZE) {
+                write_batch(batch, batch_length);
+                total += batch_length;
+                batch_length = 0;
+            }
+
+            size_t start = tail & (LOG_RING_SIZE - 1);
+            size_t length = head - tail;
+
+            // Stop at the end of the buffer or the batch, whichever comes first
+            if (length > LOG_RING_SIZE - start) {
+                length = LOG_RING_SIZE - start;
+            }
+
+            if (length > LOG_BATCH_SIZE - batch_length) {
+                length = LOG_BATCH_SIZE - batch_length;
+            }
+
+            memcpy(batch + batch_length, ring->data + start, length);
+            batch_length += length;
+            tail += length;
+            // Give the space back as soon as it's copied, so that the thread can keep logging
+            atomic_store_explicit(&ring->tail, tail, memory_order_release);
+        }
+
+        next = ring->next;
+
+        if (dead) {
+            free_dead_ring(prev, ring);
+        } else {
+            prev = ring;
+        }
+    }
+
+    write_batch(batch, batch_length);
+
+    return total + batch_length;
+}
+
+static void * run_log_writer(void * arg) {
+    char * batch = arg;
+    struct pollfd poll_arg = {
+        .fd = stop_fd,
+        .events = POLLIN
+    };
+
+    while (1) {
+        if (drain_rings(batch)) {
+            continue;
+        }
+
+        int status = poll(&poll_arg, 1, LOG_FLUSH_INTERVAL_MS);
+
+        if (status == -1 && errno != EINTR) {
+            perror("Failed to poll log writer's stop eventfd");
+        } else if (status > 0) {
+            break;
+        }
+    }
+
+    // The threads that log have stopped by now, so this gets everything
+    drain_rings(batch);
+    free(batch);
+
+    return NULL;
+}
+
+void start_log_writer() {
+    char * batch = malloc(LOG_BATCH_SIZE);
+
+    if (! batch) {
+        die();
+    }
+
+    stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (stop_fd == -1) {
+        die();
+    }
+
+    int status = pthread_create(&writer, NULL, run_log_writer, batch);
+
+    if (status) {
+        errno = status;
+        die();
+    }
+
+    pthread_setname_np(writer, "log writer");
+    writer_started = 1;
+}
+
+void stop_log_writer() {
+    const uint64_t one = 1;
+
+    if (! writer_started) {
+        return;
+    }
+
+    if (write(stop_fd, &one, sizeof one) == -1) {
+        perror("Failed to stop log writer");
+    }
+
+    int status = pthread_join(writer, NULL);
+
+    if (status) {
+        errno = status;
+        perror("Failed to join log writer");
+    }
+
+    close(stop_fd);
+    stop_fd = -1;
+    writer_started = 0;
+
+    size_t dropped = get_dropped_log_records();
+
+    if (dropped) {
+        printf("Dropped %zu log records because the log couldn't keep up\n", dropped);
+    }
+
+    struct log_ring * ring = atomic_exchange(&rings, NULL);
+
+    while (ring) {
+        struct log_ring * next = ring->next;
+
+        free(ring);
+        ring = next;
+    }
+
+    freed_dropped = 0;
+    thread_ring = NULL;
+}
@@ -0,0 +1,63 @@
+/*
+ * This file is part of gru-http, an HTTP server.
+ * Copyright (C) 2024  Joe Desmond
+ *
+ * gru-http is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * gru-http is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with gru-http.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef SRC_LOG_H
+#define SRC_LOG_H
+
+#include <stddef.h>
+#include "http.h"
+#include "params.h"
+
+// Logging never blocks the thread that logs. Each thread formats its records into its own ring
+// buffer, and a writer thread collects them from every buffer and writes them to stdout in
+// batches. If a thread's buffer is full, its records are dropped and counted instead. A thread's
+// buffer is freed once the thread has exited and the writer has emptied it.
+
+// A record that's being built. It's written to the thread's buffer all at once, so the lines in
+// it are never split up by another thread's.
+struct log_record {
+    size_t length;
+    char data[LOG_RECORD_MAX_SIZE];
+};
+
+extern const char * log_level_names[];
+
+void set_log_level(enum log_level level);
+enum log_level get_log_level();
+
+// Returns nonzero if records at the given level should be logged.
+int log_enabled(enum log_level level);
+
+// Starts a record with the calling thread's ID.
+void begin_log_record(struct log_record * record);
+// Appends to the record. Anything past LOG_RECORD_MAX_SIZE is cut off.
+void append_log_record(struct log_record * record, const char * fmt, ...) __attribute__((format(printf, 2, 3)));
+// Puts the record in the calling thread's buffer, ending it with a newline if it doesn't have one.
+void commit_log_record(struct log_record * record);
+
+// Logs a one-line record if records at the given level should be logged.
+void log_line(enum log_level level, const char * fmt, ...) __attribute__((format(printf, 2, 3)));
+
+// The number of records that were dropped because a thread's buffer was full
+size_t get_dropped_log_records();
+
+// The writer has to be stopped after every thread that logs has stopped. Any records that are
+// left are written before it returns.
+void start_log_writer();
+void stop_log_writer();
+
+#endif
@@ -24,8 +24,11 @@
 #include "params.h"
 #include "error.h"
 #include "files.h"
+#include "log.h"
+#include "watch.h"
 #include "http.h"
 #include "net.h"
+#include "scan.h"
 
 const char * argp_program_version = "gru-http 1.0";
 const char * argp_program_bug_address = "dezzmeister16@gmail.com";
@@ -47,16 +50,116 @@ static struct argp_option argp_options[] = {
         .key = 'c',
         .arg = "never|always",
         .flags = 0,
-        .doc = "Overrides default caching behavior for responses. Pass \"never\" "
-            "to force the server to load the requested resource from the filesystem "
-            "on every request. Pass \"always\" to force the server to ignore "
-            "\"Cache-Control: no-cache\" and return cached resources on every "
-            "request. The default behavior is for the server to return a cached "
-            "resource, unless the \"Cache-Control\" header is present and specifies "
-            "\"no-cache\".",
+        .doc = "Overrides default caching behavior for responses. By default, the "
+            "server watches the static directory and reloads files in the background as "
+            "soon as they change, so responses are always fresh and requests never wait "
+            "on the filesystem. Pass \"always\" to load the files once and never reload "
+            "them. \"never\" is the same as the default.",
         .group = 0
 
     },
+    {
+        .name = "workers",
+        .key = 'w',
+        .arg = "COUNT",
+        .flags = 0,
+        .doc = "The number of worker threads that handle connections. The workers are "
+            "started once, before the server begins listening, and each one multiplexes "
+            "many connections. The default is one worker per CPU core. With --shards, "
+            "the workers are divided evenly among the shards.",
+        .group = 0
+    },
+    {
+        .name = "shards",
+        .key = 's',
+        .arg = "COUNT",
+        .flags = 0,
+        .doc = "Opens COUNT listen sockets on the same address with SO_REUSEPORT, so "
+            "that the kernel spreads connections across them. Each shard has its own "
+            "acceptor thread and workers, all pinned to one CPU. Send 's' on stdin to "
+            "see how connections are distributed. By default there is one listen socket "
+            "and threads aren't pinned.",
+        .group = 0
+    },
+    {
+        .name = "max-header-size",
+        .key = 'm',
+        .arg = "BYTES",
+        .flags = 0,
+        .doc = "The largest request head (request line and headers) that the server "
+            "will accept. Requests with longer heads are rejected with 414 or 431. "
+            "The default is 8192.",
+        .group = 0
+    },
+    {
+        .name = "sendfile-min",
+        .key = 'f',
+        .arg = "BYTES",
+        .flags = 0,
+        .doc = "Files of at least BYTES bytes are kept open and sent straight from disk "
+            "with sendfile, instead of being mapped into memory. Pass 0 to map every "
+            "file. The default is 1048576 (1 MiB).",
+        .group = 0
+    },
+    {
+        .name = "warm",
+        .key = 'W',
+        .arg = "GLOB",
+        .flags = 0,
+        .doc = "Static files are mapped into memory when the server starts, but their "
+            "contents aren't read from disk until they're first requested. Files whose "
+            "path (as requested, e.g. \"/img/*.jpg\") matches GLOB are read in ahead "
+            "of time in the background instead. Can be given more than once.",
+        .group = 0
+    },
+    {
+        .name = "error-pages",
+        .key = 'e',
+        .arg = NULL,
+        .flags = 0,
+        .doc = "Uses the files in DIR that are named after a status code, like "
+            "\"404.html\", as the bodies of error responses with that status. They're "
+            "read once, when the server starts. By default, error responses have a "
+            "short plain text body.",
+        .group = 0
+    },
+    {
+        .name = "metrics",
+        .key = 'M',
+        .arg = "PATH",
+        .flags = 0,
+        .doc = "Serves counters for requests, responses, bytes sent, static file "
+            "lookups, connections and accept queue depth at PATH (e.g. \"/metrics\"), "
+            "in the Prometheus text format. PATH takes precedence over a static file with "
+            "the same path. By default, metrics aren't served.",
+        .group = 0
+    },
+    {
+        .name = "log",
+        .key = 'l',
+        .arg = "off|access|verbose",
+        .flags = 0,
+        .doc = "Sets what's logged to stdout. \"access\" logs one line per response, with "
+            "the method, target, status and bytes sent. \"verbose\" also logs every "
+            "request and response header and every connection that's opened or closed, "
+            "which costs a lot of throughput. Records are written by a background thread, "
+            "and dropped if it can't keep up. Send 'l' on stdin to change the level while "
+            "the server is running. The default is \"access\".",
+        .group = 0
+    },
+    {
+        .name = "backend",
+        .key = 'b',
+        .arg = "epoll|io_uring",
+        .flags = 0,
+        .doc = "Selects how the workers do socket I/O. With \"epoll\", each worker "
+            "waits for readiness events and calls accept, read and write itself. With "
+            "\"io_uring\", each worker submits accepts, receives and sends to its own "
+            "io_uring instance and only makes a system call when it runs out of work. "
+            "If io_uring isn't supported, the server falls back to epoll. The default "
+            "is \"epoll\".",
+        .group = 0
+    },
     { 0 }
 };
 
@@ -108,6 +211,113 @@ static error_t arg_parser(int key, char * arg, struct argp_state * state) {
 
             break;
         }
+        case 'f': {
+            char * end;
+            long long sendfile_min_size = strtoll(arg, &end, 10);
+
+            if (*end || ! *arg || sendfile_min_size < 0) {
+                printf("Invalid --sendfile-min option, must be a number of bytes\n");
+                argp_usage(state);
+            }
+
+            global_options.sendfile_min_size = sendfile_min_size;
+
+            break;
+        }
+        case 'e': {
+            global_options.error_pages = 1;
+
+            break;
+        }
+        case 'M': {
+            if (arg[0] != '/') {
+                printf("Invalid --metrics option, must be a path starting with '/'\n");
+                argp_usage(state);
+            }
+
+            global_options.metrics_path = arg;
+
+            break;
+        }
+        case 'W': {
+            if (global_options.num_warm_patterns == MAX_WARM_PATTERNS) {
+                printf("Too many --warm options, the limit is %d\n", MAX_WARM_PATTERNS);
+                argp_usage(state);
+            }
+
+            global_options.warm_patterns[global_options.num_warm_patterns++] = arg;
+
+            break;
+        }
+        case 'l': {
+            if (! strcmp(arg, "off")) {
+                global_options.log_level = LogOff;
+            } else if (! strcmp(arg, "access")) {
+                global_options.log_level = LogAccess;
+            } else if (! strcmp(arg, "verbose")) {
+                global_options.log_level = LogVerbose;
+            } else {
+                printf("Invalid --log option\n");
+                argp_usage(state);
+            }
+
+            break;
+        }
+        case 'b': {
+            if (! strcmp(arg, "epoll")) {
+                global_options.backend = EpollBackend;
+            } else if (! strcmp(arg, "io_uring")) {
+                global_options.backend = IoUringBackend;
+            } else {
+                printf("Invalid --backend option\n");
+                argp_usage(state);
+            }
+
+            break;
+        }
+        case 'w': {
+            char * end;
+            long num_workers = strtol(arg, &end, 10);
+
+            if (*end || num_workers < 1 || num_workers > MAX_WORKERS) {
+                printf("Invalid --workers option, must be in the range [1, %d]\n", MAX_WORKERS);
+                argp_usage(state);
+            }
+
+            global_options.num_workers = num_workers;
+
+            break;
+        }
+        case 's': {
+            char * end;
+            long num_shards = strtol(arg, &end, 10);
+
+            if (*end || num_shards < 1 || num_shards > MAX_SHARDS) {
+                printf("Invalid --shards option, must be in the range [1, %d]\n", MAX_SHARDS);
+                argp_usage(state);
+            }
+
+            global_options.num_shards = num_shards;
+
+            break;
+        }
+        case 'm': {
+            char * end;
+            long max_header_size = strtol(arg, &end, 10);
+
+            if (*end || max_header_size < MIN_HEADER_SIZE || max_header_size > MAX_HEADER_SIZE) {
+                printf(
+                    "Invalid --max-header-size option, must be in the range [%d, %d]\n",
+                    MIN_HEADER_SIZE,
+                    MAX_HEADER_SIZE
+                );
+                argp_usage(state);
+            }
+
+            global_options.max_header_size = max_header_size;
+
+            break;
+        }
         default:
             return ARGP_ERR_UNKNOWN;
     }
@@ -116,6 +326,10 @@ static error_t arg_parser(int key, char * arg, struct argp_state * state) {
 }
 
 int main(int argc, char ** const argv) {
+    // Logs are written straight to stdout by the log writer, so anything printed with stdio has
+    // to go out a line at a time to stay in order with them
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
     struct argp parser = {
         .options = argp_options,
         .parser = arg_parser,
@@ -132,17 +346,11 @@ int main(int argc, char ** const argv) {
         die();
     }
 
-    switch (global_options.cache_option) {
-        case NeverUseCache: {
-            printf("Caching is disabled\n");
-            break;
-        }
-        case AlwaysUseCache: {
-            printf("Caching is forced\n");
-            break;
-        }
-        case DefaultUseCache: {}
-    };
+    if (global_options.cache_option == AlwaysUseCache) {
+        printf("Static files will not be reloaded when they change\n");
+    } else {
+        init_static_watcher();
+    }
 
     int port = atoi(port_str);
 
@@ -167,10 +375,18 @@ int main(int argc, char ** const argv) {
     }
 
     printf("Loading static files from %s\n", static_dir);
+    init_scanners();
     load_static_dir(static_dir);
+    init_error_responses();
+    start_static_watcher();
+    set_log_level(global_options.log_level);
+    start_log_writer();
 
     listen_for_connections(&my_addr);
 
+    stop_log_writer();
+    stop_static_watcher();
+    free_error_responses();
     free_static_dir();
 
     return 0;
@@ -0,0 +1,253 @@
+/*
+ * This file is part of gru-http, an HTTP server.
+ * Copyright (C) 2024  Joe Desmond
+ *
+ * gru-http is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * gru-http is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with gru-http.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include "params.h"
+#include "log.h"
+#include "metrics.h"
+
+struct queue_source {
+    size_t shard;
+    struct fd_queue * queue;
+};
+
+// Workers can be serving requests for the metrics while the later shards are still being
+// started, so the counts are published after the entries are filled in
+static struct worker_metrics * workers[MAX_WORKERS];
+static atomic_size_t num_workers = 0;
+static struct queue_source queues[MAX_SHARDS];
+static atomic_size_t num_queues = 0;
+
+void increment_counter(atomic_size_t * counter) {
+    add_to_counter(counter, 1);
+}
+
+void add_to_counter(atomic_size_t * counter, size_t amount) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + amount, memory_order_relaxed);
+}
+
+void record_response(struct worker_metrics * metrics, const struct connection * conn) {
+    const struct http_req * req = &conn->req;
+    const struct http_res * res = &conn->res;
+
+    record_latency(&metrics->latency[PhaseParse], req->parse_ns);
+    record_latency(&metrics->latency[PhaseLookup], res->lookup_ns);
+    record_latency(&metrics->latency[PhaseSend], now_ns() - conn->res_ready_ns);
+
+    increment_counter(&metrics->requests_by_method[req->method]);
+    increment_counter(&metrics->responses_by_status[res->status]);
+    add_to_counter(&metrics->bytes_sent, res->bytes_sent);
+
+    if (res->file) {
+        increment_counter(&metrics->static_hits);
+    } else if (res->status == HTTP_RESOURCE_NOT_FOUND) {
+        increment_counter(&metrics->static_misses);
+    }
+}
+
+void register_worker_metrics(struct worker_metrics * metrics) {
+    size_t i = atomic_load_explicit(&num_workers, memory_order_relaxed);
+
+    // There can only be more workers than this if there are more CPUs than this
+    if (i == MAX_WORKERS) {
+        return;
+    }
+
+    workers[i] = metrics;
+    atomic_store_explicit(&num_workers, i + 1, memory_order_release);
+}
+
+void register_accept_queue(size_t shard, struct fd_queue * queue) {
+    size_t i = atomic_load_explicit(&num_queues, memory_order_relaxed);
+
+    queues[i].shard = shard;
+    queues[i].queue = queue;
+    atomic_store_explicit(&num_queues, i + 1, memory_order_release);
+}
+
+void clear_metrics() {
+    atomic_store(&num_workers, 0);
+    atomic_store(&num_queues, 0);
+}
+
+static size_t read_counter(atomic_size_t * counter) {
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+struct metrics_totals {
+    size_t requests_by_method[NUM_HTTP_METHODS];
+    size_t responses_by_status[HTTP_STATUS_MAX];
+    size_t bytes_sent;
+    size_t static_hits;
+    size_t static_misses;
+    size_t connections_opened;
+    size_t connections_closed;
+};
+
+// Adds up the counters of the first `count` workers. The workers keep counting while we read, so
+// the totals aren't from one instant, but none of them ever goes down.
+static void sum_workers(struct metrics_totals * totals, size_t count) {
+    *totals = (struct metrics_totals) { 0 };
+
+    for (size_t i = 0; i < count; i++) {
+        struct worker_metrics * metrics = workers[i];
+
+        for (size_t j = 0; j < NUM_HTTP_METHODS; j++) {
+            totals->requests_by_method[j] += read_counter(&metrics->requests_by_method[j]);
+        }
+
+        for (size_t j = 0; j < HTTP_STATUS_MAX; j++) {
+            totals->responses_by_status[j] += read_counter(&metrics->responses_by_status[j]);
+        }
+
+        totals->bytes_sent += read_counter(&metrics->bytes_sent);
+        totals->static_hits += read_counter(&metrics->static_hits);
+        totals->static_misses += read_counter(&metrics->static_misses);
+        totals->connections_opened += read_counter(&metrics->connections_opened);
+        totals->connections_closed += read_counter(&metrics->connections_closed);
+    }
+}
+
+static void sum_latencies(struct latency_totals totals[NUM_LATENCY_PHASES], size_t count) {
+    for (size_t i = 0; i < NUM_LATENCY_PHASES; i++) {
+        totals[i] = (struct latency_totals) { 0 };
+
+        for (size_t j = 0; j < count; j++) {
+            add_latency_totals(totals + i, &workers[j]->latency[i]);
+        }
+    }
+}
+
+void print_latencies() {
+    // Too big for a worker's stack, but this is only called from the main thread
+    static struct latency_totals totals[NUM_LATENCY_PHASES];
+
+    sum_latencies(totals, atomic_load_explicit(&num_workers, memory_order_acquire));
+    print_latency_report(stdout, totals);
+}
+
+static void print_header(FILE * out, const char * name, const char * type, const char * help) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+char * fmt_metrics(size_t * out_len) {
+    const size_t queue_count = atomic_load_explicit(&num_queues, memory_order_acquire);
+    struct metrics_totals totals;
+    char * buf = NULL;
+    FILE * out = open_memstream(&buf, out_len);
+
+    if (! out) {
+        return NULL;
+    }
+
+    const size_t count = atomic_load_explicit(&num_workers, memory_order_acquire);
+    struct latency_totals * latencies = malloc(NUM_LATENCY_PHASES * sizeof(struct latency_totals));
+
+    if (! latencies) {
+        fclose(out);
+        free(buf);
+
+        return NULL;
+    }
+
+    sum_workers(&totals, count);
+    sum_latencies(latencies, count);
+
+    print_header(out, "gru_http_requests_total", "counter", "Requests handled, by method.");
+
+    for (size_t method = 0; method < NUM_HTTP_METHODS; method++) {
+        fprintf(
+            out,
+            "gru_http_requests_total{method=\"%s\"} %zu\n",
+            method == Unknown ? "other" : http_method_names[method],
+            totals.requests_by_method[method]
+        );
+    }
+
+    print_header(out, "gru_http_responses_total", "counter", "Responses sent, by status code.");
+
+    for (size_t status = 0; status < HTTP_STATUS_MAX; status++) {
+        if (http_status_names[status]) {
+            fprintf(out, "gru_http_responses_total{code=\"%zu\"} %zu\n", status, totals.responses_by_status[status]);
+        }
+    }
+
+    print_header(out, "gru_http_sent_bytes_total", "counter", "Bytes of responses sent, heads and bodies.");
+    fprintf(out, "gru_http_sent_bytes_total %zu\n", totals.bytes_sent);
+
+    print_header(out, "gru_http_static_lookups_total", "counter", "Requests for static files, by whether the file was found.");
+    fprintf(
+        out,
+        "gru_http_static_lookups_total{result=\"hit\"} %zu\n"
+        "gru_http_static_lookups_total{result=\"miss\"} %zu\n",
+        totals.static_hits,
+        totals.static_misses
+    );
+
+    size_t opened = totals.connections_opened;
+    size_t closed = totals.connections_closed;
+
+    print_header(out, "gru_http_connections_total", "counter", "Connections that workers have taken on.");
+    fprintf(out, "gru_http_connections_total %zu\n", opened);
+    print_header(out, "gru_http_connections_active", "gauge", "Connections that are open.");
+    // The counters are read at slightly different times, so a connection may have been closed
+    // after we read `opened`
+    fprintf(out, "gru_http_connections_active %zu\n", opened > closed ? opened - closed : 0);
+
+    print_header(out, "gru_http_log_dropped_total", "counter", "Log records dropped because a thread's log buffer was full.");
+    fprintf(out, "gru_http_log_dropped_total %zu\n", get_dropped_log_records());
+
+    static const double quantiles[] = { 0.5, 0.99, 0.999 };
+
+    print_header(out, "gru_http_phase_duration_seconds", "summary", "Time spent in each phase of handling connections.");
+
+    for (size_t i = 0; i < NUM_LATENCY_PHASES; i++) {
+        const char * phase = latency_phase_names[i];
+
+        for (size_t j = 0; j < sizeof quantiles / sizeof quantiles[0]; j++) {
+            fprintf(
+                out,
+                "gru_http_phase_duration_seconds{phase=\"%s\",quantile=\"%g\"} %.9f\n",
+                phase,
+                quantiles[j],
+                get_latency_quantile(latencies + i, quantiles[j]) / 1e9
+            );
+        }
+
+        fprintf(out, "gru_http_phase_duration_seconds_sum{phase=\"%s\"} %.9f\n", phase, latencies[i].sum_ns / 1e9);
+        fprintf(out, "gru_http_phase_duration_seconds_count{phase=\"%s\"} %zu\n", phase, latencies[i].count);
+    }
+
+    free(latencies);
+
+    print_header(out, "gru_http_accept_queue_depth", "gauge", "Accepted connections that no worker has taken yet, by shard.");
+
+    for (size_t i = 0; i < queue_count; i++) {
+        fprintf(out, "gru_http_accept_queue_depth{shard=\"%zu\"} %zu\n", queues[i].shard, fd_queue_size(queues[i].queue));
+    }
+
+    if (fclose(out)) {
+        free(buf);
+
+        return NULL;
+    }
+
+    return buf;
+}
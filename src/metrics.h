@@ -0,0 +1,69 @@
+/*
+ * This file is part of gru-http, an HTTP server.
+ * Copyright (C) 2024  Joe Desmond
+ *
+ * gru-http is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * gru-http is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with gru-http.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef SRC_METRICS_H
+#define SRC_METRICS_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include "conn.h"
+#include "http.h"
+#include "latency.h"
+#include "queue.h"
+#include "status.h"
+
+// The counters that one worker keeps. Only the worker writes them, so it doesn't need locked
+// instructions, and they start on their own cache line so that workers never write to the same
+// line. They're only added up when someone asks for the metrics.
+struct worker_metrics {
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t requests_by_method[NUM_HTTP_METHODS];
+    atomic_size_t responses_by_status[HTTP_STATUS_MAX];
+    // Heads and bodies
+    atomic_size_t bytes_sent;
+    // Requests for static files that were found (including 304s and 206s) or weren't
+    atomic_size_t static_hits;
+    atomic_size_t static_misses;
+    // Active connections are the difference between these
+    atomic_size_t connections_opened;
+    atomic_size_t connections_closed;
+    struct latency_histogram latency[NUM_LATENCY_PHASES];
+};
+
+// Increments a counter that only one thread writes to. Other threads may read it at any time,
+// so it has to be atomic, but it doesn't need a locked read-modify-write.
+void increment_counter(atomic_size_t * counter);
+void add_to_counter(atomic_size_t * counter, size_t amount);
+
+// Counts a response once it's been sent, and records how long it took to parse the request, look
+// up the resource and send the response.
+void record_response(struct worker_metrics * metrics, const struct connection * conn);
+
+// Adds a worker's counters or a shard's accept queue to the metrics. These must be called before
+// the worker or the shard's acceptor is started, and they're only valid until the metrics are
+// cleared.
+void register_worker_metrics(struct worker_metrics * metrics);
+void register_accept_queue(size_t shard, struct fd_queue * queue);
+void clear_metrics();
+
+// Adds up every worker's counters, and formats them in the Prometheus text format. Returns a
+// buffer that the caller has to free, or NULL if it couldn't be allocated.
+char * fmt_metrics(size_t * out_len);
+
+// Adds up every worker's latency histograms, and prints percentiles for each phase to stdout.
+void print_latencies();
+
+#endif
@@ -20,413 +20,559 @@
 #include <errno.h>
 #include <netdb.h>
 #include <poll.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <unistd.h>
 #include "params.h"
 #include "error.h"
 #include "http.h"
 #include "ip.h"
+#include "log.h"
 #include "net.h"
+#include "queue.h"
+#include "worker.h"
 
-#ifndef SUPPRESS_REQ_LOGS
-#include "status.h"
-#endif
+static struct shard * shards = NULL;
+static size_t num_shards = 0;
+static const struct net_backend * backend = &epoll_backend;
 
-#define RECV_BUF_SIZE   8192
-#define PRINT_BUF_SIZE  512
+// Becomes readable when the acceptors and workers should stop
+static int stop_fd = -1;
 
-struct locked_thread_fields {
-    int peer_fd;
-    int started;
-    int active;
+enum user_command {
+    None = 0,
+    Quit = 1,
+    Stats = 2,
+    StdinClosed = 3,
+    CycleLogLevel = 4,
+    Latencies = 5
 };
 
-struct connection_thread {
-    pthread_t thread;
-    struct http_req req;
-    struct http_res res;
-
-    pthread_mutex_t lock;
-    struct locked_thread_fields locked;
-};
+// Hands a newly accepted socket to the shard's workers. Returns -1 if the accept queue is full.
+static int dispatch_connection(struct shard * shard, int peer_fd) {
+    if (fd_queue_push(&shard->accept_queue, peer_fd, now_ns())) {
+        return -1;
+    }
 
-struct connection_thread threads[MAX_CONNECTION_THREADS] = { 0 };
+    const uint64_t one = 1;
 
-enum user_command {
-    None = 0,
-    Quit = 1
-};
+    if (write(shard->accept_fd, &one, sizeof one) == -1) {
+        perror("Failed to signal accept queue eventfd");
+    }
 
-#ifdef DEBUG_LOCKS
-#define checked_lock(lock) { \
-    int result = pthread_mutex_lock((lock)); \
-    switch (result) { \
-        case EINVAL: { \
-            printf("Error locking mutex: EINVAL, %s, %d\n", __FILE__, __LINE__); \
-            break; \
-        } \
-        case EDEADLK: { \
-            printf("Error locking mutex: EDEADLK, %s, %d\n", __FILE__, __LINE__); \
-        } \
-    } \
+    return 0;
 }
 
-#define checked_unlock(lock) { \
-    int result = pthread_mutex_unlock((lock)); \
-    switch (result) { \
-        case EINVAL: { \
-            printf("Error unlocking mutex: EINVAL, %s, %d\n", __FILE__, __LINE__); \
-            break; \
-        } \
-        case EPERM: { \
-            printf("Error unlocking mutex: EDEADLK, %s, %d\n", __FILE__, __LINE__); \
-        } \
-    } \
-}
-#else
-#define checked_lock pthread_mutex_lock
-#define checked_unlock pthread_mutex_unlock
-#endif
-
-#ifndef SUPPRESS_REQ_LOGS
-static void print_http_req(struct http_req * req, pid_t tid) {
-    if (req->target) {
-        printf("[Thread %d] -> %s %s\n", tid, http_method_names[req->method], req->target);
-
-        for (size_t i = 0; i < REQ_HEADER_MAX; i++) {
-            if (req->headers.known[i]) {
-                printf("\t\t %s: %s\n", req_header_names[i], req->headers.known[i]);
+static void * run_acceptor(void * shard_ptr) {
+    struct shard * shard = shard_ptr;
+    char thread_name[16];
+
+    snprintf(thread_name, 16, "acceptor %d", (uint8_t) shard->index);
+    int setname_result = pthread_setname_np(pthread_self(), thread_name);
+
+    if (setname_result) {
+        perror("Failed to set acceptor thread name");
+    }
+
+    struct sockaddr_in peer_sock;
+    socklen_t peer_len;
+
+    struct pollfd poll_arg[2] = {
+        {
+            .fd = shard->listen_fd,
+            .events = POLLIN
+        },
+        {
+            .fd = shard->stop_fd,
+            .events = POLLIN
+        }
+    };
+
+    // A socket that couldn't be dispatched because the accept queue was full
+    int held_fd = -1;
+
+    while (! poll_arg[1].revents) {
+        // While the workers are saturated, we stop accepting and retry the held socket every
+        // millisecond instead. The kernel will keep queueing connections in the backlog.
+        int status = poll(poll_arg, sizeof(poll_arg) / sizeof(struct pollfd), held_fd == -1 ? -1 : 1);
+
+        if (held_fd != -1 && ! dispatch_connection(shard, held_fd)) {
+            held_fd = -1;
+            poll_arg[0].events = POLLIN;
+        }
+
+        if (status == -1) {
+            if (errno != EINTR) {
+                perror("Failed to poll listen socket");
             }
+
+            continue;
         }
-    } else {
-        printf("[Thread %d] -> %s (Undefined target)\n", tid, http_method_names[req->method]);
-    }
-}
 
-static void print_http_res(struct http_res * res, pid_t tid) {
-    printf("[Thread %d] <- %d %s\n", tid, res->status, http_status_names[res->status]);
+        if (! poll_arg[0].revents) {
+            continue;
+        }
 
-    for (size_t i = 0; i < RES_HEADER_MAX; i++) {
-        if (res->headers.headers[i]) {
-            printf("\t\t %s: %s\n", res_header_names[i], res->headers.headers[i]);
+        if (! (poll_arg[0].revents & POLLIN)) {
+            printf("Poll error event on listen socket: %d\n", poll_arg[0].revents);
+            continue;
+        }
+
+        // The listen socket is non-blocking, so we can accept everything in the backlog
+        while (1) {
+            peer_len = sizeof peer_sock;
+            int peer_sock_fd = accept4(
+                shard->listen_fd,
+                (struct sockaddr *) &peer_sock,
+                &peer_len,
+                SOCK_NONBLOCK | SOCK_CLOEXEC
+            );
+
+            if (peer_sock_fd == -1) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    perror("Failed to accept connection");
+                }
+
+                break;
+            }
+
+            increment_counter(&shard->connections_accepted);
+            if (log_enabled(LogVerbose)) {
+                char * const ip_str = fmt_ipv4_addr(peer_sock.sin_addr);
+
+                if (ip_str) {
+                    log_line(LogVerbose, "Accepted a connection from %s:%d", ip_str, peer_sock.sin_port);
+                    free(ip_str);
+                } else {
+                    log_line(LogVerbose, "IP string was null");
+                }
+            }
+
+            if (dispatch_connection(shard, peer_sock_fd)) {
+                held_fd = peer_sock_fd;
+                poll_arg[0].events = 0;
+                break;
+            }
         }
     }
+
+    if (held_fd != -1) {
+        close(held_fd);
+    }
+
+    return NULL;
 }
-#endif
 
-static int start_connection_impl(struct connection_thread * thread) {
-    checked_lock(&thread->lock);
-    int peer_fd = thread->locked.peer_fd;
-    checked_unlock(&thread->lock);
-    char buf[RECV_BUF_SIZE];
+static int open_listen_socket(const struct sockaddr_in * my_addr, int reuse_port) {
+    struct protoent * ent = getprotobyname("tcp");
 
-    char print_buf[PRINT_BUF_SIZE];
-    print_buf[PRINT_BUF_SIZE - 1] = 0;
-    pid_t tid_for_printing = gettid();
+    if (! ent) {
+        die();
+    }
 
-#ifndef SUPPRESS_REQ_LOGS
-    printf("[Thread %d] Receiving data\n", tid_for_printing);
-#endif
+    int sock_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, ent->p_proto);
 
-    struct pollfd poll_arg = {
-        .fd = peer_fd,
-        .events = POLLIN
-    };
+    if (sock_fd == -1) {
+        die();
+    }
 
-    int status = poll(&poll_arg, 1, POLL_TIMEOUT_MS);
+    endprotoent();
 
-    if (status == -1) {
-        snprintf(print_buf, PRINT_BUF_SIZE, "[Thread %d] Failed to poll socket", tid_for_printing);
-        perror(print_buf);
-    } else if (status == 0) {
-        snprintf(print_buf, PRINT_BUF_SIZE, "[Thread %d] Timed out while polling socket", tid_for_printing);
-    } else {
-        // TODO: Call `poll` and `read` in a loop, and support Keep-Alive
-        int bytes_read = read(peer_fd, buf, RECV_BUF_SIZE - 1);
-
-        if (bytes_read > 0) {
-            buf[bytes_read] = 0;
-#ifdef DEBUG_PRINT_RAW_REQ
-            write(1, buf, bytes_read);
-#endif
-
-            handle_http_req(buf, bytes_read, &thread->req, &thread->res);
-#ifndef SUPPRESS_REQ_LOGS
-            print_http_req(&thread->req, tid_for_printing);
-#endif
-            send_http_res(&thread->res, peer_fd);
-#ifndef SUPPRESS_REQ_LOGS
-            print_http_res(&thread->res, tid_for_printing);
-#endif
-        } else if (bytes_read == -1) {
-            snprintf(print_buf, PRINT_BUF_SIZE, "[Thread %d] Failed to read data from socket", tid_for_printing);
-            perror(print_buf);
+    const int reuse = 1;
+    int result = setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof reuse);
+
+    if (result) {
+        perror("Failed to set SO_REUSEADDR on listen socket");
+    }
+
+    if (reuse_port) {
+        result = setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof reuse);
+
+        if (result) {
+            die();
         }
     }
 
-#ifndef SUPPRESS_REQ_LOGS
-    printf("[Thread %d] Closing socket\n", tid_for_printing);
-#endif
-    status = shutdown(peer_fd, SHUT_RDWR);
+    int status = bind(sock_fd, (const struct sockaddr *) my_addr, sizeof (struct sockaddr_in));
 
     if (status == -1) {
-        perror("Failed to call 'shutdown' on socket");
+        die();
     }
 
-    status = close(peer_fd);
+    status = listen(sock_fd, LISTEN_BACKLOG);
 
     if (status == -1) {
-        snprintf(print_buf, PRINT_BUF_SIZE, "[Thread %d] Failed to close socket", tid_for_printing);
-        perror(print_buf);
-
-        return errno;
+        die();
     }
 
-    return 0;
+    return sock_fd;
 }
 
-static void * start_connection(void * thread_index) {
-    const size_t thread_i = (size_t) thread_index;
-    struct connection_thread * thread = threads + thread_i;
+// Returns the `n`th CPU (wrapping around) that this process is allowed to run on, or -1 if the
+// affinity mask can't be read.
+static int get_nth_cpu(size_t n) {
+    cpu_set_t cpus;
 
-    checked_lock(&thread->lock);
-    thread->locked.started = 1;
-    checked_unlock(&thread->lock);
+    if (sched_getaffinity(0, sizeof cpus, &cpus) == -1) {
+        perror("Failed to get CPU affinity");
 
-    char thread_name[16];
+        return -1;
+    }
 
-    snprintf(thread_name, 16, "handler %d", (uint8_t) thread_i);
-    int setname_result = pthread_setname_np(thread->thread, thread_name);
+    size_t count = CPU_COUNT(&cpus);
 
-    if (setname_result) {
-        perror("Failed to set handler thread name");
+    if (! count) {
+        return -1;
     }
 
-    int status = start_connection_impl(thread);
+    n %= count;
 
-    checked_lock(&thread->lock);
-    thread->locked.active = 0;
-    checked_unlock(&thread->lock);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &cpus) && ! n--) {
+            return cpu;
+        }
+    }
 
-    return (void *) (uint64_t) status;
+    return -1;
 }
 
-void join_finished_threads() {
-    for (size_t i = 0; i < MAX_CONNECTION_THREADS; i++) {
-        checked_lock(&threads[i].lock);
-        if (threads[i].locked.started && ! threads[i].locked.active) {
-            int status = pthread_join(threads[i].thread, NULL);
+static void pin_thread(pthread_t thread, int cpu) {
+    if (cpu == -1) {
+        return;
+    }
 
-            if (status) {
-                perror("Failed to join thread");
-            }
+    cpu_set_t cpus;
 
-            threads[i].locked.started = 0;
-            reset_http_req(&threads[i].req);
-            reset_http_res(&threads[i].res);
-        }
-        checked_unlock(&threads[i].lock);
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+
+    int status = pthread_setaffinity_np(thread, sizeof cpus, &cpus);
+
+    if (status) {
+        errno = status;
+        perror("Failed to set thread CPU affinity");
     }
 }
 
-void init_shared_memory() {
-    pthread_mutexattr_t mutexattr;
+static void start_shard(struct shard * shard, const struct sockaddr_in * my_addr, size_t num_workers) {
+    // Any explicit --shards, even 1, asks for pinned shards
+    int sharded = global_options.num_shards > 0;
 
-    pthread_mutexattr_init(&mutexattr);
-#ifdef DEBUG_LOCKS
-    int result = pthread_mutexattr_settype(&mutexattr, PTHREAD_MUTEX_ERRORCHECK_NP);
-#else
-    int result = pthread_mutexattr_settype(&mutexattr, PTHREAD_MUTEX_FAST_NP);
-#endif
+    shard->cpu = sharded ? get_nth_cpu(shard->index) : -1;
+    shard->listen_fd = open_listen_socket(my_addr, sharded);
+    shard->stop_fd = stop_fd;
+    shard->accept_queue = create_fd_queue(ACCEPT_QUEUE_SIZE);
+    shard->accept_fd = eventfd(0, EFD_SEMAPHORE | EFD_NONBLOCK | EFD_CLOEXEC);
 
-    if (result) {
+    if (shard->accept_fd == -1) {
         die();
     }
 
-    for (size_t i = 0; i < MAX_CONNECTION_THREADS; i++) {
-        pthread_mutex_init(&threads[i].lock, &mutexattr);
+    atomic_init(&shard->connections_accepted, 0);
+
+    shard->num_workers = num_workers;
+    // The workers' metrics need cache line alignment
+    shard->workers = aligned_alloc(CACHE_LINE_SIZE, num_workers * sizeof(struct worker));
 
-        threads[i].req = create_http_req();
-        threads[i].res = create_http_res();
+    if (! shard->workers) {
+        die();
     }
 
-    pthread_mutexattr_destroy(&mutexattr);
+    memset(shard->workers, 0, num_workers * sizeof(struct worker));
+    register_accept_queue(shard->index, &shard->accept_queue);
+
+    for (size_t i = 0; i < num_workers; i++) {
+        struct worker * worker = shard->workers + i;
+
+        worker->index = i;
+        worker->shard = shard;
+        atomic_init(&worker->connections_accepted, 0);
+        register_worker_metrics(&worker->metrics);
+
+        backend->init_worker(worker);
+
+        int status = pthread_create(&worker->thread, NULL, backend->run_worker, worker);
+
+        if (status) {
+            errno = status;
+            die();
+        }
+
+        pin_thread(worker->thread, shard->cpu);
+    }
+
+    if (! backend->uses_acceptor) {
+        return;
+    }
+
+    int status = pthread_create(&shard->acceptor, NULL, run_acceptor, shard);
+
+    if (status) {
+        errno = status;
+        die();
+    }
+
+    pin_thread(shard->acceptor, shard->cpu);
 }
 
-enum user_command get_user_command() {
-    static char buf[256];
+// Picks the backend that was asked for, or falls back to epoll if it can't be used here.
+static void select_backend() {
+    if (global_options.backend == IoUringBackend) {
+        if (! uring_backend.probe()) {
+            backend = &uring_backend;
 
-    int bytes_read = read(STDIN_FILENO, buf, ((sizeof buf) / sizeof(char)) - 1);
-    buf[bytes_read] = 0;
+            return;
+        }
 
-    if (! strcmp(buf, "q\n")) {
-        return Quit;
+        printf("io_uring is not supported, falling back to epoll\n");
     }
 
-    return None;
+    backend = &epoll_backend;
 }
 
-void listen_for_connections(const struct sockaddr_in * my_addr) {
-    init_shared_memory();
+static void start_shards(const struct sockaddr_in * my_addr) {
+    select_backend();
 
-    struct protoent * ent = getprotobyname("tcp");
+    stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
 
-    if (! ent) {
+    if (stop_fd == -1) {
         die();
     }
 
-    int sock_fd = socket(AF_INET, SOCK_STREAM, ent->p_proto);
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t total_workers = global_options.num_workers;
 
-    if (sock_fd == -1) {
+    if (! total_workers) {
+        total_workers = num_cpus > 0 ? num_cpus : 1;
+    }
+
+    num_shards = global_options.num_shards ? global_options.num_shards : 1;
+    // The accept queues need cache line alignment
+    shards = aligned_alloc(CACHE_LINE_SIZE, num_shards * sizeof(struct shard));
+
+    if (! shards) {
         die();
     }
 
-    endprotoent();
+    memset(shards, 0, num_shards * sizeof(struct shard));
 
-    const int reuse = 1;
-    int result = setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof reuse);
+    for (size_t i = 0; i < num_shards; i++) {
+        // Spread the workers as evenly as we can, with at least one per shard
+        size_t shard_workers = total_workers / num_shards + (i < total_workers % num_shards);
 
-    if (result) {
-        perror("Failed to set SO_REUSEADDR on listen socket");
+        shards[i].index = i;
+        start_shard(shards + i, my_addr, shard_workers ? shard_workers : 1);
     }
 
-    int status = bind(sock_fd, (const struct sockaddr *) my_addr, sizeof (struct sockaddr_in));
+    printf(
+        "Started %zu shard(s), %zu %s worker(s)\n",
+        num_shards,
+        total_workers > num_shards ? total_workers : num_shards,
+        backend->name
+    );
+}
 
-    if (status == -1) {
-        die();
+static size_t get_connections_accepted(struct shard * shard) {
+    size_t accepted = atomic_load_explicit(&shard->connections_accepted, memory_order_relaxed);
+
+    for (size_t i = 0; i < shard->num_workers; i++) {
+        accepted += atomic_load_explicit(&shard->workers[i].connections_accepted, memory_order_relaxed);
     }
 
-    status = listen(sock_fd, 32);
+    return accepted;
+}
 
-    if (status == -1) {
-        die();
+static size_t get_requests_handled(struct shard * shard) {
+    size_t requests = 0;
+
+    for (size_t i = 0; i < shard->num_workers; i++) {
+        for (size_t j = 0; j < NUM_HTTP_METHODS; j++) {
+            requests += atomic_load_explicit(&shard->workers[i].metrics.requests_by_method[j], memory_order_relaxed);
+        }
     }
 
-    char * ip_str = fmt_ipv4_addr(my_addr->sin_addr);
+    return requests;
+}
 
-    printf("Listening on %s:%d\n", ip_str, ntohs(my_addr->sin_port));
-    printf("Send 'q' to quit\n");
+static void print_shard_stats() {
+    size_t total_accepted = 0;
+    size_t total_requests = 0;
 
-    free(ip_str);
+    for (size_t i = 0; i < num_shards; i++) {
+        total_accepted += get_connections_accepted(shards + i);
+        total_requests += get_requests_handled(shards + i);
+    }
 
-    struct sockaddr_in peer_sock;
-    socklen_t peer_len = sizeof peer_sock;
+    for (size_t i = 0; i < num_shards; i++) {
+        struct shard * shard = shards + i;
+        size_t accepted = get_connections_accepted(shard);
+        size_t requests = get_requests_handled(shard);
+
+        printf(
+            "Shard %zu (CPU %d): %zu connections (%.1f%%), %zu requests (%.1f%%), %zu queued\n",
+            i,
+            shard->cpu,
+            accepted,
+            total_accepted ? 100.0 * accepted / total_accepted : 0.0,
+            requests,
+            total_requests ? 100.0 * requests / total_requests : 0.0,
+            fd_queue_size(&shard->accept_queue)
+        );
+    }
+}
 
-    struct pollfd poll_arg[2] = {
-        {
-            .fd = sock_fd,
-            .events = POLLIN
-        },
-        {
-            .fd = STDIN_FILENO,
-            .events = POLLIN
-        }
-    };
+static void stop_shards() {
+    const uint64_t one = 1;
 
-    while (1) {
-        int status = poll(poll_arg, sizeof(poll_arg) / sizeof(struct pollfd), -1);
+    if (write(stop_fd, &one, sizeof one) == -1) {
+        perror("Failed to stop workers");
+    }
 
-        if (status == -1) {
-            perror("Failed to poll stdin and listen socket");
-            continue;
-        }
+    clear_metrics();
 
-        if (status == 0) {
-            perror("Timed out while polling stdin and listen socket");
-            continue;
+    for (size_t i = 0; i < num_shards; i++) {
+        struct shard * shard = shards + i;
+        int status;
+
+        if (backend->uses_acceptor) {
+            status = pthread_join(shard->acceptor, NULL);
+
+            if (status) {
+                perror("Failed to join thread");
+            }
         }
 
-        if (poll_arg[1].revents) {
-            if (poll_arg[1].revents & POLLIN) {
-                enum user_command cmd = get_user_command();
-
-                switch (cmd) {
-                    case Quit: {
-                        goto shutdown;
-                    };
-                    case None: {
-                        break;
-                    };
-                }
-            } else {
-                printf("Poll error event on stdin: %d\n", poll_arg[1].revents);
+        for (size_t j = 0; j < shard->num_workers; j++) {
+            status = pthread_join(shard->workers[j].thread, NULL);
+
+            if (status) {
+                perror("Failed to join thread");
             }
+
+            backend->free_worker(shard->workers + j);
         }
 
-        if (poll_arg[0].revents) {
-            if (poll_arg[0].revents & POLLIN) {
-                int peer_sock_fd = accept(sock_fd, (struct sockaddr *) &peer_sock, &peer_len);
+        close(shard->listen_fd);
 
-                if (peer_sock_fd == -1) {
-                    perror("Failed to accept connection");
-                    continue;
-                }
-#ifndef SUPPRESS_REQ_LOGS
-                char * const ip_str = fmt_ipv4_addr(peer_sock.sin_addr);
+        // Close any sockets that were accepted but never picked up
+        int peer_fd;
 
-                if (ip_str) {
-                    printf("Accepted a connection from %s:%d\n", ip_str, peer_sock.sin_port);
-                    free(ip_str);
-                } else {
-                    printf("IP string was null\n");
-                }
-#endif
+        while (! fd_queue_pop(&shard->accept_queue, &peer_fd, NULL)) {
+            close(peer_fd);
+        }
 
-                size_t thread_i;
+        free(shard->workers);
+        free_fd_queue(&shard->accept_queue);
+        close(shard->accept_fd);
+    }
 
-                while (1) {
-                    join_finished_threads();
+    free(shards);
+    close(stop_fd);
 
-                    for (size_t i = 0; i < MAX_CONNECTION_THREADS; i++) {
-                        checked_lock(&threads[i].lock);
-                        if (! threads[i].locked.started && ! threads[i].locked.active) {
-                            thread_i = i;
-                            checked_unlock(&threads[i].lock);
-                            goto thread_i_found;
-                        }
-                        checked_unlock(&threads[i].lock);
-                    }
+    shards = NULL;
+    num_shards = 0;
+}
 
-                    // We'll wait for a thread to die
-                    sleep(1);
-                }
-                thread_i_found:
-                checked_lock(&threads[thread_i].lock);
-                threads[thread_i].locked.peer_fd = peer_sock_fd;
-                threads[thread_i].locked.active = 1;
-                checked_unlock(&threads[thread_i].lock);
+enum user_command get_user_command() {
+    static char buf[256];
 
-                int status = pthread_create(&threads[thread_i].thread, NULL, start_connection, (void *) thread_i);
+    int bytes_read = read(STDIN_FILENO, buf, ((sizeof buf) / sizeof(char)) - 1);
 
-                if (status) {
-                    perror("Failed to start thread");
-                }
-            } else {
-                printf("Poll error event on listen socket: %d\n", poll_arg[1].revents);
-            }
-        }
+    if (bytes_read <= 0) {
+        return StdinClosed;
     }
 
-shutdown:
-    printf("Shutting down...\n");
-    close(sock_fd);
+    buf[bytes_read] = 0;
+
+    if (! strcmp(buf, "q\n")) {
+        return Quit;
+    }
 
-    for (size_t i = 0; i < MAX_CONNECTION_THREADS; i++) {
-        int should_join = 0;
-        checked_lock(&threads[i].lock);
-        should_join = threads[i].locked.started || threads[i].locked.active;
-        checked_unlock(&threads[i].lock);
+    if (! strcmp(buf, "s\n")) {
+        return Stats;
+    }
 
-        if (should_join) {
-            int status = pthread_join(threads[i].thread, NULL);
+    if (! strcmp(buf, "l\n")) {
+        return CycleLogLevel;
+    }
 
-            if (status) {
-                perror("Failed to join thread");
+    if (! strcmp(buf, "h\n")) {
+        return Latencies;
+    }
+
+    return None;
+}
+
+void listen_for_connections(const struct sockaddr_in * my_addr) {
+    start_shards(my_addr);
+
+    char * ip_str = fmt_ipv4_addr(my_addr->sin_addr);
+
+    printf("Listening on %s:%d\n", ip_str, ntohs(my_addr->sin_port));
+    printf("Send 'q' to quit, 's' to print stats, 'h' to print latencies, 'l' to change the log level\n");
+
+    free(ip_str);
+
+    struct pollfd poll_arg = {
+        .fd = STDIN_FILENO,
+        .events = POLLIN
+    };
+
+    while (1) {
+        int status = poll(&poll_arg, 1, -1);
+
+        if (status == -1) {
+            if (errno != EINTR) {
+                perror("Failed to poll stdin");
             }
 
-            reset_http_req(&threads[i].req);
-            reset_http_res(&threads[i].res);
+            continue;
+        }
+
+        if (! (poll_arg.revents & POLLIN)) {
+            printf("Poll error event on stdin: %d\n", poll_arg.revents);
+            // Stop listening to stdin, but keep the server running
+            poll_arg.fd = -1;
+            continue;
+        }
+
+        enum user_command cmd = get_user_command();
+
+        switch (cmd) {
+            case Quit: {
+                goto shutdown;
+            };
+            case Stats: {
+                print_shard_stats();
+                break;
+            };
+            case Latencies: {
+                print_latencies();
+                break;
+            };
+            case CycleLogLevel: {
+                enum log_level level = get_log_level() == LogVerbose ? LogOff : get_log_level() + 1;
+
+                set_log_level(level);
+                printf("Log level is now %s\n", log_level_names[level]);
+                break;
+            };
+            case StdinClosed: {
+                // Nobody can send us commands anymore, so just keep serving
+                poll_arg.fd = -1;
+                break;
+            };
+            case None: {
+                break;
+            };
         }
     }
+
+shutdown:
+    printf("Shutting down...\n");
+    stop_shards();
 }
@@ -22,6 +22,5 @@
 #include <pthread.h>
 
 void listen_for_connections(const struct sockaddr_in * my_addr);
-void join_finished_threads();
 
 #endif
@@ -23,24 +23,127 @@
 // set.
 
 
-// This controls how many connection threads the program is allowed to have at
-// any one time. This count does not include other threads, such as the main
-// thread.
-#define MAX_CONNECTION_THREADS      32
+// The maximum number of worker threads that can be requested with --workers.
+#define MAX_WORKERS                 1024
+
+// The maximum number of listen sockets that can be requested with --shards.
+#define MAX_SHARDS                  256
+
+// The maximum number of events a worker will take from epoll at once.
+#define EPOLL_MAX_EVENTS            64
+
+// The number of submission queue entries in each io_uring worker's ring. The
+// completion queue is four times as big. Must be a power of two.
+#define URING_ENTRIES               256
+
+// The number of receive buffers that each io_uring worker registers with the
+// kernel, and the size of each one. Data is copied out of a buffer and the buffer
+// is given back as soon as a receive completes. The count must be a power of two.
+#define URING_BUF_COUNT             256
+#define URING_BUF_SIZE              4096
+
+// The maximum number of accepted connections that can be waiting for a worker.
+// Must be a power of two.
+#define ACCEPT_QUEUE_SIZE           4096
+
+// The maximum number of accepted connections a worker will take from the accept
+// queue each time it's woken up.
+#define ACCEPT_BATCH_SIZE           16
+
+// The maximum number of connections waiting to be accepted.
+#define LISTEN_BACKLOG              1024
 
 // The number of milliseconds to wait for a client to send data before disconnecting
 // them.
 #define POLL_TIMEOUT_MS             10000
 
-// Uncomment this to suppress printing details of every request and response to
-// stdout. Doing this can greatly increase the program's ability to handle many
-// requests per second.
-// #define SUPPRESS_REQ_LOGS
+// The default value of --max-header-size: the largest request head (request line
+// and headers) in bytes that the server will accept. Longer heads get a 414 or 431
+// response.
+#define DEFAULT_MAX_HEADER_SIZE     8192
+
+// The range of values accepted by --max-header-size.
+#define MIN_HEADER_SIZE             256
+#define MAX_HEADER_SIZE             (1024 * 1024)
+
+// The default value of --sendfile-min: files at least this big (in bytes) are
+// served straight from disk with sendfile instead of being mapped into memory.
+#define DEFAULT_SENDFILE_MIN_SIZE   (1024 * 1024)
+
+// The number of threads that scan the static directory and load its files at
+// startup. These spend most of their time waiting on the disk, so there can be
+// more of them than there are CPUs.
+#define LOAD_THREADS                8
+
+// How long (in ms) the watcher waits after a static file changes before it swaps
+// in a new snapshot. Everything else that changes in the meantime goes into the
+// same snapshot.
+#define WATCH_DELAY_MS              100
+
+// The most paths that the watcher keeps track of between snapshots. If more than
+// this many change, the whole static directory is reloaded.
+#define WATCH_MAX_CHANGES           256
+
+// Files up to this size (in bytes) get an ETag that's a hash of their contents,
+// which means they're read in full when they're loaded. Bigger files get an ETag
+// that's a hash of their inode, size and modification time instead, so that their
+// pages can stay on disk until they're requested.
+#define ETAG_CONTENT_HASH_MAX_SIZE  (64 * 1024)
+
+// Text files (HTML, CSS, JavaScript and so on) between these sizes (in bytes) are
+// compressed with gzip and brotli when they're loaded, unless there's already a
+// precompressed ".gz" or ".br" file next to them. Smaller files aren't worth it,
+// and bigger ones would take too long to load.
+#define COMPRESS_MIN_SIZE           256
+#define COMPRESS_MAX_SIZE           (8 * 1024 * 1024)
+
+// The zlib compression level (1-9) and brotli quality (0-11) for files that are
+// compressed at load time. Compression only happens once per file version, so
+// these are set for the smallest output.
+#define GZIP_LEVEL                  9
+#define BROTLI_QUALITY              11
+
+// The most bytes that a pre-rendered response head can take up: the head of a 200
+// response for a static file, or of an error response. Files whose heads don't fit
+// get their headers formatted for every request.
+#define HEAD_BLOCK_MAX_SIZE         512
+
+// The most ranges that a client can ask for in one Range header. Requests for
+// more get the whole file, so that they can't make us send lots of tiny parts.
+#define MAX_RANGES                  16
+
+// Responses with more than one range are built in memory, so requests whose parts
+// add up to more than this many bytes get the whole file instead.
+#define MULTIPART_MAX_SIZE          (1024 * 1024)
+
+// The most times that --warm can be given.
+#define MAX_WARM_PATTERNS           64
+
+// The number of milliseconds to keep an idle persistent connection open while
+// waiting for the client's next request.
+#define KEEP_ALIVE_TIMEOUT_MS       5000
+
+// The number of milliseconds that a client has to take more of a response before
+// the connection is dropped. The clock starts over whenever some of it is sent.
+#define SEND_TIMEOUT_MS             10000
+
+// The size in bytes of each thread's log buffer. Lines that are logged while the
+// buffer is full are dropped. Must be a power of 2.
+#define LOG_RING_SIZE               (256 * 1024)
+
+// The longest log record (a line, or a request or response with its headers).
+// Longer records are cut short.
+#define LOG_RECORD_MAX_SIZE         4096
+
+// The log writer collects up to this many bytes from the threads' buffers before
+// it writes them to stdout.
+#define LOG_BATCH_SIZE              (64 * 1024)
+
+// How often the log writer checks the threads' buffers when it hasn't found
+// anything in them.
+#define LOG_FLUSH_INTERVAL_MS       10
 
 // Uncomment this to print raw request data to stdout
 // #define DEBUG_PRINT_RAW_REQ
 
-// Uncomment this to use error-checking locks instead of fast locks
-#define DEBUG_LOCKS
-
 #endif
@@ -0,0 +1,140 @@
+/*
+ * This file is part of gru-http, an HTTP server.
+ * Copyright (C) 2024  Joe Desmond
+ *
+ * gru-http is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * gru-http is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with gru-http.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "error.h"
+#include "queue.h"
+
+struct fd_queue create_fd_queue(size_t capacity) {
+    if (capacity < 2 || (capacity & (capacity - 1))) {
+        printf("Queue capacity must be a power of two: %zu\n", capacity);
+        exit(1);
+    }
+
+    struct fd_queue out = {
+        .cells = malloc(capacity * sizeof(struct fd_queue_cell)),
+        .mask = capacity - 1
+    };
+
+    if (! out.cells) {
+        die();
+    }
+
+    for (size_t i = 0; i < capacity; i++) {
+        atomic_init(&out.cells[i].sequence, i);
+        out.cells[i].fd = -1;
+    }
+
+    atomic_init(&out.enqueue_pos, 0);
+    atomic_init(&out.dequeue_pos, 0);
+
+    return out;
+}
+
+void free_fd_queue(struct fd_queue * queue) {
+    free(queue->cells);
+    queue->cells = NULL;
+}
+
+int fd_queue_push(struct fd_queue * queue, int fd, uint64_t pushed_ns) {
+    size_t pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+    struct fd_queue_cell * cell;
+
+    while (1) {
+        cell = queue->cells + (pos & queue->mask);
+
+        size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+
+        if (diff == 0) {
+            // The cell is free. If another producer claims it first, `pos` is reloaded and we
+            // try the next one.
+            if (atomic_compare_exchange_weak_explicit(
+                    &queue->enqueue_pos,
+                    &pos,
+                    pos + 1,
+                    memory_order_relaxed,
+                    memory_order_relaxed
+            )) {
+                break;
+            }
+        } else if (diff < 0) {
+            // The cell still holds an fd from one lap ago, so the queue is full
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    cell->fd = fd;
+    cell->pushed_ns = pushed_ns;
+    atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+
+    return 0;
+}
+
+int fd_queue_pop(struct fd_queue * queue, int * fd, uint64_t * pushed_ns) {
+    size_t pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+    struct fd_queue_cell * cell;
+
+    while (1) {
+        cell = queue->cells + (pos & queue->mask);
+
+        size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(
+                    &queue->dequeue_pos,
+                    &pos,
+                    pos + 1,
+                    memory_order_relaxed,
+                    memory_order_relaxed
+            )) {
+                break;
+            }
+        } else if (diff < 0) {
+            // Nothing has been written to this cell yet, so the queue is empty
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+        }
+    }
+
+    *fd = cell->fd;
+
+    if (pushed_ns) {
+        *pushed_ns = cell->pushed_ns;
+    }
+    // Mark the cell as free for the producer that comes around on the next lap
+    atomic_store_explicit(&cell->sequence, pos + queue->mask + 1, memory_order_release);
+
+    return 0;
+}
+
+size_t fd_queue_size(struct fd_queue * queue) {
+    size_t enqueue_pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+    size_t dequeue_pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+
+    if (enqueue_pos < dequeue_pos) {
+        return 0;
+    }
+
+    return enqueue_pos - dequeue_pos;
+}
@@ -0,0 +1,62 @@
+/*
+ * This file is part of gru-http, an HTTP server.
+ * Copyright (C) 2024  Joe Desmond
+ *
+ * gru-http is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * gru-http is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with gru-http.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef SRC_QUEUE_H
+#define SRC_QUEUE_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CACHE_LINE_SIZE     64
+
+struct fd_queue_cell {
+    atomic_size_t sequence;
+    int fd;
+    uint64_t pushed_ns;
+};
+
+// A bounded, lock-free queue of file descriptors that any number of threads can push to and
+// pop from at once. Each cell carries a sequence number that tells producers and consumers
+// whether it's free to write or ready to read, so a push or pop is a single CAS on the
+// enqueue or dequeue position in the common case.
+struct fd_queue {
+    struct fd_queue_cell * cells;
+    size_t mask;
+
+    // The two positions are on their own cache lines so that producers and consumers don't
+    // invalidate each other's lines
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t enqueue_pos;
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t dequeue_pos;
+};
+
+// Creates a queue that can hold `capacity` file descriptors. `capacity` must be a power of two.
+struct fd_queue create_fd_queue(size_t capacity);
+void free_fd_queue(struct fd_queue * queue);
+
+// Returns 0 if `fd` was added to the queue, -1 if the queue is full. `pushed_ns` is a time that's
+// kept with it, so that the consumer can tell how long it waited.
+int fd_queue_push(struct fd_queue * queue, int fd, uint64_t pushed_ns);
+
+// Returns 0 and writes the oldest file descriptor to `fd`, or returns -1 if the queue is empty.
+// If `pushed_ns` isn't NULL, the time that was pushed with the fd is written to it.
+int fd_queue_pop(struct fd_queue * queue, int * fd, uint64_t * pushed_ns);
+
+// Returns the approximate number of file descriptors in the queue.
+size_t fd_queue_size(struct fd_queue * queue);
+
+#endif
@@ -0,0 +1,365 @@
+/*
+ * This file is part of gru-http, an HTTP server.
+ * Copyright (C) 2024  Joe Desmond
+ *
+ * gru-http is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * gru-http is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with gru-http.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Finds the delimiters in a request head and checks the bytes in between. The vector versions
+// only load whole vectors that fit in the buffer, and finish the last few bytes with the scalar
+// loop, so they never read past the end.
+
+#include <stdint.h>
+#include <string.h>
+#include "scan.h"
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+const char * scan_level_names[NUM_SCAN_LEVELS] = {
+    [ScanScalar] = "scalar",
+    [ScanSse2] = "SSE2",
+    [ScanAvx2] = "AVX2"
+};
+
+static const unsigned char token_chars[256] = {
+    ['0' ... '9'] = 1,
+    ['A' ... 'Z'] = 1,
+    ['a' ... 'z'] = 1,
+    ['!'] = 1, ['#'] = 1, ['$'] = 1, ['%'] = 1, ['&'] = 1, ['\''] = 1, ['*'] = 1, ['+'] = 1,
+    ['-'] = 1, ['.'] = 1, ['^'] = 1, ['_'] = 1, ['`'] = 1, ['|'] = 1, ['~'] = 1
+};
+
+static int is_target_char(unsigned char c) {
+    return c > ' ' && c != 0x7f;
+}
+
+static int is_field_value_char(unsigned char c) {
+    return (c >= ' ' && c != 0x7f) || c == '\t';
+}
+
+static size_t scan_token_scalar(const char * buf, size_t i, size_t len) {
+    while (i < len && token_chars[(unsigned char) buf[i]]) {
+        i++;
+    }
+
+    return i;
+}
+
+static size_t scan_target_scalar(const char * buf, size_t i, size_t len) {
+    while (i < len && is_target_char(buf[i])) {
+        i++;
+    }
+
+    return i;
+}
+
+static size_t scan_field_value_scalar(const char * buf, size_t i, size_t len) {
+    while (i < len && is_field_value_char(buf[i])) {
+        i++;
+    }
+
+    return i;
+}
+
+#ifdef __x86_64__
+// SSE2 is part of x86-64, so these don't need a target attribute or a check
+
+// Sets the bytes of the result where `lo <= x <= hi`, comparing as unsigned bytes
+static __m128i in_range_sse2(__m128i x, unsigned char lo, unsigned char hi) {
+    __m128i offset = _mm_sub_epi8(x, _mm_set1_epi8(lo));
+
+    return _mm_cmpeq_epi8(_mm_min_epu8(offset, _mm_set1_epi8(hi - lo)), offset);
+}
+
+static size_t scan_token_sse2(const char * buf, size_t len) {
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *) (buf + i));
+        // The token characters, as ranges of ASCII
+        __m128i ok = in_range_sse2(x, '^', 'z');
+
+        ok = _mm_or_si128(ok, in_range_sse2(x, 'A', 'Z'));
+        ok = _mm_or_si128(ok, in_range_sse2(x, '0', '9'));
+        ok = _mm_or_si128(ok, in_range_sse2(x, '#', '\''));
+        ok = _mm_or_si128(ok, in_range_sse2(x, '*', '+'));
+        ok = _mm_or_si128(ok, in_range_sse2(x, '-', '.'));
+        ok = _mm_or_si128(ok, _mm_cmpeq_epi8(x, _mm_set1_epi8('!')));
+        ok = _mm_or_si128(ok, _mm_cmpeq_epi8(x, _mm_set1_epi8('|')));
+        ok = _mm_or_si128(ok, _mm_cmpeq_epi8(x, _mm_set1_epi8('~')));
+
+        unsigned int bad = _mm_movemask_epi8(ok) ^ 0xffff;
+
+        if (bad) {
+            return i + __builtin_ctz(bad);
+        }
+    }
+
+    return scan_token_scalar(buf, i, len);
+}
+
+static size_t scan_target_sse2(const char * buf, size_t len) {
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *) (buf + i));
+        __m128i bad = _mm_cmpeq_epi8(_mm_min_epu8(x, _mm_set1_epi8(' ')), x);
+
+        bad = _mm_or_si128(bad, _mm_cmpeq_epi8(x, _mm_set1_epi8(0x7f)));
+
+        unsigned int mask = _mm_movemask_epi8(bad);
+
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+
+    return scan_target_scalar(buf, i, len);
+}
+
+static size_t scan_field_value_sse2(const char * buf, size_t len) {
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *) (buf + i));
+        __m128i control = _mm_cmpeq_epi8(_mm_min_epu8(x, _mm_set1_epi8(0x1f)), x);
+        __m128i bad = _mm_andnot_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('\t')), control);
+
+        bad = _mm_or_si128(bad, _mm_cmpeq_epi8(x, _mm_set1_epi8(0x7f)));
+
+        unsigned int mask = _mm_movemask_epi8(bad);
+
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+
+    return scan_field_value_scalar(buf, i, len);
+}
+
+// Token characters are classified with two table lookups, one for each nibble. Every token
+// character is in 0x20-0x7f, so each of the six possible high nibbles gets a bit. The low
+// nibble table has the bits of the high nibbles that make a token character with it, so a byte
+// is a token character if the bits from its two nibbles overlap.
+static unsigned char token_lo_nibbles[16];
+static unsigned char token_hi_nibbles[16];
+static int token_nibbles_ready = 0;
+
+static void init_token_nibbles() {
+    if (token_nibbles_ready) {
+        return;
+    }
+
+    token_nibbles_ready = 1;
+
+    for (unsigned int c = 0; c < 256; c++) {
+        if (token_chars[c]) {
+            token_lo_nibbles[c & 0x0f] |= 1 << ((c >> 4) - 2);
+            token_hi_nibbles[c >> 4] = 1 << ((c >> 4) - 2);
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+static size_t scan_token_avx2(const char * buf, size_t len) {
+    __m256i lo_table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) token_lo_nibbles));
+    __m256i hi_table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) token_hi_nibbles));
+    __m256i nibble_mask = _mm256_set1_epi8(0x0f);
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *) (buf + i));
+        __m256i lo = _mm256_shuffle_epi8(lo_table, _mm256_and_si256(x, nibble_mask));
+        __m256i hi = _mm256_shuffle_epi8(hi_table, _mm256_and_si256(_mm256_srli_epi16(x, 4), nibble_mask));
+        __m256i bad = _mm256_cmpeq_epi8(_mm256_and_si256(lo, hi), _mm256_setzero_si256());
+        unsigned int mask = _mm256_movemask_epi8(bad);
+
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+
+    // Most field names are shorter than 32 bytes, so they're scanned here
+    return i + scan_token_sse2(buf + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_target_avx2(const char * buf, size_t len) {
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *) (buf + i));
+        __m256i bad = _mm256_cmpeq_epi8(_mm256_min_epu8(x, _mm256_set1_epi8(' ')), x);
+
+        bad = _mm256_or_si256(bad, _mm256_cmpeq_epi8(x, _mm256_set1_epi8(0x7f)));
+
+        unsigned int mask = _mm256_movemask_epi8(bad);
+
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+
+    return i + scan_target_sse2(buf + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_field_value_avx2(const char * buf, size_t len) {
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *) (buf + i));
+        __m256i control = _mm256_cmpeq_epi8(_mm256_min_epu8(x, _mm256_set1_epi8(0x1f)), x);
+        __m256i bad = _mm256_andnot_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('\t')), control);
+
+        bad = _mm256_or_si256(bad, _mm256_cmpeq_epi8(x, _mm256_set1_epi8(0x7f)));
+
+        unsigned int mask = _mm256_movemask_epi8(bad);
+
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+
+    return i + scan_field_value_sse2(buf + i, len - i);
+}
+#endif
+
+static size_t scan_token_from_start(const char * buf, size_t len) {
+    return scan_token_scalar(buf, 0, len);
+}
+
+static size_t scan_target_from_start(const char * buf, size_t len) {
+    return scan_target_scalar(buf, 0, len);
+}
+
+static size_t scan_field_value_from_start(const char * buf, size_t len) {
+    return scan_field_value_scalar(buf, 0, len);
+}
+
+struct scanners {
+    size_t (*token)(const char * buf, size_t len);
+    size_t (*target)(const char * buf, size_t len);
+    size_t (*field_value)(const char * buf, size_t len);
+};
+
+static const struct scanners all_scanners[NUM_SCAN_LEVELS] = {
+    [ScanScalar] = {
+        .token = scan_token_from_start,
+        .target = scan_target_from_start,
+        .field_value = scan_field_value_from_start
+    },
+#ifdef __x86_64__
+    [ScanSse2] = {
+        .token = scan_token_sse2,
+        .target = scan_target_sse2,
+        .field_value = scan_field_value_sse2
+    },
+    [ScanAvx2] = {
+        .token = scan_token_avx2,
+        .target = scan_target_avx2,
+        .field_value = scan_field_value_avx2
+    }
+#endif
+};
+
+// Only changed before the workers are started
+static enum scan_level active_level = ScanScalar;
+static const struct scanners * active = &all_scanners[ScanScalar];
+
+static int is_supported(enum scan_level level) {
+#ifdef __x86_64__
+    __builtin_cpu_init();
+
+    switch (level) {
+        case ScanScalar:
+        case ScanSse2:
+            return 1;
+        case ScanAvx2:
+            return __builtin_cpu_supports("avx2");
+    }
+#endif
+
+    return level == ScanScalar;
+}
+
+int use_scan_level(enum scan_level level) {
+    if (! is_supported(level)) {
+        return -1;
+    }
+
+#ifdef __x86_64__
+    if (level == ScanAvx2) {
+        init_token_nibbles();
+    }
+#endif
+
+    active_level = level;
+    active = &all_scanners[level];
+
+    return 0;
+}
+
+enum scan_level get_scan_level() {
+    return active_level;
+}
+
+void init_scanners() {
+    for (int level = NUM_SCAN_LEVELS - 1; level > ScanScalar; level--) {
+        if (! use_scan_level(level)) {
+            return;
+        }
+    }
+}
+
+size_t scan_token(const char * buf, size_t len) {
+    return active->token(buf, len);
+}
+
+size_t scan_target(const char * buf, size_t len) {
+    return active->target(buf, len);
+}
+
+size_t scan_field_value(const char * buf, size_t len) {
+    return active->field_value(buf, len);
+}
+
+int equals_ignore_case(const char * a, const char * b, size_t len) {
+    // Setting this bit turns upper case letters into lower case ones, and leaves digits and '-'
+    // alone
+    const uint64_t case_bits = 0x2020202020202020;
+    size_t i = 0;
+
+    for (; i + 8 <= len; i += 8) {
+        uint64_t a_word;
+        uint64_t b_word;
+
+        memcpy(&a_word, a + i, 8);
+        memcpy(&b_word, b + i, 8);
+
+        if ((a_word | case_bits) != (b_word | case_bits)) {
+            return 0;
+        }
+    }
+
+    for (; i < len; i++) {
+        if ((a[i] | 0x20) != (b[i] | 0x20)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
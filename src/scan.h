@@ -0,0 +1,61 @@
+/*
+ * This file is part of gru-http, an HTTP server.
+ * Copyright (C) 2024  Joe Desmond
+ *
+ * gru-http is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * gru-http is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with gru-http.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef SRC_SCAN_H
+#define SRC_SCAN_H
+
+#include <stddef.h>
+
+// Which instructions the scanners use. Every level finds the same bytes, later ones just look at
+// more of them at once.
+enum scan_level {
+    ScanScalar = 0,
+    // 16 bytes at a time
+    ScanSse2 = 1,
+    // 32 bytes at a time
+    ScanAvx2 = 2
+};
+
+#define NUM_SCAN_LEVELS 3
+
+extern const char * scan_level_names[NUM_SCAN_LEVELS];
+
+// Picks the fastest level that the CPU supports. Until this is called, the scalar scanners are
+// used.
+void init_scanners();
+
+// Switches to the given level. Returns nonzero (and leaves the level alone) if the CPU doesn't
+// support it.
+int use_scan_level(enum scan_level level);
+enum scan_level get_scan_level();
+
+// Each scanner returns the index of the first byte in `buf` (which is `len` bytes long) that
+// can't be part of what it's scanning, or `len` if there isn't one. The caller then checks that
+// the byte is the delimiter that it expected.
+
+// Scans a token, like a method or a field name: letters, digits and "!#$%&'*+-.^_`|~".
+size_t scan_token(const char * buf, size_t len);
+// Scans a request target, which can have any byte but spaces and control characters.
+size_t scan_target(const char * buf, size_t len);
+// Scans a field value, which can have any byte but control characters other than tab.
+size_t scan_field_value(const char * buf, size_t len);
+
+// Compares `len` bytes ignoring case, a word at a time. `a` must be a token, and `b` must only
+// have letters, digits and '-', so that no other pair of bytes compares equal.
+int equals_ignore_case(const char * a, const char * b, size_t len);
+
+#endif
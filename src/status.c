@@ -17,8 +17,11 @@
  */
 #include "status.h"
 
-const char * http_status_names[] = {
+const char * http_status_names[HTTP_STATUS_MAX] = {
     [HTTP_OK] = "OK",
+    [HTTP_PARTIAL_CONTENT] = "Partial Content",
+
+    [HTTP_NOT_MODIFIED] = "Not Modified",
 
     [HTTP_BAD_REQUEST] = "Bad Request",
     [HTTP_UNAUTHORIZED] = "Unauthorized",
@@ -26,7 +29,10 @@ const char * http_status_names[] = {
     [HTTP_FORBIDDEN] = "Forbidden",
     [HTTP_RESOURCE_NOT_FOUND] = "Resource Not Found",
     [HTTP_METHOD_NOT_ALLOWED] = "Method Not Allowed",
+    [HTTP_NOT_ACCEPTABLE] = "Not Acceptable",
     [HTTP_URI_TOO_LONG] = "URI Too Long",
+    [HTTP_RANGE_NOT_SATISFIABLE] = "Range Not Satisfiable",
+    [HTTP_REQUEST_HEADER_FIELDS_TOO_LARGE] = "Request Header Fields Too Large",
 
     [HTTP_INTERNAL_SERVER_ERROR] = "Internal Server Error",
     [HTTP_METHOD_NOT_IMPLEMENTED] = "Method Not Implemented",
@@ -20,6 +20,9 @@
 #include <stdint.h>
 
 #define HTTP_OK                             200
+#define HTTP_PARTIAL_CONTENT                206
+
+#define HTTP_NOT_MODIFIED                   304
 
 #define HTTP_BAD_REQUEST                    400
 #define HTTP_UNAUTHORIZED                   401
@@ -27,14 +30,20 @@
 #define HTTP_FORBIDDEN                      403
 #define HTTP_RESOURCE_NOT_FOUND             404
 #define HTTP_METHOD_NOT_ALLOWED             405
+#define HTTP_NOT_ACCEPTABLE                 406
 #define HTTP_URI_TOO_LONG                   414
+#define HTTP_RANGE_NOT_SATISFIABLE          416
+#define HTTP_REQUEST_HEADER_FIELDS_TOO_LARGE 431
 
 #define HTTP_INTERNAL_SERVER_ERROR          500
 #define HTTP_METHOD_NOT_IMPLEMENTED         501
 #define HTTP_VERSION_NOT_SUPPORTED          505
 
+// Every status code is less than this
+#define HTTP_STATUS_MAX                     600
+
 typedef uint16_t http_status_code;
 
-extern const char * http_status_names[];
+extern const char * http_status_names[HTTP_STATUS_MAX];
 
 #endif
@@ -0,0 +1,840 @@
+/*
+ * This file is part of gru-http, an HTTP server.
+ * Copyright (C) 2024  Joe Desmond
+ *
+ * gru-http is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * gru-http is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with gru-http.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// The io_uring backend. Every worker has its own ring and does all of its socket I/O through
+// it: a multishot accept on the shard's listen socket, receives into a ring of buffers that we
+// register with the kernel, and one SENDMSG per response. When the client doesn't want to keep
+// the connection, the send is linked to a shutdown and a close, so the whole response costs
+// one submission. Workers only make a system call when they run out of completions to handle.
+//
+// There's no liburing here. The ring is set up with the raw system calls, which keeps the
+// server free of extra dependencies.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "params.h"
+#include "error.h"
+#include "http.h"
+#include "ip.h"
+#include "log.h"
+#include "worker.h"
+
+// The buffer group ID of the receive buffers
+#define URING_BUF_GROUP     0
+
+// How long a stopping worker waits for its connections' operations to finish
+#define URING_STOP_TIMEOUT_MS   1000
+
+// The operation that a completion belongs to is kept in the low bits of its user data. The rest
+// is a pointer to the connection, which is at least 8-byte aligned.
+#define URING_OP_MASK       7
+
+enum uring_op {
+    AcceptOp = 0,
+    RecvOp = 1,
+    SendOp = 2,
+    ShutdownOp = 3,
+    CloseOp = 4,
+    StopOp = 5,
+    PollOutOp = 6
+};
+
+struct uring {
+    int fd;
+
+    unsigned sq_entries;
+    unsigned sq_mask;
+    unsigned * sq_head;
+    unsigned * sq_tail;
+    unsigned * sq_array;
+    struct io_uring_sqe * sqes;
+    // The number of SQEs that have been queued but not yet submitted
+    unsigned to_submit;
+
+    unsigned cq_mask;
+    unsigned * cq_head;
+    unsigned * cq_tail;
+    struct io_uring_cqe * cqes;
+
+    void * ring_ptr;
+    size_t ring_len;
+    size_t sqes_len;
+
+    // Receive buffers. The kernel picks one from `buf_ring` for each receive, and we put it back
+    // once we've copied the data out.
+    struct io_uring_buf_ring * buf_ring;
+    size_t buf_ring_len;
+    char * bufs;
+    uint16_t buf_tail;
+
+    int stopping;
+};
+
+// The setup flags that worked when the backend was probed
+static unsigned ring_flags = 0;
+
+static int io_uring_setup(unsigned entries, struct io_uring_params * params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void * arg, size_t arg_size) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void * arg, unsigned nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// Creates the ring and maps its queues. Returns 0 on success and -1 on failure, with errno set.
+static int setup_ring(struct uring * ring, unsigned entries, unsigned flags) {
+    struct io_uring_params params;
+
+    memset(&params, 0, sizeof params);
+    params.flags = flags | IORING_SETUP_CQSIZE;
+    params.cq_entries = entries * 4;
+
+    int fd = io_uring_setup(entries, &params);
+
+    if (fd == -1) {
+        return -1;
+    }
+
+    // We wait for completions with a timeout, which needs IORING_ENTER_EXT_ARG
+    if (! (params.features & IORING_FEAT_SINGLE_MMAP) || ! (params.features & IORING_FEAT_EXT_ARG)) {
+        close(fd);
+        errno = ENOTSUP;
+
+        return -1;
+    }
+
+    size_t sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    ring->fd = fd;
+    ring->ring_len = sq_len > cq_len ? sq_len : cq_len;
+    ring->ring_ptr = mmap(NULL, ring->ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+
+    if (ring->ring_ptr == MAP_FAILED) {
+        close(fd);
+
+        return -1;
+    }
+
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+    if (ring->sqes == MAP_FAILED) {
+        munmap(ring->ring_ptr, ring->ring_len);
+        close(fd);
+
+        return -1;
+    }
+
+    char * ptr = ring->ring_ptr;
+
+    ring->sq_entries = params.sq_entries;
+    ring->sq_mask = *(unsigned *) (ptr + params.sq_off.ring_mask);
+    ring->sq_head = (unsigned *) (ptr + params.sq_off.head);
+    ring->sq_tail = (unsigned *) (ptr + params.sq_off.tail);
+    ring->sq_array = (unsigned *) (ptr + params.sq_off.array);
+    ring->to_submit = 0;
+
+    ring->cq_mask = *(unsigned *) (ptr + params.cq_off.ring_mask);
+    ring->cq_head = (unsigned *) (ptr + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (ptr + params.cq_off.tail);
+    ring->cqes = (struct io_uring_cqe *) (ptr + params.cq_off.cqes);
+
+    // SQEs are always used in order, so the indirection array never changes
+    for (unsigned i = 0; i < ring->sq_entries; i++) {
+        ring->sq_array[i] = i;
+    }
+
+    ring->buf_ring = NULL;
+    ring->bufs = NULL;
+    ring->stopping = 0;
+
+    return 0;
+}
+
+// Gives a receive buffer back to the kernel.
+static void provide_buf(struct uring * ring, uint16_t bid) {
+    struct io_uring_buf * buf = &ring->buf_ring->bufs[ring->buf_tail & (URING_BUF_COUNT - 1)];
+
+    buf->addr = (uint64_t) (ring->bufs + (size_t) bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+
+    ring->buf_tail++;
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+// Registers the receive buffers with the kernel. Returns 0 on success and -1 on failure, with
+// errno set.
+static int setup_bufs(struct uring * ring) {
+    ring->buf_ring_len = URING_BUF_COUNT * sizeof(struct io_uring_buf);
+    // The buffer ring has to be page aligned
+    ring->buf_ring = mmap(NULL, ring->buf_ring_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (ring->buf_ring == MAP_FAILED) {
+        ring->buf_ring = NULL;
+
+        return -1;
+    }
+
+    ring->bufs = malloc((size_t) URING_BUF_COUNT * URING_BUF_SIZE);
+
+    if (! ring->bufs) {
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+
+    memset(&reg, 0, sizeof reg);
+    reg.ring_addr = (uint64_t) ring->buf_ring;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid = URING_BUF_GROUP;
+
+    if (io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        return -1;
+    }
+
+    ring->buf_tail = 0;
+
+    for (uint16_t i = 0; i < URING_BUF_COUNT; i++) {
+        provide_buf(ring, i);
+    }
+
+    return 0;
+}
+
+// Closes the ring and frees the receive buffers. The kernel cancels anything that's still in
+// flight.
+static void free_ring(struct uring * ring) {
+    munmap(ring->sqes, ring->sqes_len);
+    munmap(ring->ring_ptr, ring->ring_len);
+    close(ring->fd);
+
+    if (ring->buf_ring) {
+        munmap(ring->buf_ring, ring->buf_ring_len);
+    }
+
+    free(ring->bufs);
+}
+
+// Checks that the kernel supports every operation the backend uses.
+static int probe_ops(struct uring * ring) {
+    static const uint8_t required_ops[] = {
+        IORING_OP_ACCEPT,
+        IORING_OP_RECV,
+        IORING_OP_SENDMSG,
+        IORING_OP_SHUTDOWN,
+        IORING_OP_CLOSE,
+        IORING_OP_POLL_ADD
+    };
+    const size_t max_ops = 256;
+    struct io_uring_probe * probe = calloc(1, sizeof(struct io_uring_probe) + max_ops * sizeof(struct io_uring_probe_op));
+
+    if (! probe) {
+        return -1;
+    }
+
+    int status = io_uring_register(ring->fd, IORING_REGISTER_PROBE, probe, max_ops);
+
+    for (size_t i = 0; ! status && i < ARR_SIZE(required_ops); i++) {
+        uint8_t op = required_ops[i];
+
+        if (op > probe->last_op || ! (probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+            errno = ENOTSUP;
+            status = -1;
+        }
+    }
+
+    free(probe);
+
+    return status;
+}
+
+static int probe_uring() {
+    struct uring ring;
+
+    // Only the worker thread submits to its ring, which lets the kernel defer completion work
+    // until we ask for completions
+    ring_flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+
+    if (setup_ring(&ring, 8, ring_flags)) {
+        ring_flags = 0;
+
+        if (setup_ring(&ring, 8, ring_flags)) {
+            perror("Failed to set up io_uring");
+
+            return -1;
+        }
+    }
+
+    // Provided buffer rings came in the same kernel release as multishot accept
+    int status = probe_ops(&ring) || setup_bufs(&ring);
+
+    if (status) {
+        perror("io_uring is missing a required feature");
+    }
+
+    free_ring(&ring);
+
+    return status ? -1 : 0;
+}
+
+// Submits everything that's been queued. If `wait` is nonzero, also waits until there's at
+// least one completion or until `timeout_ms` has passed. A negative timeout waits forever.
+static void submit(struct uring * ring, int wait, int timeout_ms) {
+    struct __kernel_timespec ts = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_nsec = (timeout_ms % 1000) * 1000000
+    };
+    struct io_uring_getevents_arg arg = {
+        .sigmask = 0,
+        .sigmask_sz = _NSIG / 8,
+        .ts = timeout_ms < 0 ? 0 : (uint64_t) &ts
+    };
+    unsigned flags = wait ? IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG : 0;
+
+    int submitted = io_uring_enter(ring->fd, ring->to_submit, wait ? 1 : 0, flags, wait ? &arg : NULL, wait ? sizeof arg : 0);
+
+    if (submitted == -1) {
+        if (errno != ETIME && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            perror("Failed to submit to io_uring");
+        }
+
+        return;
+    }
+
+    ring->to_submit -= submitted;
+}
+
+// Returns a zeroed SQE that will be submitted the next time we enter the kernel. If the
+// submission queue is full, everything in it is submitted first.
+static struct io_uring_sqe * get_sqe(struct uring * ring) {
+    unsigned tail = *ring->sq_tail;
+
+    while (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->sq_entries) {
+        submit(ring, 0, 0);
+    }
+
+    struct io_uring_sqe * sqe = ring->sqes + (tail & ring->sq_mask);
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+
+    return sqe;
+}
+
+static uint64_t make_user_data(struct connection * conn, enum uring_op op) {
+    return (uint64_t) conn | op;
+}
+
+static void queue_accept(struct worker * worker, struct uring * ring) {
+    struct io_uring_sqe * sqe = get_sqe(ring);
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = worker->shard->listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = make_user_data(NULL, AcceptOp);
+}
+
+static void queue_stop_poll(struct worker * worker, struct uring * ring) {
+    struct io_uring_sqe * sqe = get_sqe(ring);
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = worker->shard->stop_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = make_user_data(NULL, StopOp);
+}
+
+// Frees the connection once it's closing and the kernel is done with it.
+static void release_connection(struct worker * worker, struct connection * conn) {
+    char print_buf[PRINT_BUF_SIZE];
+
+    if (conn->state != ClosingConnection || conn->pending_ops) {
+        return;
+    }
+
+    list_remove(&worker->closing, conn);
+
+    log_line(LogVerbose, "Closing socket");
+
+    if (! conn->fd_closed && close(conn->fd) == -1) {
+        snprintf(print_buf, PRINT_BUF_SIZE, "[Thread %d] Failed to close socket", gettid());
+        perror(print_buf);
+    }
+
+    free_connection(conn);
+    increment_counter(&worker->metrics.connections_closed);
+}
+
+// Starts closing the connection. If the kernel still has operations on the socket, shutting it
+// down makes them complete, and the connection is freed when the last one does.
+static void close_connection(struct worker * worker, struct connection * conn) {
+    if (conn->state == ClosingConnection) {
+        return;
+    }
+
+    set_connection_state(worker, conn, ClosingConnection);
+
+    if (conn->pending_ops && shutdown(conn->fd, SHUT_RDWR) == -1 && errno != ENOTCONN) {
+        perror("Failed to call 'shutdown' on socket");
+    }
+
+    release_connection(worker, conn);
+}
+
+static void queue_recv(struct worker * worker, struct uring * ring, struct connection * conn) {
+    size_t space = reserve_recv_buf(conn);
+
+    if (! space) {
+        close_connection(worker, conn);
+
+        return;
+    }
+
+    struct io_uring_sqe * sqe = get_sqe(ring);
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    // The kernel won't put more than this in the buffer it picks, so the data always fits in
+    // the receive buffer
+    sqe->len = space < URING_BUF_SIZE ? space : URING_BUF_SIZE;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->user_data = make_user_data(conn, RecvOp);
+
+    conn->pending_ops++;
+}
+
+// Sends whatever part of the response hasn't been sent yet, except for a body that has to be
+// sent with `sendfile`. If the connection isn't persistent and the whole response is in memory,
+// the socket is shut down and closed right after the send, in the same submission.
+static void queue_send(struct uring * ring, struct connection * conn) {
+    conn->msg.msg_iovlen = get_unsent_http_res(&conn->res, conn->iov);
+    conn->msg.msg_name = NULL;
+    conn->msg.msg_namelen = 0;
+    conn->msg.msg_iov = conn->iov;
+    conn->msg.msg_control = NULL;
+    conn->msg.msg_controllen = 0;
+    conn->msg.msg_flags = 0;
+
+    struct io_uring_sqe * sqe = get_sqe(ring);
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = conn->fd;
+    sqe->addr = (uint64_t) &conn->msg;
+    // Without MSG_WAITALL a send completes as soon as the socket is full, so we see that the
+    // client is making progress and can time it out when it isn't
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = make_user_data(conn, SendOp);
+
+    conn->pending_ops++;
+
+    if (conn->res.content_fd != -1) {
+        // The body follows with `sendfile`, so the head should wait for it
+        sqe->msg_flags |= MSG_MORE;
+
+        return;
+    }
+
+    if (conn->res.keep_alive) {
+        return;
+    }
+
+    sqe->flags = IOSQE_IO_LINK;
+
+    sqe = get_sqe(ring);
+    sqe->opcode = IORING_OP_SHUTDOWN;
+    sqe->fd = conn->fd;
+    sqe->len = SHUT_RDWR;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = make_user_data(conn, ShutdownOp);
+
+    sqe = get_sqe(ring);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = conn->fd;
+    sqe->user_data = make_user_data(conn, CloseOp);
+
+    conn->pending_ops += 2;
+}
+
+// Responds to the next request if we have all of it, otherwise asks for more data.
+static void serve_request(struct worker * worker, struct uring * ring, struct connection * conn) {
+    int status = parse_request(conn);
+
+    if (status == 1) {
+        set_connection_state(worker, conn, WritingResponse);
+        queue_send(ring, conn);
+    } else if (status == -1) {
+        close_connection(worker, conn);
+    } else {
+        queue_recv(worker, ring, conn);
+    }
+}
+
+// Waits for the socket to become writable again.
+static void queue_poll_out(struct uring * ring, struct connection * conn) {
+    struct io_uring_sqe * sqe = get_sqe(ring);
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = conn->fd;
+    sqe->poll32_events = POLLOUT;
+    sqe->user_data = make_user_data(conn, PollOutOp);
+
+    conn->pending_ops++;
+}
+
+// Called once the whole response has been sent. Moves on to the next request, or closes the
+// connection if it isn't persistent.
+static void finish_send(struct worker * worker, struct uring * ring, struct connection * conn) {
+    record_response(&worker->metrics, conn);
+
+    if (! finish_response(conn)) {
+        // If the close was linked to the send, it takes care of the socket. Otherwise it's
+        // closed as soon as nothing else refers to the connection.
+        set_connection_state(worker, conn, ClosingConnection);
+        release_connection(worker, conn);
+
+        return;
+    }
+
+    list_remove(&worker->sending, conn);
+    wait_for_request(worker, conn, KEEP_ALIVE_TIMEOUT_MS);
+    serve_request(worker, ring, conn);
+}
+
+// Sends as much of a file body as the socket will take. io_uring has no `sendfile`, so we call it
+// on the non-blocking socket ourselves and poll for POLLOUT when the socket is full. The data
+// still goes straight from the page cache to the socket.
+static void send_file_body(struct worker * worker, struct uring * ring, struct connection * conn) {
+    size_t bytes_sent = conn->res.bytes_sent;
+    int status = send_http_res(&conn->res, conn->fd);
+
+    if (status == 1) {
+        if (conn->res.bytes_sent != bytes_sent) {
+            extend_send_deadline(worker, conn);
+        }
+
+        queue_poll_out(ring, conn);
+    } else if (status == -1) {
+        close_connection(worker, conn);
+    } else {
+        finish_send(worker, ring, conn);
+    }
+}
+
+static void add_connection(struct worker * worker, struct uring * ring, int peer_fd) {
+    increment_counter(&worker->connections_accepted);
+
+    struct sockaddr_in peer_sock;
+    socklen_t peer_len = sizeof peer_sock;
+
+    if (log_enabled(LogVerbose) && ! getpeername(peer_fd, (struct sockaddr *) &peer_sock, &peer_len)) {
+        char * const ip_str = fmt_ipv4_addr(peer_sock.sin_addr);
+
+        if (ip_str) {
+            log_line(LogVerbose, "Accepted a connection from %s:%d", ip_str, peer_sock.sin_port);
+            free(ip_str);
+        } else {
+            log_line(LogVerbose, "IP string was null");
+        }
+    }
+
+    struct connection * conn = create_connection(peer_fd);
+
+    if (! conn) {
+        perror("Failed to allocate connection");
+        close(peer_fd);
+
+        return;
+    }
+
+    increment_counter(&worker->metrics.connections_opened);
+    wait_for_request(worker, conn, POLL_TIMEOUT_MS);
+    queue_recv(worker, ring, conn);
+}
+
+static void handle_recv(struct worker * worker, struct uring * ring, struct connection * conn, struct io_uring_cqe * cqe) {
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+        if (cqe->res > 0 && conn->state == ReadingRequest) {
+            memcpy(conn->recv_buf + conn->recv_len, ring->bufs + (size_t) bid * URING_BUF_SIZE, cqe->res);
+            commit_recv_buf(conn, cqe->res);
+        }
+
+        provide_buf(ring, bid);
+    }
+
+    if (conn->state == ClosingConnection) {
+        release_connection(worker, conn);
+    } else if (cqe->res == -ENOBUFS) {
+        // Every buffer was taken when the data came in. They're given back as soon as their
+        // completions are handled, so there will be one next time.
+        queue_recv(worker, ring, conn);
+    } else if (cqe->res <= 0) {
+        // Either the client closed its end of the connection or the receive failed
+        close_connection(worker, conn);
+    } else {
+        serve_request(worker, ring, conn);
+    }
+}
+
+static void handle_send(struct worker * worker, struct uring * ring, struct connection * conn, struct io_uring_cqe * cqe) {
+    if (conn->state == ClosingConnection) {
+        release_connection(worker, conn);
+
+        return;
+    }
+
+    if (cqe->res < 0) {
+        close_connection(worker, conn);
+
+        return;
+    }
+
+    conn->res.bytes_sent += cqe->res;
+
+    if (conn->res.bytes_sent < get_http_res_length(&conn->res)) {
+        if (cqe->res > 0) {
+            extend_send_deadline(worker, conn);
+        }
+
+        if (conn->res.content_fd != -1 && conn->res.bytes_sent >= conn->res.head_length) {
+            send_file_body(worker, ring, conn);
+        } else {
+            // A short send breaks the link, so the shutdown and close (if any) were cancelled
+            // and are queued again with the rest of the response
+            queue_send(ring, conn);
+        }
+
+        return;
+    }
+
+    finish_send(worker, ring, conn);
+}
+
+static void handle_poll_out(struct worker * worker, struct uring * ring, struct connection * conn, struct io_uring_cqe * cqe) {
+    if (conn->state == ClosingConnection) {
+        release_connection(worker, conn);
+    } else if (cqe->res < 0) {
+        close_connection(worker, conn);
+    } else {
+        send_file_body(worker, ring, conn);
+    }
+}
+
+static void close_all_connections(struct worker * worker) {
+    while (worker->waiting.head) {
+        close_connection(worker, worker->waiting.head);
+    }
+
+    while (worker->sending.head) {
+        close_connection(worker, worker->sending.head);
+    }
+}
+
+static void handle_cqe(struct worker * worker, struct uring * ring, struct io_uring_cqe * cqe) {
+    enum uring_op op = cqe->user_data & URING_OP_MASK;
+    struct connection * conn = (struct connection *) (cqe->user_data & ~((uint64_t) URING_OP_MASK));
+
+    switch (op) {
+        case AcceptOp: {
+            if (cqe->res >= 0) {
+                if (ring->stopping) {
+                    close(cqe->res);
+                } else {
+                    add_connection(worker, ring, cqe->res);
+                }
+            } else if (cqe->res != -ECANCELED) {
+                errno = -cqe->res;
+                perror("Failed to accept connection");
+            }
+
+            // The kernel stops a multishot accept when it runs into an error
+            if (! (cqe->flags & IORING_CQE_F_MORE) && ! ring->stopping) {
+                queue_accept(worker, ring);
+            }
+
+            break;
+        }
+        case RecvOp: {
+            conn->pending_ops--;
+            handle_recv(worker, ring, conn, cqe);
+            break;
+        }
+        case SendOp: {
+            conn->pending_ops--;
+            handle_send(worker, ring, conn, cqe);
+            break;
+        }
+        case PollOutOp: {
+            conn->pending_ops--;
+            handle_poll_out(worker, ring, conn, cqe);
+            break;
+        }
+        case ShutdownOp: {
+            conn->pending_ops--;
+            release_connection(worker, conn);
+            break;
+        }
+        case CloseOp: {
+            conn->pending_ops--;
+
+            if (! cqe->res) {
+                conn->fd_closed = 1;
+            }
+
+            release_connection(worker, conn);
+            break;
+        }
+        case StopOp: {
+            ring->stopping = 1;
+            close_all_connections(worker);
+            break;
+        }
+    }
+}
+
+// Handles every completion that's ready.
+static void reap_completions(struct worker * worker, struct uring * ring) {
+    unsigned head = *ring->cq_head;
+
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe cqe = ring->cqes[head & ring->cq_mask];
+
+        // Free up the slot before handling the completion, which may queue more operations
+        head++;
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+        handle_cqe(worker, ring, &cqe);
+    }
+}
+
+// Drops connections whose clients haven't sent a request, or taken any more of a response, in
+// time. Returns the number of milliseconds until the next connection's deadline, or -1 if no
+// connection has one.
+static int expire_connections(struct worker * worker) {
+    uint64_t now = now_ms();
+
+    while (worker->waiting.head && worker->waiting.head->deadline_ms <= now) {
+        log_line(LogVerbose, "Timed out while waiting for request");
+        close_connection(worker, worker->waiting.head);
+    }
+
+    while (worker->sending.head && worker->sending.head->deadline_ms <= now) {
+        log_line(LogVerbose, "Timed out while sending response");
+        close_connection(worker, worker->sending.head);
+    }
+
+    return get_next_timeout(worker, now);
+}
+
+static void * run_uring_worker(void * worker_ptr) {
+    struct worker * worker = worker_ptr;
+    struct uring * ring = worker->backend_data;
+
+    name_worker_thread(worker);
+
+    // The ring has to be created on the thread that submits to it
+    if (setup_ring(ring, URING_ENTRIES, ring_flags) || setup_bufs(ring)) {
+        die();
+    }
+
+    queue_accept(worker, ring);
+    queue_stop_poll(worker, ring);
+    register_static_reader(&worker->reader);
+
+    uint64_t stop_deadline = 0;
+
+    while (1) {
+        int timeout;
+
+        if (ring->stopping) {
+            uint64_t now = now_ms();
+
+            if (! stop_deadline) {
+                stop_deadline = now + URING_STOP_TIMEOUT_MS;
+            }
+
+            if (! worker->closing.head || now >= stop_deadline) {
+                break;
+            }
+
+            timeout = stop_deadline - now;
+        } else {
+            timeout = expire_connections(worker);
+        }
+
+        static_reader_offline(&worker->reader);
+        uint64_t wait_start_ns = now_ns();
+        submit(ring, 1, timeout);
+        record_latency(&worker->metrics.latency[PhaseWait], now_ns() - wait_start_ns);
+        static_reader_online(&worker->reader);
+        reap_completions(worker, ring);
+    }
+
+    if (worker->closing.head) {
+        // The kernel may still be using these connections' buffers, so they're leaked rather
+        // than freed. This only happens if a client stops reading during shutdown.
+        printf("Worker %zu.%zu gave up on some connections while shutting down\n", worker->shard->index, worker->index);
+    }
+
+    unregister_static_reader(&worker->reader);
+    free_ring(ring);
+
+    return NULL;
+}
+
+static void init_uring_worker(struct worker * worker) {
+    struct uring * ring = calloc(1, sizeof(struct uring));
+
+    if (! ring) {
+        die();
+    }
+
+    worker->backend_data = ring;
+}
+
+static void free_uring_worker(struct worker * worker) {
+    free(worker->backend_data);
+    worker->backend_data = NULL;
+}
+
+const struct net_backend uring_backend = {
+    .name = "io_uring",
+    .uses_acceptor = 0,
+    .probe = probe_uring,
+    .init_worker = init_uring_worker,
+    .run_worker = run_uring_worker,
+    .free_worker = free_uring_worker
+};
@@ -0,0 +1,414 @@
+/*
+ * This file is part of gru-http, an HTTP server.
+ * Copyright (C) 2024  Joe Desmond
+ *
+ * gru-http is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * gru-http is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with gru-http.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "params.h"
+#include "conn.h"
+#include "error.h"
+#include "files.h"
+#include "watch.h"
+
+// Everything that can change the set of files in a directory or a file's contents. Metadata
+// changes are ignored. IN_DELETE_SELF and IN_MOVE_SELF are reported by the parent directory.
+#define WATCH_MASK  (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+// The paths that have changed since the last snapshot was built. A path that names a directory
+// covers everything under it, and the empty path is the root.
+struct change_set {
+    char * paths[WATCH_MAX_CHANGES];
+    size_t len;
+    // When the first change came in, on the monotonic clock
+    uint64_t first_ms;
+};
+
+static int inotify_fd = -1;
+static int stop_fd = -1;
+static pthread_t watcher;
+
+// The served path of every watched directory, indexed by watch descriptor. The loader threads
+// add to this while the watcher thread waits for them, so it needs a lock.
+static pthread_mutex_t watches_lock = PTHREAD_MUTEX_INITIALIZER;
+static char ** watches = NULL;
+static size_t watches_cap = 0;
+
+void init_static_watcher() {
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+    if (inotify_fd == -1) {
+        die();
+    }
+
+    stop_fd = eventfd(0, EFD_CLOEXEC);
+
+    if (stop_fd == -1) {
+        die();
+    }
+}
+
+void add_dir_watch(const char * path, size_t path_len) {
+    if (inotify_fd == -1) {
+        return;
+    }
+
+    char full_path[PATH_MAX * 2];
+
+    snprintf(full_path, sizeof full_path, "%s%s", static_files.root, path);
+
+    int wd = inotify_add_watch(inotify_fd, full_path, WATCH_MASK);
+
+    if (wd == -1) {
+        printf("Failed to watch %s for changes\n", full_path);
+
+        return;
+    }
+
+    char * path_copy = strdup(path);
+
+    if (! path_copy) {
+        die();
+    }
+
+    pthread_mutex_lock(&watches_lock);
+
+    if ((size_t) wd >= watches_cap) {
+        size_t new_cap = watches_cap ? watches_cap : 64;
+
+        while (new_cap <= (size_t) wd) {
+            new_cap *= 2;
+        }
+
+        char ** new_watches = realloc(watches, new_cap * sizeof(char *));
+
+        if (! new_watches) {
+            die();
+        }
+
+        memset(new_watches + watches_cap, 0, (new_cap - watches_cap) * sizeof(char *));
+        watches = new_watches;
+        watches_cap = new_cap;
+    }
+
+    // Watching the same directory twice gives back the same descriptor
+    free(watches[wd]);
+    watches[wd] = path_copy;
+
+    pthread_mutex_unlock(&watches_lock);
+}
+
+// Returns nonzero if `path` is `change` or is somewhere under it.
+static int is_covered(const char * path, const char * change) {
+    size_t change_len = strlen(change);
+
+    return ! strncmp(path, change, change_len) && (path[change_len] == 0 || path[change_len] == '/');
+}
+
+static int is_covered_by_set(const char * path, const struct change_set * changes) {
+    for (size_t i = 0; i < changes->len; i++) {
+        if (is_covered(path, changes->paths[i])) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void clear_changes(struct change_set * changes) {
+    for (size_t i = 0; i < changes->len; i++) {
+        free(changes->paths[i]);
+    }
+
+    changes->len = 0;
+}
+
+static void add_change(struct change_set * changes, const char * path) {
+    if (! changes->len) {
+        changes->first_ms = now_ms();
+    }
+
+    for (size_t i = 0; i < changes->len; i++) {
+        if (! strcmp(changes->paths[i], path)) {
+            return;
+        }
+    }
+
+    if (changes->len == WATCH_MAX_CHANGES) {
+        // Too much has changed to be worth tracking, so everything is reloaded
+        clear_changes(changes);
+        path = "";
+    }
+
+    changes->paths[changes->len] = strdup(path);
+
+    if (! changes->paths[changes->len]) {
+        die();
+    }
+
+    changes->len++;
+}
+
+// Stops watching the directories under `path`, which are about to be scanned again or are gone.
+// If a directory was moved somewhere else under the root, its watch would otherwise keep
+// reporting changes under its old path.
+static void remove_dir_watches(const char * path) {
+    pthread_mutex_lock(&watches_lock);
+
+    for (size_t wd = 0; wd < watches_cap; wd++) {
+        if (watches[wd] && is_covered(watches[wd], path)) {
+            inotify_rm_watch(inotify_fd, wd);
+            free(watches[wd]);
+            watches[wd] = NULL;
+        }
+    }
+
+    pthread_mutex_unlock(&watches_lock);
+}
+
+// Builds a snapshot with the current version of every changed path and every unchanged file from
+// the current snapshot, and swaps it in.
+static void apply_changes(struct change_set * changes) {
+    // A path that's covered by another one would be loaded twice
+    for (size_t i = 0; i < changes->len; i++) {
+        for (size_t j = 0; j < changes->len; j++) {
+            if (i != j && is_covered(changes->paths[i], changes->paths[j])) {
+                free(changes->paths[i]);
+                changes->paths[i--] = changes->paths[--changes->len];
+
+                break;
+            }
+        }
+    }
+
+    // Only this thread swaps snapshots, so the current one can't go away under us
+    struct static_snapshot * old = atomic_load(&static_files.snapshot);
+    struct file_array files = { 0 };
+
+    for (size_t i = 0; i <= old->index_mask; i++) {
+        struct file * file = old->index[i].file;
+
+        if (file && ! is_covered_by_set(file->path, changes)) {
+            atomic_fetch_add_explicit(&file->refs, 1, memory_order_relaxed);
+            push_file(&files, file);
+        }
+    }
+
+    size_t num_unchanged = files.len;
+
+    for (size_t i = 0; i < changes->len; i++) {
+        const char * path = changes->paths[i];
+        struct stat statbuf;
+
+        remove_dir_watches(path);
+
+        if (fstatat(static_files.root_fd, path[0] ? path + 1 : ".", &statbuf, 0) == -1) {
+            // It's gone
+            continue;
+        }
+
+        if (S_ISDIR(statbuf.st_mode)) {
+            load_static_tree(path, strlen(path), &files);
+        } else if (S_ISREG(statbuf.st_mode)) {
+            struct file * file = load_static_file(path, strlen(path));
+
+            if (file) {
+                push_file(&files, file);
+            }
+        }
+    }
+
+    printf(
+        "Reloaded %zu changed path(s): %zu file(s) loaded, %zu unchanged\n",
+        changes->len,
+        files.len - num_unchanged,
+        num_unchanged
+    );
+
+    swap_static_snapshot(create_static_snapshot(&files));
+    clear_changes(changes);
+}
+
+// Records a change to `path`. A precompressed file belongs to the file that it's a version of,
+// so that file changes too.
+static void add_path_change(struct change_set * changes, char * path, size_t path_len) {
+    add_change(changes, path);
+
+    if (path_len > 3 && (! strcmp(path + path_len - 3, ".gz") || ! strcmp(path + path_len - 3, ".br"))) {
+        path[path_len - 3] = 0;
+        add_change(changes, path);
+    }
+}
+
+// Reads every pending event and records the paths that they're about.
+static void read_events(struct change_set * changes) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    char path[PATH_MAX];
+
+    while (1) {
+        ssize_t len = read(inotify_fd, buf, sizeof buf);
+
+        if (len == -1) {
+            if (errno != EAGAIN && errno != EINTR) {
+                perror("Failed to read inotify events");
+            }
+
+            if (errno != EINTR) {
+                return;
+            }
+
+            continue;
+        }
+
+        for (char * ptr = buf; ptr < buf + len; ptr += sizeof(struct inotify_event) + ((struct inotify_event *) ptr)->len) {
+            const struct inotify_event * event = (const struct inotify_event *) ptr;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                // Some events were lost, so we don't know what changed
+                add_change(changes, "");
+
+                continue;
+            }
+
+            pthread_mutex_lock(&watches_lock);
+
+            const char * dir = event->wd >= 0 && (size_t) event->wd < watches_cap ? watches[event->wd] : NULL;
+
+            if (event->mask & IN_IGNORED) {
+                // The directory is gone, or we stopped watching it
+                if (dir) {
+                    free(watches[event->wd]);
+                    watches[event->wd] = NULL;
+                }
+            } else if (dir && event->len) {
+                int path_len = snprintf(path, sizeof path, "%s/%s", dir, event->name);
+
+                if (path_len > 0 && (size_t) path_len < sizeof path) {
+                    add_path_change(changes, path, path_len);
+                }
+            }
+
+            pthread_mutex_unlock(&watches_lock);
+        }
+    }
+}
+
+static void * run_watcher(void * arg) {
+    struct change_set changes = { .len = 0 };
+    struct pollfd fds[2] = {
+        {
+            .fd = inotify_fd,
+            .events = POLLIN
+        },
+        {
+            .fd = stop_fd,
+            .events = POLLIN
+        }
+    };
+
+    int setname_result = pthread_setname_np(pthread_self(), "watcher");
+
+    if (setname_result) {
+        perror("Failed to set watcher thread name");
+    }
+
+    while (1) {
+        int timeout = -1;
+
+        // Changes are applied a little while after the first one comes in, so that a deploy
+        // that touches many files builds only one snapshot
+        if (changes.len) {
+            uint64_t elapsed = now_ms() - changes.first_ms;
+
+            timeout = elapsed < WATCH_DELAY_MS ? WATCH_DELAY_MS - elapsed : 0;
+        }
+
+        int num_ready = poll(fds, 2, timeout);
+
+        if (num_ready == -1) {
+            if (errno != EINTR) {
+                perror("Failed to wait for inotify events");
+            }
+
+            continue;
+        }
+
+        if (fds[1].revents) {
+            break;
+        }
+
+        if (fds[0].revents) {
+            read_events(&changes);
+        }
+
+        if (changes.len && now_ms() - changes.first_ms >= WATCH_DELAY_MS) {
+            apply_changes(&changes);
+        }
+    }
+
+    clear_changes(&changes);
+
+    return NULL;
+}
+
+void start_static_watcher() {
+    if (inotify_fd == -1) {
+        return;
+    }
+
+    if (pthread_create(&watcher, NULL, run_watcher, NULL)) {
+        die();
+    }
+}
+
+void stop_static_watcher() {
+    if (inotify_fd == -1) {
+        return;
+    }
+
+    uint64_t stop = 1;
+
+    if (write(stop_fd, &stop, sizeof stop) == -1) {
+        die();
+    }
+
+    if (pthread_join(watcher, NULL)) {
+        die();
+    }
+
+    close(inotify_fd);
+    close(stop_fd);
+    inotify_fd = -1;
+    stop_fd = -1;
+
+    for (size_t wd = 0; wd < watches_cap; wd++) {
+        free(watches[wd]);
+    }
+
+    free(watches);
+    watches = NULL;
+    watches_cap = 0;
+}
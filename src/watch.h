@@ -0,0 +1,41 @@
+/*
+ * This file is part of gru-http, an HTTP server.
+ * Copyright (C) 2024  Joe Desmond
+ *
+ * gru-http is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * gru-http is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with gru-http.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef SRC_WATCH_H
+#define SRC_WATCH_H
+
+#include <stddef.h>
+
+// The watcher keeps the static files fresh without ever touching the disk on the request path.
+// It watches every directory under the root with inotify, and when something changes, it loads
+// the files that changed on its own thread, builds a new snapshot that shares every other file
+// with the current one, and swaps it in. Responses that are already being sent keep the version
+// they started with, which only keeps its old content if the file was replaced by a rename.
+
+// Sets up the inotify instance. This has to be called before the static directory is loaded,
+// so that directories are watched as they're scanned. Without it, the files are never reloaded.
+void init_static_watcher();
+
+// Starts watching the directory served at `path`. Called by the loader threads for every
+// directory that they scan. Does nothing if the watcher hasn't been set up.
+void add_dir_watch(const char * path, size_t path_len);
+
+// Starts the watcher thread, if the watcher has been set up.
+void start_static_watcher();
+void stop_static_watcher();
+
+#endif
@@ -0,0 +1,83 @@
+/*
+ * This file is part of gru-http, an HTTP server.
+ * Copyright (C) 2024  Joe Desmond
+ *
+ * gru-http is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * gru-http is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with gru-http.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include "params.h"
+#include "worker.h"
+
+void name_worker_thread(struct worker * worker) {
+    char thread_name[16];
+
+    snprintf(thread_name, 16, "worker %d.%d", (uint8_t) worker->shard->index, (uint8_t) worker->index);
+    int setname_result = pthread_setname_np(pthread_self(), thread_name);
+
+    if (setname_result) {
+        perror("Failed to set worker thread name");
+    }
+}
+
+struct connection_list * list_for_state(struct worker * worker, enum connection_state state) {
+    if (state == ReadingRequest) {
+        return &worker->waiting;
+    }
+
+    if (state == WritingResponse) {
+        return &worker->sending;
+    }
+
+    return &worker->closing;
+}
+
+void set_connection_state(struct worker * worker, struct connection * conn, enum connection_state state) {
+    list_remove(list_for_state(worker, conn->state), conn);
+    conn->state = state;
+
+    // Every send deadline is the same time from now, so the list stays sorted
+    if (state == WritingResponse) {
+        conn->deadline_ms = now_ms() + SEND_TIMEOUT_MS;
+    }
+
+    list_push_back(list_for_state(worker, conn->state), conn);
+}
+
+void extend_send_deadline(struct worker * worker, struct connection * conn) {
+    list_remove(&worker->sending, conn);
+    conn->deadline_ms = now_ms() + SEND_TIMEOUT_MS;
+    list_push_back(&worker->sending, conn);
+}
+
+int get_next_timeout(struct worker * worker, uint64_t now) {
+    struct connection * next = worker->waiting.head;
+
+    if (worker->sending.head && (! next || worker->sending.head->deadline_ms < next->deadline_ms)) {
+        next = worker->sending.head;
+    }
+
+    if (! next) {
+        return -1;
+    }
+
+    return next->deadline_ms > now ? next->deadline_ms - now : 0;
+}
+
+void wait_for_request(struct worker * worker, struct connection * conn, uint64_t timeout_ms) {
+    conn->state = ReadingRequest;
+    conn->deadline_ms = now_ms() + timeout_ms;
+    list_insert_by_deadline(&worker->waiting, conn);
+}
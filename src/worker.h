@@ -0,0 +1,126 @@
+/*
+ * This file is part of gru-http, an HTTP server.
+ * Copyright (C) 2024  Joe Desmond
+ *
+ * gru-http is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * gru-http is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with gru-http.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#ifndef SRC_WORKER_H
+#define SRC_WORKER_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include "conn.h"
+#include "files.h"
+#include "metrics.h"
+#include "queue.h"
+
+// A worker is a long-lived thread that runs an event loop. It owns a set of connections and
+// multiplexes them with one of the I/O backends. Each connection is a small state machine that
+// is advanced whenever the backend can make progress on its socket.
+struct worker {
+    pthread_t thread;
+    size_t index;
+    struct shard * shard;
+    // Owned by the backend
+    void * backend_data;
+
+    // Connections waiting for a request, ordered by deadline
+    struct connection_list waiting;
+    // Connections that are sending a response, ordered by deadline
+    struct connection_list sending;
+    // Connections that are being closed
+    struct connection_list closing;
+
+    // The worker goes offline whenever it waits for I/O, so that it never holds up the swap of
+    // a static file snapshot
+    struct static_reader reader;
+
+    // Only written by the worker, but read by the main thread when it prints stats and by any
+    // worker that serves the metrics
+    struct worker_metrics metrics;
+    // Connections accepted by the worker itself, for backends without an acceptor thread
+    atomic_size_t connections_accepted;
+};
+
+// A shard is a listen socket with its own workers, and for backends that need one, its own
+// acceptor thread. With more than one shard, every listen socket is bound to the same address
+// with SO_REUSEPORT and the kernel spreads incoming connections across them. Each shard's
+// threads are pinned to one CPU.
+struct shard {
+    size_t index;
+    // The CPU that the shard's threads are pinned to, or -1
+    int cpu;
+    int listen_fd;
+    // Becomes readable when the acceptors and workers should stop
+    int stop_fd;
+    pthread_t acceptor;
+
+    struct worker * workers;
+    size_t num_workers;
+
+    // Accepted sockets that haven't been picked up by a worker yet
+    struct fd_queue accept_queue;
+    // A semaphore eventfd that counts the sockets in `accept_queue`. Every worker waits on it
+    // with EPOLLEXCLUSIVE, so each new connection wakes one idle worker instead of all of
+    // them.
+    int accept_fd;
+
+    // Only written by the acceptor
+    atomic_size_t connections_accepted;
+};
+
+// An I/O backend drives the workers' connections. The rest of the server (shards, stats,
+// shutdown) doesn't care which one is in use.
+struct net_backend {
+    const char * name;
+    // Nonzero if the shard should run an acceptor thread that hands sockets to the workers
+    // through the accept queue. Otherwise the workers accept connections themselves.
+    int uses_acceptor;
+    // Returns 0 if the backend can be used on this system.
+    int (*probe)();
+    // Prepares a worker before its thread is started. Called on the main thread.
+    void (*init_worker)(struct worker * worker);
+    // The worker thread's entry point. Returns once the shard's `stop_fd` becomes readable and
+    // every connection has been closed.
+    void * (*run_worker)(void * worker);
+    // Frees whatever `init_worker` and `run_worker` left behind, after the thread has been
+    // joined.
+    void (*free_worker)(struct worker * worker);
+};
+
+extern const struct net_backend epoll_backend;
+extern const struct net_backend uring_backend;
+
+// Sets the worker thread's name to "worker <shard>.<index>".
+void name_worker_thread(struct worker * worker);
+
+// Returns the list that the worker keeps connections in the given state in.
+struct connection_list * list_for_state(struct worker * worker, enum connection_state state);
+
+// Moves the connection to the list for its new state. A connection that starts sending a
+// response gets SEND_TIMEOUT_MS to take some of it.
+void set_connection_state(struct worker * worker, struct connection * conn, enum connection_state state);
+
+// Starts the sending connection's timeout over, after some of the response was sent.
+void extend_send_deadline(struct worker * worker, struct connection * conn);
+
+// Returns the number of milliseconds from `now` until the next waiting or sending connection's
+// deadline, or -1 if there are none.
+int get_next_timeout(struct worker * worker, uint64_t now);
+
+// Puts the connection in the worker's waiting list and gives the client `timeout_ms` to send a
+// request. The connection must not be in a list already.
+void wait_for_request(struct worker * worker, struct connection * conn, uint64_t timeout_ms);
+
+#endif